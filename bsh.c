@@ -36,7 +36,9 @@
  * - `PRECEDENCE`: An integer determining its binding strength.
  * - `ASSOC`: Associativity (Left, Right, or Non-associative).
  * - `HANDLER`: The name of a BSH function that implements the
- * operator's logic.
+ * operator's logic, or `native:<lib_alias>:<symbol>` to bind it
+ * directly to a function in a `loadlib`-loaded C library (same
+ * signature as for `calllib`), skipping the BSH function call.
  * - The C core's tokenizer learns these operator symbols, and its expression
  * parser uses these properties to correctly interpret expressions.
  *
@@ -67,18 +69,34 @@
  *
  * 5.  **Structured Data Handling (`object:` prefix & `echo` stringification):**
  * - Command output prefixed with `object:` (e.g., `object:["key":"val"]`)
- * is automatically parsed by the C core when assigned to a variable.
- * - The C core "flattens" this structure into a set of BSH variables
- * (e.g., `$myobj_key = "val"`), marked with a metadata variable
- * (e.g., `$myobj_BSH_STRUCT_TYPE = "BSH_OBJECT_ROOT"`).
+ * is automatically parsed by the C core when assigned to a variable
+ * (`capture $var command args...` stores a command's complete output;
+ * `cmd1 | cmd2 | ...` pipes external commands directly, recording each
+ * stage's exit status in `$PIPESTATUS[n]` and `$PIPESTATUS_COUNT`;
+ * `cmd args &` runs a command or function call in the background as job
+ * `$LAST_JOB_ID`, managed with `jobs`, `wait` and `wait <id>`;
+ * `parallel_map` fans a function, command or native call out over an array).
+ * - Output prefixed with `json:` is parsed as JSON into the same tree: arrays
+ * are keyed "0", "1", ..., numbers keep their text, and true/false/null
+ * become those words (e.g., `$doc.items.0.id`).
+ * - `foreach_record <file|-|command args...> $rec { ... }` streams JSON-lines
+ * input one record at a time: each line is parsed into `$rec`, and the
+ * record and anything the body assigns are released before the next line.
+ * - The C core parses this structure into a tree (BshObject) attached to the
+ * variable. The older flattened names (e.g., `$myobj_key`, and the marker
+ * `$myobj_BSH_STRUCT_TYPE = "BSH_OBJECT_ROOT"`) still read from that tree.
  * - The `echo` command, when given a variable representing such a BSH object,
  * will automatically "stringify" it back into the `object:[...]` format.
  * - This allows BSH scripts and external commands to exchange structured data.
  *
  * 6.  **Variable Property Access (Dot Notation - C Core):**
  * - The C core's variable expansion logic (`expand_variables_in_string_advanced`)
- * directly supports dot notation for accessing properties of these flattened
- * BSH objects (e.g., `$myobj.user.name` resolves to `myobj_user_name`).
+ * directly supports dot notation for accessing properties of these BSH
+ * objects (e.g., `$myobj.user.name` walks the tree: myobj -> user -> name).
+ * - `$arr[i]` with a numeric index reads a native array (a vector of strings,
+ * see BshArray); `array_length`, `array_push`, `array_pop` and `array_slice`
+ * operate on it. Other keys ("007", "name"), indexes far past the end, and
+ * `$arr_ARRAYIDX_i` reads keep the older per-element variable form working.
  *
  * 7.  **Dynamic C Library Integration (`def_c_lib`, `loadlib`, `calllib`):**
  * - BSH scripts (e.g., `c_compiler.bsh`) can provide functions like
@@ -99,6 +117,23 @@
  * defined in the `BSH_MODULE_PATH` environment variable, facilitating
  * code organization and reuse.
  *
+ * 10. **Execution Engines (`--engine=vm|line`):**
+ * - `vm`: scripts and function bodies are compiled once into a
+ * `BytecodeProgram`. Block structure (if/else/while/defunc) becomes
+ * instructions with resolved jump targets, and expressions are lowered to a
+ * postfix `ExprCode` run on a small value stack.
+ * - `line` (default): the original interpreter, which tokenizes and dispatches each
+ * line as it is read. It remains the fallback for anything the compiler
+ * rejects and always drives the interactive prompt.
+ * - Imports and the startup script are cached in `.bshc` files (under
+ * `$BSH_CACHE_DIR`, default `~/.bsh_cache`): trimmed lines, the compiled
+ * program and token streams, keyed on path, mtime, size and content hash.
+ * Stale or unreadable entries are ignored and rewritten.
+ * - `--snapshot-save FILE` writes the interpreter state after startup
+ * (libraries, operators, keyword aliases, functions, globals);
+ * `--snapshot-load FILE` maps it back instead of running `initialize_shell`
+ * and the startup script.
+ *
  * === Tokenization (`advanced_tokenize_line`) ===
  * - Produces a stream of `Token` structs, including line/column info.
  * - `TokenType` is minimal: `TOKEN_WORD`, `TOKEN_STRING`, `TOKEN_NUMBER`,
@@ -118,11 +153,25 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <limits.h>
 #include <libgen.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h> // JSON string scanning, 16 bytes at a time
+#endif
+
+extern char **environ;
 
 // --- Constants and Definitions ---
 #define MAX_LINE_LENGTH 2048
@@ -130,6 +179,7 @@
 #define MAX_VAR_NAME_LEN 256
 #define INPUT_BUFFER_SIZE 4096
 #define MAX_FULL_PATH_LEN 1024
+#define MAX_PIPELINE_STAGES 16
 #ifndef PATH_MAX
     #ifdef _XOPEN_PATH_MAX
         #define PATH_MAX _XOPEN_PATH_MAX
@@ -148,7 +198,7 @@
 #define DEFAULT_MODULE_PATH "./framework:~/.bsh_framework:/usr/local/share/bsh/framework"
 #define MAX_EXPRESSION_TOKENS MAX_ARGS // Max tokens in a single expression to be parsed
 
-#define JSON_STDOUT_PREFIX "json:" // json are not managed (?)
+#define JSON_STDOUT_PREFIX "json:"
 #define OBJECT_STDOUT_PREFIX "object:"
 
 // --- Tokenizer Types (Simplified) ---
@@ -166,6 +216,8 @@ typedef enum {
     TOKEN_LBRACKET,     // [
     TOKEN_RBRACKET,     // ]
     TOKEN_SEMICOLON,    // ;
+    TOKEN_PIPE,         // | between pipeline stages (unless a defined operator matches)
+    TOKEN_AMPERSAND,    // & ending a command that runs in the background (same rule)
     TOKEN_ASSIGN,       // = (could also be TOKEN_OPERATOR if fully dynamic)
     TOKEN_COMMENT,      // #...
     TOKEN_EOF,          // End of input
@@ -173,6 +225,8 @@ typedef enum {
     // TOKEN_QMARK, TOKEN_COLON removed, will be TOKEN_OPERATOR
 } TokenType;
 
+struct OperatorDefinition;
+
 typedef struct {
     TokenType type;
     const char *text; // Points into the token_storage buffer or original line
@@ -180,9 +234,28 @@ typedef struct {
     int line;         // Line number of the token
     int col;          // Column number of the token
     // Precedence and associativity are properties of OPERATORS, not tokens themselves.
-    // They will be looked up from OperatorDefinition when a TOKEN_OPERATOR is encountered.
+    // The tokenizer resolves a TOKEN_OPERATOR's definitions (NULL otherwise): the variant
+    // used where an operand is expected, and the one used after an operand.
+    struct OperatorDefinition *prefix_op;
+    struct OperatorDefinition *infix_op; // Binary, postfix or ternary
 } Token;
 
+// A source line together with its cached token stream. Token texts point into
+// 'token_storage', which is owned by the line. Tokenization depends on the set of
+// defined operators, so the cache is tagged with the operator epoch it was built
+// under and is stale once any 'defoperator' runs. Likewise the user function a command
+// line calls is cached until any function is (re)defined.
+typedef struct TokenizedLine {
+    const char *text;      // Trimmed source line (not owned)
+    Token *tokens;
+    int num_tokens;
+    char *token_storage;
+    unsigned long op_epoch;
+    uint64_t op_signature; // operator_symbol_signature the tokens were split under
+    struct UserFunction *call_target; // Function named by tokens[0] (NULL: not a function)
+    unsigned long call_epoch;         // function_table_epoch call_target was resolved under
+} TokenizedLine;
+
 // --- Operator Definition (Dynamic List) ---
 typedef enum {
     OP_TYPE_NONE,
@@ -204,24 +277,72 @@ typedef enum {
     ASSOC_RIGHT
 } OperatorAssociativity;
 
+// Signature of C library functions callable via calllib or as native operator handlers.
+typedef int (*BshLibFunction)(int argc, char *argv[], char *output_buffer, int buffer_size);
+
 typedef struct OperatorDefinition {
     char op_str[MAX_OPERATOR_LEN + 1];
     TokenType token_type; // Will usually be TOKEN_OPERATOR, but can map to others if needed
     OperatorType op_type_prop; // The new type property (unary, binary, etc.)
     int precedence;
     OperatorAssociativity associativity;
-    char bsh_handler_name[MAX_VAR_NAME_LEN]; // BSH function to call
+    char bsh_handler_name[MAX_VAR_NAME_LEN]; // BSH function to call (or the "native:lib:sym" spec)
+    BshLibFunction native_handler; // Set for "native:" handlers; called instead of a BSH function
+    struct UserFunction *handler_func; // Resolved BSH handler, valid while handler_epoch is current
+    unsigned long handler_epoch;
     struct OperatorDefinition *next;
 } OperatorDefinition;
 OperatorDefinition *operator_list_head = NULL;
-
-// --- Keyword Aliasing (Dynamic List) ---
-typedef struct KeywordAlias {
-    char original[MAX_KEYWORD_LEN + 1];
-    char alias[MAX_KEYWORD_LEN + 1];
-    struct KeywordAlias *next;
-} KeywordAlias;
-KeywordAlias *keyword_alias_head = NULL;
+unsigned long operator_table_epoch = 1; // Bumped on every (re)definition; invalidates cached token streams
+
+// Longest-match trie over all operator symbols, rebuilt by add_operator_definition.
+// A symbol may have one prefix variant and one infix/postfix variant (e.g. "-", "++").
+#define OPERATOR_TRIE_FANOUT 256
+#define MAX_OPERATOR_TRIE_NODES 4096
+typedef struct OperatorTrieNode {
+    unsigned short child[OPERATOR_TRIE_FANOUT]; // Node index per next byte; 0 = none (root is never a child)
+    OperatorDefinition *prefix_op;
+    OperatorDefinition *infix_op;
+} OperatorTrieNode;
+OperatorTrieNode *operator_trie = NULL;
+int operator_trie_node_count = 0;
+int operator_trie_capacity = 0;
+// FNV-1a chain over the operator symbols, in definition-list order. Token boundaries
+// depend only on the symbols, so a line tokenized under the same signature only needs
+// its definitions re-resolved.
+uint64_t operator_symbol_signature = 0;
+// FNV-1a chain over every definition (symbol, type, precedence, associativity,
+// handler) in list order; part of the .bshc cache key.
+uint64_t operator_definition_signature = 0;
+
+// --- Builtin Commands and Keyword Aliases (Hash Table) ---
+// Builtins register once in builtin_commands[]. The keyword table maps every word
+// that starts a command, builtin names and 'defkeyword' aliases alike, to what it
+// resolves to and the builtin that runs, so a line needs one lookup for both.
+typedef void (*BuiltinHandler)(Token *tokens, int num_tokens);
+typedef void (*BuiltinBlockHandler)(Token *tokens, int num_tokens, FILE *input_source, int current_line_no);
+
+typedef struct BuiltinCommand {
+    const char *name;
+    BuiltinHandler handler;            // Plain statements
+    BuiltinBlockHandler block_handler; // if/else/while also need the input source and line number
+} BuiltinCommand;
+
+typedef struct KeywordEntry {
+    char word[MAX_KEYWORD_LEN + 1];     // Empty: free slot
+    char original[MAX_KEYWORD_LEN + 1]; // What the word resolves to (itself for builtins)
+    bool is_alias;                      // Defined by 'defkeyword'
+    const BuiltinCommand *builtin;      // Builtin named by 'original', or NULL
+    unsigned long word_hash;
+} KeywordEntry;
+
+#define KEYWORD_TABLE_INITIAL_CAPACITY 64 // Must be a power of two
+KeywordEntry *keyword_table = NULL; // Open addressing; built on first lookup
+size_t keyword_table_capacity = 0;
+size_t keyword_table_count = 0;
+// FNV-1a chain over every 'defkeyword' (alias, original) in the order they were made;
+// the compiler resolves block keywords through aliases, so it is part of the cache key.
+uint64_t keyword_alias_signature = 0;
 
 // --- PATH Directories (Dynamic List) ---
 typedef struct PathDirNode {
@@ -231,18 +352,197 @@ typedef struct PathDirNode {
 PathDirNode *path_list_head = NULL;
 PathDirNode *module_path_list_head = NULL;
 
+// Command name -> location found in path_list_head, like bash's 'hash'. Misses are
+// cached too (full_path NULL), up to COMMAND_CACHE_MAX_MISSES of them. Cleared when
+// a script assigns $PATH and by 'rehash'.
+#define COMMAND_CACHE_SIZE 256 // Buckets; must be a power of two
+#define COMMAND_CACHE_MAX_MISSES 128
+typedef struct CommandCacheEntry {
+    char *name;
+    char *full_path;
+    struct CommandCacheEntry *next;
+} CommandCacheEntry;
+CommandCacheEntry *command_cache[COMMAND_CACHE_SIZE];
+int command_cache_miss_count = 0;
+
+// --- Growable Strings ---
+// Length-tracked, NUL-terminated buffer that doubles as it grows, so appending is
+// amortized O(1) (e.g. capturing command output of any size).
+typedef struct StringBuilder {
+    char *data;      // NULL until the first append
+    size_t length;
+    size_t capacity;
+} StringBuilder;
+
+// --- Background Jobs ---
+// One entry per 'command &' (a pipeline is one job). SIGCHLD only raises
+// child_status_changed; finished children are reaped per pid with WNOHANG at safe
+// points, so foreground waits never lose their child to the reaper.
+typedef struct Job { // Kept in start order
+    int id;
+    pid_t pids[MAX_PIPELINE_STAGES]; // -1 once reaped
+    int pid_count;
+    int running_count;
+    int status;                      // Exit status of the last stage, once it is reaped
+    bool reported;                   // "Done" already shown at the interactive prompt
+    char *command;
+    struct Job *next;
+} Job;
+Job *job_list_head = NULL;
+int next_job_id = 1;
+volatile sig_atomic_t child_status_changed = 0;
+
+// --- Parallel Map ---
+// Shared by the worker threads of a native parallel_map; 'next_index' is claimed
+// atomically, every other field is read-only while they run.
+typedef struct NativeMapContext {
+    BshLibFunction func;
+    char **elements;
+    char **results;
+    int *statuses;
+    int count;
+    int next_index;
+} NativeMapContext;
+
+// One in-flight child of a process-based parallel_map: its stdout is collected
+// until EOF, then becomes results[index].
+typedef struct MapWorker {
+    pid_t pid;
+    int output_fd; // -1 when the slot is free
+    int index;
+    StringBuilder output;
+} MapWorker;
+
+// --- Record Loops ---
+// A running 'foreach_record'. Its source stays open across iterations and is read a
+// buffer at a time, so only the current line is ever held. The loop's scope holds just
+// the record variable (see assignment_frame); the next record overwrites it in place.
+// The end of the body ('}' or BC_NEXT_RECORD) sets 'resuming', telling the header to
+// read the next record rather than open a new loop. Innermost loop first.
+typedef struct RecordLoop {
+    int fd;
+    pid_t pid;                 // Source command, or -1 for a file/stdin
+    bool at_eof;
+    char *buffer;              // Unconsumed input is [start, end)
+    size_t start;
+    size_t end;
+    size_t capacity;
+    char var_name[MAX_VAR_NAME_LEN];
+    int scope_id;              // Holds only the record variable
+    bool resuming;
+    struct RecordLoop *next;
+} RecordLoop;
+RecordLoop *record_loop_stack = NULL;
+int record_loop_count = 0;
+#define RECORD_READ_CHUNK 65536
+
 // --- Variable Scoping and Management ---
+// Each scope frame owns its variables: a singly linked list (newest first) used for
+// iteration and teardown, plus an open-addressing hash index over that list so a
+// lookup costs one probe sequence per scope on the stack instead of a list walk.
+// Native array value: a contiguous vector of element strings, so $arr[i] is one
+// hash lookup for 'arr' plus an index. Never-assigned slots below 'length' are NULL
+// (unset, like a missing element). An index more than ARRAY_MAX_DENSE_GAP past the end
+// is not stored here but as a "name_ARRAYIDX_i" variable, so a stray large index
+// cannot allocate a huge vector.
+#define ARRAY_MAX_DENSE_GAP 1024
+typedef struct BshArray {
+    char **items;
+    size_t length;
+    size_t capacity;
+} BshArray;
+
+// Parsed "object:[...]" value: one node per [...] level, entries in input order.
+// Objects with more than BSH_OBJECT_INDEX_THRESHOLD entries also get an open-addressing
+// index over their keys, so a dot-access step never scans a large object.
+// Keys and values point into the root's 'text' (a decoded copy of the source) or, for
+// strings the source doesn't spell out (JSON numbers, array indexes), its 'extra_text'.
+#define BSH_OBJECT_INDEX_THRESHOLD 8
+typedef struct BshObjectEntry {
+    char *key;
+    char *value;              // String value; NULL when 'child' is set
+    struct BshObject *child;  // Nested [...] value
+    unsigned long key_hash;
+} BshObjectEntry;
+
+typedef struct BshObject {
+    BshObjectEntry *entries;
+    size_t count;
+    size_t capacity;
+    size_t *slots;            // Entry index + 1 (0 = empty); NULL while the object is small
+    size_t slot_capacity;     // Power of two
+    char *text;               // Root only: buffer the whole tree's strings live in
+    struct BshTextChunk *extra_text; // Root only: generated strings
+    bool from_json;           // Root only: parsed from "json:" data
+} BshObject;
+
+typedef struct BshTextChunk {
+    struct BshTextChunk *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} BshTextChunk;
+
+// Destination of stringify_bsh_object: text collects in 'buffer' and, when 'stream' is
+// set, is written out each time it passes OBJECT_WRITER_FLUSH_SIZE, so echoing a large
+// object holds one chunk of its text rather than the whole thing.
+#define OBJECT_WRITER_FLUSH_SIZE 65536
+typedef struct ObjectWriter {
+    StringBuilder buffer;
+    FILE *stream;             // NULL: keep everything in 'buffer'
+} ObjectWriter;
+
+// Cursor of the object: parser (see parse_bsh_object_recursive).
+#define MAX_OBJECT_DEPTH 256
+typedef struct ObjectParser {
+    char *start;              // Private copy of the input, decoded in place
+    char *p;
+    char *end;
+    int depth;
+    bool failed;              // An error has been reported
+    const char *format;       // "Object" or "JSON", for messages
+    BshObject *root;
+    char **index_keys;        // JSON: "0", "1", ... shared by every array in the document
+    size_t index_key_count;
+} ObjectParser;
+
+// Values up to VAR_INLINE_VALUE_SIZE - 1 bytes live inside the Variable itself; longer
+// ones get a heap buffer that later assignments reuse while the new value fits.
+#define VAR_INLINE_VALUE_SIZE 24
 typedef struct Variable {
-    char name[MAX_VAR_NAME_LEN];
-    char *value;
+    const char *name;          // Interned (see intern_variable_name), shared by every scope
+    char *value;               // "" while 'array' is set; the source text for an object
+    size_t value_capacity;     // Bytes available at 'value'
+    BshArray *array;           // Non-NULL for array variables
+    BshObject *object;         // Non-NULL for variables assigned "object:"/"json:" data
     bool is_array_element;
     int scope_id;
-    struct Variable *next;
+    unsigned long name_hash;
+    struct Variable *next; // Next variable owned by the same scope
+    char inline_value[VAR_INLINE_VALUE_SIZE]; // 'value' points here for short values
 } Variable;
-Variable *variable_list_head = NULL;
+
+// Every distinct variable name is stored once, in an open-addressing table (linear
+// probing, at most half full). Each Variable holds a reference to its name; the last
+// one to go removes the name, so generated names do not pile up.
+typedef struct InternedName {
+    unsigned long hash;
+    size_t ref_count;          // Variables pointing at 'text'
+    char text[];
+} InternedName;
+InternedName **interned_names = NULL;
+size_t interned_name_capacity = 0;     // Power of two
+size_t interned_name_count = 0;
+
+#define VAR_TABLE_INITIAL_CAPACITY 16 // Must be a power of two
 
 typedef struct ScopeFrame {
     int scope_id;
+    Variable *variables;       // All variables of this scope, newest first
+    Variable **var_slots;      // Hash index over 'variables' (linear probing), NULL until first set
+    size_t var_slot_capacity;  // Power of two
+    size_t var_count;
+    const char *record_var_name; // foreach_record scope: holds only this variable; else NULL
 } ScopeFrame;
 ScopeFrame scope_stack[MAX_SCOPE_DEPTH];
 int scope_stack_top = -1;
@@ -256,9 +556,18 @@ typedef struct UserFunction {
     int param_count;
     char* body[MAX_FUNC_LINES];
     int line_count;
+    TokenizedLine *tokenized_body; // One entry per body[] line, built at defunc time
+    struct BytecodeProgram *compiled_body; // --engine=vm: compiled on first call
+    bool compile_failed;           // Compiler rejected the body; use the line engine
+    int active_calls;              // Calls currently executing this function (recursion depth)
     struct UserFunction *next;
+    struct UserFunction *table_next; // Next function in the same function_table bucket
 } UserFunction;
 UserFunction *function_list = NULL;
+#define FUNCTION_TABLE_SIZE 256 // Buckets; must be a power of two
+UserFunction *function_table[FUNCTION_TABLE_SIZE]; // Name -> definition index over function_list
+unsigned long function_table_epoch = 1; // Bumped whenever a function is (re)defined; invalidates cached call targets
+UserFunction *retired_function_list = NULL; // Redefined while executing; freed at shutdown
 bool is_defining_function = false;
 UserFunction *current_function_definition = NULL;
 
@@ -276,7 +585,7 @@ bool bsh_return_value_is_set = false;
 
 
 typedef enum {
-    BLOCK_TYPE_IF, BLOCK_TYPE_ELSE, BLOCK_TYPE_WHILE, BLOCK_TYPE_FUNCTION_DEF
+    BLOCK_TYPE_IF, BLOCK_TYPE_ELSE, BLOCK_TYPE_WHILE, BLOCK_TYPE_FUNCTION_DEF, BLOCK_TYPE_FOREACH_RECORD
 } BlockType;
 
 typedef struct BlockFrame {
@@ -289,9 +598,17 @@ typedef struct BlockFrame {
 BlockFrame block_stack[MAX_NESTING_DEPTH];
 int block_stack_top_bf = -1;
 
+// Scripts, function bodies and eval code run as arrays of lines, so a 'while' repeats
+// by line index: handle_closing_brace_token stores the loop header's line number and
+// the running execute_line_sequence jumps back to it.
+int line_sequence_depth = 0;       // Nesting of execute_line_sequence calls
+int loop_restart_line_no = 0;      // 1-based line to resume at, 0 if none
+int function_body_brace_depth = 0; // Blocks opened inside the 'defunc' body being captured
+
 // --- Dynamic Library Handles ---
 typedef struct DynamicLib {
     char alias[MAX_VAR_NAME_LEN];
+    char path[MAX_FULL_PATH_LEN]; // As given to loadlib; snapshots re-dlopen it
     void *handle;
     struct DynamicLib *next;
 } DynamicLib;
@@ -308,24 +625,172 @@ typedef struct ExprParseContext {
     int recursion_depth; // To prevent stack overflow in parser
 } ExprParseContext;
 #define MAX_EXPR_RECURSION_DEPTH 64
+int operator_handler_depth = 0; // BSH operator handlers currently running (nested via their own expressions)
+
+// --- Bytecode Engine ---
+typedef enum {
+    ENGINE_LINE,
+    ENGINE_VM
+} EngineMode;
+EngineMode bsh_engine_mode = ENGINE_LINE;
+
+// Expressions are lowered to postfix form: operands are pushed, operators pop
+// their arity and push the handler's result.
+typedef enum {
+    EXPR_OP_PUSH_VALUE,  // Word/number/variable token, variable-expanded
+    EXPR_OP_PUSH_STRING, // String literal, unescaped then expanded
+    EXPR_OP_APPLY        // Apply 'op_def' to the top 'arity' values
+} ExprOpCode;
+
+typedef struct ExprInstr {
+    ExprOpCode op;
+    const Token *token;
+    OperatorDefinition *op_def;
+    int arity;
+} ExprInstr;
+
+typedef struct ExprCode {
+    ExprInstr *code;
+    int count;
+    int max_stack;
+} ExprCode;
+
+typedef struct ExprCompileContext {
+    Token *tokens;
+    int num_tokens;
+    int current_token_idx;
+    int recursion_depth; // Counted like ExprParseContext so both give up at the same depth
+    ExprCode *out;
+    int stack_depth;
+} ExprCompileContext;
 
+typedef enum {
+    BC_NOP,
+    BC_COMMAND,   // Builtin, user function, external command: dispatched by execute_tokenized_line
+    BC_ASSIGN,    // $target = <expr>
+    BC_EXPR,      // Standalone expression, result printed and stored in LAST_OP_RESULT
+    BC_IF,        // Expression condition false -> jump_target
+    BC_ELSE_IF,   // Like BC_IF, but with the [!] value / 'a op b' condition form of 'else if'
+    BC_WHILE,     // Condition false -> jump_target (past the loop)
+    BC_JUMP,      // Unconditional (end of a taken if/else branch, loop back-edge)
+    BC_DEFUNC,    // Register function from body lines, then jump_target
+    BC_FOREACH_RECORD, // Next record of the loop (opened on first entry); none left -> jump_target
+    BC_NEXT_RECORD     // End of a foreach_record body: release the record, jump_target (header)
+} BytecodeOp;
+
+typedef struct BytecodeInstr {
+    BytecodeOp op;
+    int jump_target;
+    int line_no;
+    TokenizedLine line;
+    bool classified;     // 'op'/'arg_*' match the current tokens (statements are reclassified after defoperator)
+    int arg_start;       // Condition or expression tokens: [arg_start, arg_end)
+    int arg_end;
+    ExprCode *expr;      // BC_ASSIGN/BC_EXPR, compiled on first execution
+    bool expr_failed;    // Expression compiler rejected it; evaluate with the recursive parser
+    int body_first_line; // BC_DEFUNC: source line range of the body
+    int body_line_count;
+} BytecodeInstr;
+
+typedef struct BytecodeProgram {
+    BytecodeInstr *code;
+    int count;
+    int capacity;
+    char **lines;        // Source lines (borrowed); BC_DEFUNC copies its body out of them
+    int active_runs;     // Nested executions (recursive calls); stale lines are only re-tokenized in place at depth 1
+} BytecodeProgram;
+
+// Compile-time view of an open block. Jumps leaving the taken branches of an
+// if/else chain are linked through their jump_target fields until the chain ends.
+typedef struct BytecodeCompileBlock {
+    BlockType type;
+    int header_pc;       // BC_IF/BC_ELSE_IF/BC_WHILE/BC_DEFUNC, or -1 for a plain 'else'
+    int chain_head;      // Last BC_JUMP of the if/else chain, -1 if none
+    int body_first_line; // BLOCK_TYPE_FUNCTION_DEF only
+    int body_depth;      // BLOCK_TYPE_FUNCTION_DEF only: braces opened inside the body
+} BytecodeCompileBlock;
+
+typedef struct BytecodeCompiler {
+    BytecodeProgram *prog;
+    const char *origin_name;
+    BytecodeCompileBlock blocks[MAX_NESTING_DEPTH];
+    int block_count;
+    bool awaiting_lbrace;            // Last header had no '{'; the next line must be one
+    bool has_pending_chain;          // An if/else branch just closed and may be continued by 'else'
+    BytecodeCompileBlock pending_chain;
+} BytecodeCompiler;
+
+// --- Precompiled Script Cache (.bshc) ---
+#define BSH_FNV1A_OFFSET 14695981039346656037ULL
+#define BSH_FNV1A_PRIME 1099511628211ULL
+#define BSH_CACHE_MAGIC "BSHC"
+#define BSH_CACHE_FORMAT_VERSION 7
+#define BSH_CACHE_DIR_NAME ".bsh_cache"
+
+// Identity of a script's current contents; a cache entry is only used if all of it matches.
+typedef struct ScriptSourceInfo {
+    char path[MAX_FULL_PATH_LEN]; // Canonical path (the cache key)
+    int64_t mtime;
+    int64_t size;
+    uint64_t content_hash;
+    uint64_t language_signature; // Operator definitions and keyword aliases when the script started
+} ScriptSourceInfo;
+
+// --- Interpreter Snapshots ---
+#define BSH_SNAPSHOT_MAGIC "BSHS"
+#define BSH_SNAPSHOT_FORMAT_VERSION 7
 
 // --- Function Prototypes (Updated/New) ---
 // Core
 void initialize_shell();
 void process_line(char *line, FILE *input_source, int current_line_no, ExecutionState exec_mode);
+void process_tokenized_line(TokenizedLine *tl, FILE *input_source, int current_line_no, ExecutionState exec_mode);
+void execute_tokenized_line(Token *tokens, int num_tokens, TokenizedLine *call_site, FILE *input_source, int current_line_no, ExecutionState exec_mode);
+bool capture_function_body_line(const char *line, ExecutionState exec_mode);
+void execute_line_sequence(char **lines, TokenizedLine *cached_lines, int line_count, bool refresh_cache, ExecutionState exec_mode);
+int read_script_lines(FILE *script_file, char ***lines_out);
+uint64_t hash_bytes_fnv1a(const void *data, size_t len, uint64_t hash);
+bool read_script_source_info(FILE *script_file, const char *filename, ScriptSourceInfo *info);
+bool script_cache_file_path(const ScriptSourceInfo *info, char *cache_path, size_t cache_path_size);
+bool load_script_cache(const ScriptSourceInfo *info, char ***lines_out, int *line_count_out,
+                       BytecodeProgram **prog_out, TokenizedLine **line_tokens_out);
+void save_script_cache(const ScriptSourceInfo *info, char **lines, int line_count,
+                       BytecodeProgram *prog, TokenizedLine *line_tokens);
+void free_script_lines(char **lines, int line_count);
+void cache_put_u32(FILE *cache_file, uint32_t value);
+void cache_put_u64(FILE *cache_file, uint64_t value);
+void cache_put_string(FILE *cache_file, const char *str);
+bool cache_get_u32(FILE *cache_file, uint32_t *value);
+bool cache_get_u64(FILE *cache_file, uint64_t *value);
+bool cache_get_string(FILE *cache_file, char *buffer, size_t buffer_size);
+bool cache_get_token_stream(FILE *cache_file, TokenizedLine *tl);
+char* cache_get_string_alloc(FILE *cache_file);
+bool write_checksummed_file(const char *path, const char *image, size_t image_size);
+const char* map_checksummed_file(const char *path, size_t *payload_size_out, size_t *map_size_out);
 void execute_script(const char *filename, bool is_import, bool is_startup_script);
 void cleanup_shell();
+void initialize_process_state();
+bool save_interpreter_snapshot(const char *path);
+bool load_interpreter_snapshot(const char *path);
+bool restore_snapshot_sections(FILE *snap_file);
 
 // Tokenizer & Operator/Keyword Management
 void initialize_operators_core_structural(); // Renamed
-void add_operator_definition(const char* op_str, TokenType token_type, OperatorType op_type_prop, int precedence, OperatorAssociativity assoc, const char* bsh_handler); // Changed signature
+void add_operator_definition(const char* op_str, TokenType token_type, OperatorType op_type_prop, int precedence, OperatorAssociativity assoc, const char* bsh_handler, BshLibFunction native_handler); // Changed signature
 OperatorDefinition* get_operator_definition(const char* op_str); // New helper
-int match_operator_text(const char *input, const char **op_text); // Simplified from match_operator_dynamic
+int match_operator_trie(const char *input, OperatorTrieNode **node_out);
+void rebuild_operator_trie();
 void add_keyword_alias(const char* original, const char* alias_name);
 const char* resolve_keyword_alias(const char* alias_name);
 void free_keyword_alias_list();
+const BuiltinCommand* find_builtin_command(const char *name);
+KeywordEntry* find_keyword_entry(const char *word);
+KeywordEntry* insert_keyword_entry(const char *word);
+bool initialize_keyword_table();
 int advanced_tokenize_line(const char *line_text, int line_num, Token *tokens, int max_tokens, char *token_storage, size_t storage_size); // Added line_num, col
+bool tokens_touch(const Token *a, const Token *b);
+bool tokenize_line_cached(TokenizedLine *tl, int line_num);
+void free_tokenized_line(TokenizedLine *tl);
 
 // Path Management
 void add_path_to_list(PathDirNode **list_head, const char* dir_path);
@@ -336,25 +801,122 @@ void initialize_module_path();
 int enter_scope();
 void leave_scope(int scope_id_to_leave);
 void cleanup_variables_for_scope(int scope_id);
+ScopeFrame* find_scope_frame(int scope_id);
+ScopeFrame* assignment_frame(const char *name);
+unsigned long hash_variable_name(const char* name);
+Variable* find_variable_in_frame(ScopeFrame* frame, const char* name, unsigned long name_hash);
+bool insert_variable_in_frame(ScopeFrame* frame, Variable* var);
+const char* intern_variable_name(const char* name, unsigned long name_hash);
+void release_variable_name(const char* name);
+bool set_variable_value(Variable* var, const char* value);
+void free_scope_frame_variables(ScopeFrame* frame);
 char* get_variable_scoped(const char *name_raw);
 void set_variable_scoped(const char *name_raw, const char *value_to_set, bool is_array_elem);
 void expand_variables_in_string_advanced(const char *input_str, char *expanded_str, size_t expanded_str_size); // Keep as is for now
 char* get_array_element_scoped(const char* array_base_name, const char* index_str_raw);
 void set_array_element_scoped(const char* array_base_name, const char* index_str_raw, const char* value);
+Variable* find_variable_scoped(const char *name);
+BshArray* find_array_scoped(const char *name);
+BshArray* get_or_create_array_scoped(const char *name);
+bool parse_array_index(const char *text, size_t *index);
+void expand_array_index(const char *index_str_raw, char *expanded_index, size_t expanded_index_size);
+char* array_element_at(BshArray *array, const char *index_str);
+bool array_reserve(BshArray *array, size_t min_capacity);
+bool array_index_is_dense(const BshArray *array, size_t index);
+bool array_set(BshArray *array, size_t index, const char *value);
+bool array_push(BshArray *array, const char *value);
+void free_array(BshArray *array);
 
 // Command Execution
 bool find_command_in_path_dynamic(const char *command, char *full_path);
+bool search_path_list(const char *command, char *full_path);
+void build_path_list();
+void clear_command_cache();
+void export_path_variable(const char *value);
+void handle_rehash_statement(Token *tokens, int num_tokens);
 bool find_module_in_path(const char* module_name, char* full_path);
 int execute_external_command(char *command_path, char **args, int arg_count, char *output_buffer, size_t output_buffer_size);
+pid_t launch_external_command(char *command_path, char **args, int input_fd, int output_fd, bool merge_stderr);
+void execute_pipeline(Token *tokens, int num_tokens);
+int start_pipeline(Token *tokens, int num_tokens, pid_t *pids);
+bool word_starts_block_statement(const char *word);
+pid_t launch_shell_stage(Token *tokens, int num_tokens, int input_fd, int output_fd, int unused_fd);
+int exit_code_from_wait_status(int status);
+void handle_sigchld(int signo);
+void start_background_job(Token *tokens, int num_tokens, TokenizedLine *call_site, FILE *input_source);
+pid_t fork_shell_child();
+void exit_shell_child();
+void reap_background_jobs();
+int wait_for_job(Job *job);
+void remove_job(Job *job);
+void free_job_list();
+void handle_jobs_statement(Token *tokens, int num_tokens);
+void handle_wait_statement(Token *tokens, int num_tokens);
+void handle_parallel_map_statement(Token *tokens, int num_tokens);
+void handle_array_length_statement(Token *tokens, int num_tokens);
+void handle_array_push_statement(Token *tokens, int num_tokens);
+void handle_array_pop_statement(Token *tokens, int num_tokens);
+void handle_array_slice_statement(Token *tokens, int num_tokens);
+void expand_word_token(const Token *token, char *out, size_t out_size);
+void handle_foreach_record_statement(Token *tokens, int num_tokens, FILE* input_source, int current_line_no);
+bool foreach_record_advance(Token *tokens, int num_tokens);
+RecordLoop* open_record_loop(Token *tokens, int num_tokens);
+bool read_next_record(RecordLoop *loop);
+void assign_record(RecordLoop *loop, char *text, size_t length);
+void end_record_iteration();
+void close_record_loop(RecordLoop *loop);
+void close_record_loops_above(int count);
+void* native_map_worker(void *arg);
+int run_native_map(BshLibFunction func, char **elements, char **results, int count, int worker_count);
+int run_process_map(UserFunction *func, const char *command_path, char **elements, char **results, int count, int worker_count);
+bool open_cloexec_pipe(int pipefd[2]);
+int wait_for_external_command(pid_t pid);
+int capture_external_command(char *command_path, char **args, StringBuilder *output);
+int build_command_argv(Token *tokens, int num_tokens, char **args);
+void free_command_argv(char **args, int arg_count);
 void execute_user_function(UserFunction* func, Token* call_arg_tokens, int call_arg_token_count, FILE* input_source_for_context);
+void execute_user_function_with_values(UserFunction* func, const char *arg_values[], int arg_count, bool is_command_call);
+void run_user_function_body(UserFunction* func);
+void leave_function_scope(int function_scope_id, bool propagate_status);
 
 // Expression Evaluation (New/Rewritten)
 bool evaluate_expression_from_tokens(Token* tokens, int num_tokens, char* result_buffer, size_t buffer_size);
 bool parse_expression_recursive(ExprParseContext* ctx, int min_precedence); // Core of precedence climbing
 bool parse_operand(ExprParseContext* ctx, char* operand_result_buffer, size_t operand_buffer_size); // Parses primary, unary prefix
 
+// Bytecode Engine
+ExprCode* compile_expression_code(Token *tokens, int num_tokens);
+void free_expression_code(ExprCode *code);
+bool run_expression_code(ExprCode *code, char *result_buffer, size_t buffer_size);
+char (*reserve_expression_stack(int slots))[INPUT_BUFFER_SIZE];
+void free_expression_stack_pool();
+void expr_emit(ExprCompileContext *ctx, ExprOpCode op, const Token *token, OperatorDefinition *op_def, int arity);
+bool expr_compile_operand(ExprCompileContext *ctx);
+bool expr_compile_recursive(ExprCompileContext *ctx, int min_precedence);
+BytecodeProgram* compile_bytecode_program(char **lines, int line_count, const char *origin_name);
+void free_bytecode_program(BytecodeProgram *prog);
+bool bytecode_compile_line(BytecodeCompiler *comp, int line_idx);
+bool bytecode_compile_else(BytecodeCompiler *comp, int line_idx, const char *after_else, int header_words);
+void bytecode_compile_error(BytecodeCompiler *comp, int line_no, const char *message);
+int bytecode_emit(BytecodeCompiler *comp, BytecodeOp op, int line_no);
+int bytecode_emit_line(BytecodeCompiler *comp, BytecodeOp op, int line_idx, int arg_start);
+bool bytecode_push_block(BytecodeCompiler *comp, BlockType type, int header_pc, int chain_head);
+void bytecode_finish_chain(BytecodeCompiler *comp);
+bool bytecode_line_opens_block(const char *text);
+const char* bytecode_scan_keyword(const char *text, char *keyword, size_t keyword_size);
+bool bytecode_rest_is_empty(const char *p);
+void run_bytecode_program(BytecodeProgram *prog, ExecutionState exec_mode);
+bool vm_prepare_instruction(BytecodeInstr *instr);
+void vm_execute_instruction(BytecodeProgram *prog, BytecodeInstr *instr, int *pc, ExecutionState exec_mode);
+bool vm_evaluate_expression(BytecodeInstr *instr, char *result_buffer, size_t buffer_size);
+bool vm_evaluate_block_condition(BytecodeInstr *instr);
+void vm_define_function(BytecodeProgram *prog, BytecodeInstr *instr);
+bool evaluate_condition_tokens(Token *tokens, int count);
+bool bsh_value_is_truthy(const char *value);
+
 // BSH Handler Invocation
-bool invoke_bsh_operator_handler(const char* bsh_handler_name,
+bool apply_operator_definition(OperatorDefinition *op_def, int arg_count, const char *args[], char *result_buffer, size_t result_buffer_size);
+bool invoke_bsh_operator_handler(UserFunction* func, const char* bsh_handler_name,
                                  const char* op_symbol, // The operator itself
                                  int arg_count, // Number of string arguments for BSH
                                  const char* args[], // Array of string arguments
@@ -364,6 +926,7 @@ bool invoke_bsh_operator_handler(const char* bsh_handler_name,
 void handle_defoperator_statement(Token *tokens, int num_tokens); // Updated
 void handle_defkeyword_statement(Token *tokens, int num_tokens);
 void handle_assignment_advanced(Token *tokens, int num_tokens); // Will use evaluate_expression_from_tokens
+void assign_evaluated_value(const Token *target_token, char *rhs_value_buffer);
 void handle_echo_advanced(Token *tokens, int num_tokens);
 bool evaluate_condition_advanced(Token* operand1_token, Token* operator_token, Token* operand2_token); // May be replaced by generic expr eval
 void handle_if_statement_advanced(Token *tokens, int num_tokens, FILE* input_source, int current_line_no); // Will use evaluate_expression_from_tokens for condition
@@ -372,12 +935,16 @@ void handle_while_statement_advanced(Token *tokens, int num_tokens, FILE* input_
 void handle_defunc_statement_advanced(Token *tokens, int num_tokens);
 // void handle_inc_dec_statement_advanced(Token *tokens, int num_tokens, bool increment); // ++/-- are now generic TOKEN_OPERATOR
 void handle_loadlib_statement(Token *tokens, int num_tokens);
+bool load_dynamic_library(const char *lib_path, const char *alias);
 void handle_calllib_statement(Token *tokens, int num_tokens);
+BshLibFunction find_lib_function(const char *alias, const char *func_name);
+BshLibFunction resolve_native_operator_handler(const char *spec, const char *op_symbol);
 void handle_import_statement(Token *tokens, int num_tokens);
 void handle_update_cwd_statement(Token *tokens, int num_tokens);
 // void handle_unary_op_statement(Token* var_token, Token* op_token, bool is_prefix); // Replaced by generic expression eval
 void handle_exit_statement(Token *tokens, int num_tokens);
 void handle_eval_statement(Token *tokens, int num_tokens);
+void handle_capture_statement(Token *tokens, int num_tokens);
 
 
 // Block Management
@@ -385,21 +952,52 @@ void push_block_bf(BlockType type, bool condition_true, long loop_start_fpos, in
 BlockFrame* pop_block_bf();
 BlockFrame* peek_block_bf();
 void handle_opening_brace_token(Token token); // Needs to respect current_exec_state
-void handle_closing_brace_token(Token token, FILE* input_source); // Needs to respect current_exec_state
+void handle_closing_brace_token(Token token); // Needs to respect current_exec_state
 
 // Utility & BSH Callers
 char* trim_whitespace(char *str);
 void free_all_variables();
+void free_interned_names();
 void free_function_list();
+void free_user_function(UserFunction *func);
+void build_function_token_cache(UserFunction *func);
+void free_function_token_cache(UserFunction *func);
+void register_user_function(UserFunction *func);
+UserFunction* find_user_function(const char *name);
+UserFunction* resolve_call_site_function(TokenizedLine *call_site, const char *name);
 void free_operator_list(); // Updated for new OperatorDefinition
 void free_loaded_libs();
 long get_file_pos(FILE* f);
 char* unescape_string(const char* input, char* output_buffer, size_t buffer_size);
 bool input_source_is_file(FILE* f);
+bool string_builder_append(StringBuilder *sb, const char *data, size_t len);
+void string_builder_free(StringBuilder *sb);
 
 // object: management
-void parse_and_flatten_bsh_object_string(const char* data_string, const char* base_var_name, int current_scope_id);
-bool stringify_bsh_object_to_string(const char* base_var_name, char* output_buffer, size_t buffer_size);
+BshObject* parse_bsh_object_string(const char* object_data_string, size_t length);
+BshObject* parse_json_string(const char* json_text, size_t length);
+bool parse_json_container(ObjectParser* parser, BshObject* object);
+bool parse_json_member(ObjectParser* parser, BshObject* object, char* key);
+char* json_read_string(ObjectParser* parser);
+char* json_read_number(ObjectParser* parser);
+char* json_index_key(ObjectParser* parser, size_t index);
+const char* json_scan_string_run(const char* p, const char* end);
+void json_skip_space(ObjectParser* parser);
+char* bsh_object_add_text(BshObject* root, const char* text, size_t length);
+bool parse_bsh_object_recursive(ObjectParser* parser, BshObject* object);
+void object_parser_skip_space(ObjectParser* parser);
+void object_parser_error(ObjectParser* parser, const char* message);
+char* object_parser_read_string(ObjectParser* parser);
+BshObjectEntry* bsh_object_find(const BshObject* object, const char* key);
+BshObjectEntry* bsh_object_put(BshObject* object, char* key);
+bool bsh_object_reindex(BshObject* object, size_t new_slot_capacity);
+void free_bsh_object(BshObject* object);
+bool stringify_bsh_object(const BshObject* object, ObjectWriter* out);
+bool object_writer_append(ObjectWriter* out, const char* data, size_t len);
+bool object_writer_append_quoted(ObjectWriter* out, const char* text);
+bool object_writer_flush(ObjectWriter* out);
+char* find_flattened_object_value(char* name);
+char* resolve_flattened_object_path(const BshObject* object, const char* path, bool is_root);
 
 
 // --- Tokenizer & Operator/Keyword Management Implementations ---
@@ -424,25 +1022,28 @@ void initialize_operators_core_structural() {
     // add_operator_definition("]", TOKEN_RBRACKET, OP_TYPE_NONE, 0, ASSOC_NONE, "");
     // add_operator_definition(";", TOKEN_SEMICOLON, OP_TYPE_NONE, 0, ASSOC_NONE, "");
 
-    // '=' could be special if C handles assignment uniquely, or a regular operator.
-    // If it's special for $var = value:
-    // add_operator_definition("=", TOKEN_ASSIGN, OP_TYPE_BINARY_INFIX, 2, ASSOC_RIGHT, "_bsh_assign"); // Or no handler if C manages it
-    // Or it could be fully script defined. Let's assume for now TOKEN_ASSIGN is still a distinct type for process_line logic.
+    // '=' is defined here so '$var = value' is an assignment from the first line of
+    // .bshrc on. The C core performs the assignment itself (handle_assignment_advanced),
+    // so it needs no handler; scripts can still re-define it with defoperator.
+    add_operator_definition("=", TOKEN_OPERATOR, OP_TYPE_BINARY_INFIX, 2, ASSOC_RIGHT, "", NULL);
 }
 
 
 // New signature for adding richer operator definitions
 void add_operator_definition(const char* op_str, TokenType token_type, OperatorType op_type_prop,
-                             int precedence, OperatorAssociativity assoc, const char* bsh_handler_name_str) {
+                             int precedence, OperatorAssociativity assoc, const char* bsh_handler_name_str,
+                             BshLibFunction native_handler) {
     if (strlen(op_str) > MAX_OPERATOR_LEN) {
         fprintf(stderr, "Warning: Operator '%s' too long (max %d chars).\n", op_str, MAX_OPERATOR_LEN);
         return;
     }
 
-    // Check if operator already exists, update if so (optional, or disallow)
+    // Check if operator already exists, update if so (optional, or disallow).
+    // Prefix and infix/postfix uses of the same symbol are separate variants.
+    bool defining_prefix = (op_type_prop == OP_TYPE_UNARY_PREFIX);
     OperatorDefinition *current = operator_list_head;
     while(current) {
-        if (strcmp(current->op_str, op_str) == 0) {
+        if (strcmp(current->op_str, op_str) == 0 && (current->op_type_prop == OP_TYPE_UNARY_PREFIX) == defining_prefix) {
             fprintf(stderr, "Warning: Operator '%s' already defined. Re-defining.\n", op_str);
             current->token_type = token_type;
             current->op_type_prop = op_type_prop;
@@ -450,6 +1051,11 @@ void add_operator_definition(const char* op_str, TokenType token_type, OperatorT
             current->associativity = assoc;
             strncpy(current->bsh_handler_name, bsh_handler_name_str, MAX_VAR_NAME_LEN -1);
             current->bsh_handler_name[MAX_VAR_NAME_LEN -1] = '\0';
+            current->native_handler = native_handler;
+            current->handler_func = NULL;
+            current->handler_epoch = 0;
+            rebuild_operator_trie();
+            operator_table_epoch++;
             return;
         }
         current = current->next;
@@ -468,55 +1074,94 @@ void add_operator_definition(const char* op_str, TokenType token_type, OperatorT
     new_op->associativity = assoc;
     strncpy(new_op->bsh_handler_name, bsh_handler_name_str, MAX_VAR_NAME_LEN -1);
     new_op->bsh_handler_name[MAX_VAR_NAME_LEN-1] = '\0';
+    new_op->native_handler = native_handler;
+    new_op->handler_func = NULL;
+    new_op->handler_epoch = 0;
 
     new_op->next = operator_list_head;
     operator_list_head = new_op;
+    rebuild_operator_trie();
+    operator_table_epoch++;
 }
 
-// Helper to get an operator's full definition
-OperatorDefinition* get_operator_definition(const char* op_str) {
-    OperatorDefinition *current = operator_list_head;
-    while (current) {
-        if (strcmp(current->op_str, op_str) == 0) {
-            return current;
+// Rebuilds operator_trie from operator_list_head. Cheap enough to redo on every
+// defoperator, and keeps matching at O(operator length) for the tokenizer.
+void rebuild_operator_trie() {
+    operator_trie_node_count = 0;
+    if (!operator_trie) {
+        operator_trie = (OperatorTrieNode*)malloc(sizeof(OperatorTrieNode) * 64);
+        if (!operator_trie) { perror("malloc for operator trie failed"); return; }
+        operator_trie_capacity = 64;
+    }
+    memset(&operator_trie[0], 0, sizeof(OperatorTrieNode));
+    operator_trie_node_count = 1; // Root
+    operator_symbol_signature = BSH_FNV1A_OFFSET;
+    operator_definition_signature = BSH_FNV1A_OFFSET;
+
+    for (OperatorDefinition *def = operator_list_head; def; def = def->next) {
+        int32_t shape[3] = { def->op_type_prop, def->precedence, def->associativity };
+        operator_definition_signature = hash_bytes_fnv1a(def->op_str, strlen(def->op_str) + 1, operator_definition_signature);
+        operator_definition_signature = hash_bytes_fnv1a(shape, sizeof(shape), operator_definition_signature);
+        operator_definition_signature = hash_bytes_fnv1a(def->bsh_handler_name, strlen(def->bsh_handler_name) + 1, operator_definition_signature);
+        int node = 0;
+        for (const unsigned char *c = (const unsigned char*)def->op_str; *c; c++) {
+            if (operator_trie[node].child[*c] == 0) {
+                if (operator_trie_node_count >= MAX_OPERATOR_TRIE_NODES) {
+                    fprintf(stderr, "Warning: Too many operator symbols; '%s' will not be recognized.\n", def->op_str);
+                    node = -1; break;
+                }
+                if (operator_trie_node_count == operator_trie_capacity) {
+                    int new_capacity = operator_trie_capacity * 2;
+                    OperatorTrieNode *grown = (OperatorTrieNode*)realloc(operator_trie, sizeof(OperatorTrieNode) * new_capacity);
+                    if (!grown) { perror("realloc for operator trie failed"); node = -1; break; }
+                    operator_trie = grown;
+                    operator_trie_capacity = new_capacity;
+                }
+                memset(&operator_trie[operator_trie_node_count], 0, sizeof(OperatorTrieNode));
+                operator_trie[node].child[*c] = (unsigned short)operator_trie_node_count++;
+            }
+            node = operator_trie[node].child[*c];
+        }
+        if (node <= 0) continue;
+        if (!operator_trie[node].prefix_op && !operator_trie[node].infix_op) {
+            operator_symbol_signature = hash_bytes_fnv1a(def->op_str, strlen(def->op_str) + 1, operator_symbol_signature); // NUL separates symbols
+        }
+        // The list is newest-first, so the first definition seen for a slot wins.
+        if (def->op_type_prop == OP_TYPE_UNARY_PREFIX) {
+            if (!operator_trie[node].prefix_op) operator_trie[node].prefix_op = def;
+        } else if (!operator_trie[node].infix_op) {
+            operator_trie[node].infix_op = def;
         }
-        current = current->next;
     }
-    return NULL;
 }
 
-// Simplified from match_operator_dynamic. Now only matches text, returns length.
-// The caller (tokenizer) will then use get_operator_definition() if needed.
-int match_operator_text(const char *input, const char **op_text) {
-    OperatorDefinition *current = operator_list_head;
-    const char* best_match_str = NULL;
-    int longest_match_len = 0;
-
-    // Check built-in single character structural tokens first if they are not in OperatorDefinition list
-    // (e.g. '(', ')', '{', '}', '[', ']', ';', '=')
-    // This depends on whether they are added to operator_list_head or handled separately by tokenizer.
-    // For now, assume all symbols that can be TOKEN_OPERATOR are in operator_list_head.
-    // Let's assume fixed punctuation like '(', ')', etc. are handled before this,
-    // and this function is for TOKEN_OPERATOR candidates.
-
-    while (current) {
-        size_t op_len = strlen(current->op_str);
-        if (strncmp(input, current->op_str, op_len) == 0) {
-            if (op_len > longest_match_len) {
-                longest_match_len = op_len;
-                best_match_str = current->op_str; // Point to the string in the definition
-            }
+// Longest operator symbol at the start of 'input'; returns its length (0 if none)
+// and the trie node holding its variants.
+int match_operator_trie(const char *input, OperatorTrieNode **node_out) {
+    if (!operator_trie || operator_trie_node_count == 0) return 0;
+    int node = 0, best_node = 0, best_len = 0;
+    for (int len = 1; input[len - 1]; len++) {
+        node = operator_trie[node].child[(unsigned char)input[len - 1]];
+        if (node == 0) break;
+        if (operator_trie[node].prefix_op || operator_trie[node].infix_op) {
+            best_node = node;
+            best_len = len;
         }
-        current = current->next;
     }
+    if (best_len > 0 && node_out) *node_out = &operator_trie[best_node];
+    return best_len;
+}
 
-    if (longest_match_len > 0) {
-        if (op_text) *op_text = best_match_str;
-        return longest_match_len;
-    }
-    return 0;
+// Helper to get an operator's full definition (the infix/postfix variant if the
+// symbol has one, else the prefix one). Parsers use the Token's resolved variants.
+OperatorDefinition* get_operator_definition(const char* op_str) {
+    OperatorTrieNode *node = NULL;
+    int len = match_operator_trie(op_str, &node);
+    if (len == 0 || op_str[len] != '\0') return NULL;
+    return node->infix_op ? node->infix_op : node->prefix_op;
 }
 
+
 void free_operator_list() {
     OperatorDefinition *current = operator_list_head;
     OperatorDefinition *next_op;
@@ -526,9 +1171,17 @@ void free_operator_list() {
         current = next_op;
     }
     operator_list_head = NULL;
+    free(operator_trie);
+    operator_trie = NULL;
+    operator_trie_node_count = operator_trie_capacity = 0;
 }
 
 
+// True if 'b' starts right where 'a' ends on the same line (no space between them).
+bool tokens_touch(const Token *a, const Token *b) {
+    return a->line == b->line && a->col + a->len == b->col;
+}
+
 // Updated tokenizer to be simpler and use new types/operator matching
 int advanced_tokenize_line(const char *line_text, int line_num, Token *tokens, int max_tokens, char *token_storage, size_t storage_size) {
     int token_count = 0;
@@ -540,8 +1193,10 @@ int advanced_tokenize_line(const char *line_text, int line_num, Token *tokens, i
     auto void add_token(TokenType type, const char* text_start, int len) {
         if (token_count >= max_tokens -1 || remaining_storage <= len +1) { /* Ran out of space */ return; }
         tokens[token_count].type = type;
+        tokens[token_count].prefix_op = NULL;
+        tokens[token_count].infix_op = NULL;
         tokens[token_count].line = line_num;
-        tokens[token_count].col = current_col - len; // Approximate start column
+        tokens[token_count].col = current_col - len; // Callers advance past the text first
 
         strncpy(storage_ptr, text_start, len);
         storage_ptr[len] = '\0';
@@ -582,8 +1237,16 @@ int advanced_tokenize_line(const char *line_text, int line_num, Token *tokens, i
             } else {
                 while (isalnum((unsigned char)*p) || *p == '_') { p++; current_col++; }
             }
-            // Array access like $var[index] or $var.prop needs more complex tokenization
-            // For now, $var or ${var} is one token. Dot/bracket would be separate TOKEN_OPERATORs.
+            // $var[index] (brackets may nest, e.g. $a[$b[0]]) is one token; $var.prop is
+            // resolved later by variable expansion.
+            if (*p == '[') {
+                int bracket_depth = 0;
+                do {
+                    if (*p == '[') bracket_depth++;
+                    else if (*p == ']') bracket_depth--;
+                    p++; current_col++;
+                } while (*p && *p != '\n' && bracket_depth > 0);
+            }
             add_token(TOKEN_VARIABLE, p_token_start, p - p_token_start);
             continue;
         }
@@ -644,21 +1307,35 @@ int advanced_tokenize_line(const char *line_text, int line_num, Token *tokens, i
         }
 
         // 6. Script-Defined Operators (can be multi-character)
-        const char *matched_op_text_ptr = NULL;
-        int op_len = match_operator_text(p, &matched_op_text_ptr); // match_operator_text uses operator_list_head
+        OperatorTrieNode *matched_op_node = NULL;
+        int op_len = match_operator_trie(p, &matched_op_node);
         if (op_len > 0) {
-            // The matched_op_text_ptr points to the op_str in an OperatorDefinition.
-            // We still copy it to token_storage for consistency in Token.text.
-            add_token(TOKEN_OPERATOR, p, op_len); // Type is generic TOKEN_OPERATOR
+            // Resolve the operator's definitions now so parsers need not look them up again.
+            int op_token_idx = token_count;
             p += op_len;
             current_col += op_len;
+            add_token(TOKEN_OPERATOR, p_token_start, op_len); // Type is generic TOKEN_OPERATOR
+            if (token_count > op_token_idx) {
+                tokens[op_token_idx].prefix_op = matched_op_node->prefix_op;
+                tokens[op_token_idx].infix_op = matched_op_node->infix_op;
+            }
+            continue;
+        }
+
+        // A '|' or '&' that no defined operator claimed separates pipeline stages or
+        // sends the command to the background.
+        if (*p == '|' || *p == '&') {
+            p++; current_col++;
+            add_token(*p_token_start == '|' ? TOKEN_PIPE : TOKEN_AMPERSAND, p_token_start, 1);
             continue;
         }
 
 
-        // 7. Words (keywords, command names, identifiers)
-        if (isalnum((unsigned char)*p) || *p == '_') { // Start of a word
-            while (isalnum((unsigned char)*p) || *p == '_') {
+        // 7. Words (keywords, command names, identifiers). A '-' that no defined operator
+        // claims is part of the word, so options like '-l' read as words.
+        if (isalnum((unsigned char)*p) || *p == '_' || *p == '-') { // Start of a word
+            while (isalnum((unsigned char)*p) || *p == '_' ||
+                   (*p == '-' && match_operator_trie(p, &matched_op_node) == 0)) {
                 p++; current_col++;
             }
             add_token(TOKEN_WORD, p_token_start, p - p_token_start);
@@ -668,13 +1345,15 @@ int advanced_tokenize_line(const char *line_text, int line_num, Token *tokens, i
         // 8. Unrecognized character
         fprintf(stderr, "bsh: tokenize error: Unrecognized character '%c' at line %d, col %d.\n", *p, line_num, current_col);
         // For now, create an error token and try to continue. A real shell might stop or have better recovery.
-        add_token(TOKEN_ERROR, p_token_start, 1);
         p++; current_col++; // Skip the bad character
+        add_token(TOKEN_ERROR, p_token_start, 1);
     }
 
 end_of_line_tokens:
     if (token_count < max_tokens) {
         tokens[token_count].type = TOKEN_EOF;
+        tokens[token_count].prefix_op = NULL;
+        tokens[token_count].infix_op = NULL;
         tokens[token_count].text = "EOF"; // Static string, no need for storage_ptr
         tokens[token_count].len = 3;
         tokens[token_count].line = line_num;
@@ -685,6 +1364,197 @@ end_of_line_tokens:
 }
 
 
+// --- Builtin Commands and Keyword Aliases ---
+
+// Every builtin command, in no particular order. New builtins are added here only.
+const BuiltinCommand builtin_commands[] = {
+    { "echo",        handle_echo_advanced,             NULL },
+    { "defkeyword",  handle_defkeyword_statement,      NULL },
+    { "defoperator", handle_defoperator_statement,     NULL },
+    { "if",          NULL,                             handle_if_statement_advanced },
+    { "else",        NULL,                             handle_else_statement_advanced },
+    { "while",       NULL,                             handle_while_statement_advanced },
+    { "defunc",      handle_defunc_statement_advanced, NULL },
+    { "loadlib",     handle_loadlib_statement,         NULL },
+    { "calllib",     handle_calllib_statement,         NULL },
+    { "import",      handle_import_statement,          NULL },
+    { "update_cwd",  handle_update_cwd_statement,      NULL },
+    { "eval",        handle_eval_statement,            NULL },
+    { "exit",        handle_exit_statement,            NULL },
+    { "rehash",      handle_rehash_statement,          NULL },
+    { "capture",     handle_capture_statement,         NULL },
+    { "jobs",        handle_jobs_statement,            NULL },
+    { "wait",        handle_wait_statement,            NULL },
+    { "parallel_map", handle_parallel_map_statement,   NULL },
+    { "array_length", handle_array_length_statement,   NULL },
+    { "array_push",  handle_array_push_statement,      NULL },
+    { "array_pop",   handle_array_pop_statement,       NULL },
+    { "array_slice", handle_array_slice_statement,     NULL },
+    { "foreach_record", NULL,                          handle_foreach_record_statement },
+};
+#define BUILTIN_COMMAND_COUNT (sizeof(builtin_commands) / sizeof(builtin_commands[0]))
+
+const BuiltinCommand* find_builtin_command(const char *name) {
+    for (size_t i = 0; i < BUILTIN_COMMAND_COUNT; i++) {
+        if (strcmp(builtin_commands[i].name, name) == 0) return &builtin_commands[i];
+    }
+    return NULL;
+}
+
+bool initialize_keyword_table() {
+    keyword_table = (KeywordEntry*)calloc(KEYWORD_TABLE_INITIAL_CAPACITY, sizeof(KeywordEntry));
+    if (!keyword_table) { perror("calloc for keyword table failed"); return false; }
+    keyword_table_capacity = KEYWORD_TABLE_INITIAL_CAPACITY;
+    keyword_table_count = 0;
+    for (size_t i = 0; i < BUILTIN_COMMAND_COUNT; i++) {
+        KeywordEntry *entry = insert_keyword_entry(builtin_commands[i].name);
+        if (!entry) return false;
+        strcpy(entry->original, builtin_commands[i].name);
+        entry->builtin = &builtin_commands[i];
+    }
+    return true;
+}
+
+KeywordEntry* find_keyword_entry(const char *word) {
+    if (!keyword_table && !initialize_keyword_table()) return NULL;
+    unsigned long word_hash = hash_variable_name(word);
+    size_t mask = keyword_table_capacity - 1;
+    for (size_t slot = word_hash & mask; keyword_table[slot].word[0] != '\0'; slot = (slot + 1) & mask) {
+        if (keyword_table[slot].word_hash == word_hash && strcmp(keyword_table[slot].word, word) == 0) return &keyword_table[slot];
+    }
+    return NULL;
+}
+
+// Returns the entry for 'word', adding an empty one (original "", no builtin) if new.
+KeywordEntry* insert_keyword_entry(const char *word) {
+    KeywordEntry *existing = find_keyword_entry(word);
+    if (existing) return existing;
+    if ((keyword_table_count + 1) * 2 > keyword_table_capacity) {
+        size_t new_capacity = keyword_table_capacity * 2;
+        KeywordEntry *new_table = (KeywordEntry*)calloc(new_capacity, sizeof(KeywordEntry));
+        if (!new_table) { perror("calloc for keyword table failed"); return NULL; }
+        for (size_t i = 0; i < keyword_table_capacity; i++) {
+            if (keyword_table[i].word[0] == '\0') continue;
+            size_t slot = keyword_table[i].word_hash & (new_capacity - 1);
+            while (new_table[slot].word[0] != '\0') slot = (slot + 1) & (new_capacity - 1);
+            new_table[slot] = keyword_table[i];
+        }
+        free(keyword_table);
+        keyword_table = new_table;
+        keyword_table_capacity = new_capacity;
+    }
+    unsigned long word_hash = hash_variable_name(word);
+    size_t mask = keyword_table_capacity - 1;
+    size_t slot = word_hash & mask;
+    while (keyword_table[slot].word[0] != '\0') slot = (slot + 1) & mask;
+    KeywordEntry *entry = &keyword_table[slot];
+    strncpy(entry->word, word, MAX_KEYWORD_LEN); entry->word[MAX_KEYWORD_LEN] = '\0';
+    entry->word_hash = word_hash;
+    keyword_table_count++;
+    return entry;
+}
+
+// Aliases resolve one level: an alias of an alias names the other alias, not its builtin.
+void add_keyword_alias(const char* original, const char* alias_name) {
+    if (strlen(original) > MAX_KEYWORD_LEN || strlen(alias_name) > MAX_KEYWORD_LEN) {
+        fprintf(stderr, "Keyword or alias too long (max %d chars).\n", MAX_KEYWORD_LEN); return;
+    }
+    KeywordEntry *entry = find_keyword_entry(alias_name);
+    if (entry && entry->is_alias) {
+        fprintf(stderr, "Warning: Alias '%s' already defined for '%s'. Overwriting with new original '%s'.\n", alias_name, entry->original, original);
+    }
+    if (!entry && !(entry = insert_keyword_entry(alias_name))) return;
+    strncpy(entry->original, original, MAX_KEYWORD_LEN); entry->original[MAX_KEYWORD_LEN] = '\0';
+    entry->is_alias = true;
+    if (keyword_alias_signature == 0) keyword_alias_signature = BSH_FNV1A_OFFSET;
+    keyword_alias_signature = hash_bytes_fnv1a(entry->word, strlen(entry->word) + 1, keyword_alias_signature);
+    keyword_alias_signature = hash_bytes_fnv1a(entry->original, strlen(entry->original) + 1, keyword_alias_signature);
+    entry->builtin = find_builtin_command(original);
+}
+
+const char* resolve_keyword_alias(const char* alias_name) {
+    KeywordEntry *entry = find_keyword_entry(alias_name);
+    return entry ? entry->original : alias_name;
+}
+
+void free_keyword_alias_list() {
+    free(keyword_table);
+    keyword_table = NULL;
+    keyword_table_capacity = 0;
+    keyword_table_count = 0;
+    keyword_alias_signature = 0;
+}
+
+// --- Pre-tokenized Line Cache ---
+
+// (Re)builds tl's token stream if it has never been tokenized or if operators were
+// (re)defined since. The tokens are copied out of the tokenizer's scratch buffers into
+// an exactly-sized allocation so a cached line costs only what it uses.
+bool tokenize_line_cached(TokenizedLine *tl, int line_num) {
+    if (tl->tokens && tl->op_epoch == operator_table_epoch) return true;
+    if (tl->tokens && tl->op_signature == operator_symbol_signature) {
+        // Same operator symbols, so the same token boundaries; only re-resolve definitions.
+        for (int i = 0; i < tl->num_tokens; i++) {
+            if (tl->tokens[i].type != TOKEN_OPERATOR) continue;
+            OperatorTrieNode *node = NULL;
+            if (match_operator_trie(tl->tokens[i].text, &node) != tl->tokens[i].len) node = NULL;
+            tl->tokens[i].prefix_op = node ? node->prefix_op : NULL;
+            tl->tokens[i].infix_op = node ? node->infix_op : NULL;
+        }
+        tl->op_epoch = operator_table_epoch;
+        return true;
+    }
+
+    Token scratch_tokens[MAX_EXPRESSION_TOKENS];
+    char scratch_storage[TOKEN_STORAGE_SIZE];
+    int count = advanced_tokenize_line(tl->text, line_num, scratch_tokens, MAX_EXPRESSION_TOKENS, scratch_storage, TOKEN_STORAGE_SIZE);
+
+    size_t storage_used = 0;
+    for (int i = 0; i < count; i++) {
+        if (scratch_tokens[i].type != TOKEN_EOF) storage_used += scratch_tokens[i].len + 1;
+    }
+
+    Token *tokens = (Token*)malloc(sizeof(Token) * (count > 0 ? count : 1));
+    char *storage = (char*)malloc(storage_used > 0 ? storage_used : 1);
+    if (!tokens || !storage) {
+        perror("malloc for tokenized line failed");
+        free(tokens); free(storage);
+        return false;
+    }
+
+    char *storage_ptr = storage;
+    for (int i = 0; i < count; i++) {
+        tokens[i] = scratch_tokens[i];
+        if (scratch_tokens[i].type != TOKEN_EOF) {
+            memcpy(storage_ptr, scratch_tokens[i].text, scratch_tokens[i].len + 1);
+            tokens[i].text = storage_ptr;
+            storage_ptr += scratch_tokens[i].len + 1;
+        }
+    }
+
+    free_tokenized_line(tl);
+    tl->tokens = tokens;
+    tl->token_storage = storage;
+    tl->num_tokens = count;
+    tl->op_epoch = operator_table_epoch;
+    tl->op_signature = operator_symbol_signature;
+    tl->call_epoch = 0; // tokens[0] may have changed
+    return true;
+}
+
+void free_tokenized_line(TokenizedLine *tl) {
+    free(tl->tokens);
+    free(tl->token_storage);
+    tl->tokens = NULL;
+    tl->token_storage = NULL;
+    tl->num_tokens = 0;
+    tl->op_epoch = 0;
+    tl->op_signature = 0;
+    tl->call_target = NULL;
+    tl->call_epoch = 0;
+}
+
+
 // --- Built-in Command Implementations (handle_defoperator_statement updated) ---
 
 void handle_defoperator_statement(Token *tokens, int num_tokens) {
@@ -692,6 +1562,7 @@ void handle_defoperator_statement(Token *tokens, int num_tokens) {
 
     // Syntax: defoperator <op_symbol_str> TYPE <type_enum_str> [PRECEDENCE <N>] [ASSOC <L|R|N>] HANDLER <bsh_func_name>
     // Example: defoperator "+" TYPE BINARY_INFIX PRECEDENCE 10 ASSOC L HANDLER "math_add"
+    // Example: defoperator "+" TYPE BINARY_INFIX PRECEDENCE 10 ASSOC L HANDLER "native:bshmath:bsh_add_numbers"
     if (num_tokens < 6) { // Minimum: defoperator "sym" TYPE SOME_TYPE HANDLER "hdlr"
         fprintf(stderr, "Syntax: defoperator <op_symbol> TYPE <type> [PRECEDENCE <N>] [ASSOC <L|R|N>] HANDLER <handler_func>\n");
         fprintf(stderr, "  TYPE: UNARY_PREFIX, UNARY_POSTFIX, BINARY_INFIX, TERNARY_PRIMARY, TERNARY_SECONDARY\n");
@@ -794,41 +1665,88 @@ void handle_defoperator_statement(Token *tokens, int num_tokens) {
     } else {
         strncpy(bsh_handler_name, handler_name_src, MAX_VAR_NAME_LEN - 1);
         bsh_handler_name[MAX_VAR_NAME_LEN - 1] = '\0';
+        // Unquoted native:lib:sym arrives split around the ':' characters; glue back the
+        // ':' lib ':' sym tokens written directly against it, and nothing after them.
+        int spec_end = current_arg_idx + 5;
+        if (strcmp(bsh_handler_name, "native") == 0 && spec_end <= num_tokens &&
+            strcmp(tokens[current_arg_idx + 1].text, ":") == 0 && tokens[current_arg_idx + 2].type == TOKEN_WORD &&
+            strcmp(tokens[current_arg_idx + 3].text, ":") == 0 && tokens[current_arg_idx + 4].type == TOKEN_WORD) {
+            bool touching = true;
+            for (int i = current_arg_idx; i + 1 < spec_end; i++) touching = touching && tokens_touch(&tokens[i], &tokens[i + 1]);
+            if (touching) {
+                for (int i = current_arg_idx + 1; i < spec_end; i++) {
+                    strncat(bsh_handler_name, tokens[i].text, MAX_VAR_NAME_LEN - 1 - strlen(bsh_handler_name));
+                }
+            }
+        }
     }
     
     if (strlen(bsh_handler_name) == 0) {
          fprintf(stderr, "defoperator: BSH handler name cannot be empty for operator '%s'.\n", op_symbol); return;
     }
 
+    // HANDLER native:<lib_alias>:<symbol> binds the operator straight to a loaded C function.
+    BshLibFunction native_handler = NULL;
+    if (strncmp(bsh_handler_name, "native:", 7) == 0) {
+        native_handler = resolve_native_operator_handler(bsh_handler_name, op_symbol);
+        if (!native_handler) return;
+    }
+
     // Add the operator definition
-    add_operator_definition(op_symbol, TOKEN_OPERATOR, op_type_prop, precedence, assoc, bsh_handler_name);
+    add_operator_definition(op_symbol, TOKEN_OPERATOR, op_type_prop, precedence, assoc, bsh_handler_name, native_handler);
     // printf("DEBUG: Defined operator '%s' TYPE %d PREC %d ASSOC %d HANDLER '%s'\n",
     //        op_symbol, op_type_prop, precedence, assoc, bsh_handler_name);
 }
 
 
 // --- BSH Handler Invocation ---
-bool invoke_bsh_operator_handler(const char* bsh_handler_name_param,
+
+// Applies an operator to already-evaluated operands; shared by the recursive
+// expression parser and the bytecode VM. Native handlers get just the operands,
+// like a calllib function; their output is staged because callers may pass an
+// operand buffer as result_buffer. A BSH handler's result holder is named after the
+// handler nesting depth, so repeated applications reuse one variable name.
+bool apply_operator_definition(OperatorDefinition *op_def, int arg_count, const char *args[],
+                               char *result_buffer, size_t result_buffer_size) {
+    if (op_def->native_handler) {
+        char *native_argv[MAX_ARGS + 1];
+        if (arg_count > MAX_ARGS) arg_count = MAX_ARGS;
+        for (int i = 0; i < arg_count; i++) native_argv[i] = (char*)args[i];
+        native_argv[arg_count] = NULL;
+        char native_output[INPUT_BUFFER_SIZE]; native_output[0] = '\0';
+        int status = op_def->native_handler(arg_count, native_argv, native_output, sizeof(native_output));
+        native_output[sizeof(native_output) - 1] = '\0';
+        strncpy(result_buffer, native_output, result_buffer_size - 1);
+        result_buffer[result_buffer_size - 1] = '\0';
+        if (status != 0) {
+            fprintf(stderr, "Error: Native handler '%s' for operator '%s' failed (status %d): %s\n",
+                    op_def->bsh_handler_name, op_def->op_str, status, native_output);
+            return false;
+        }
+        return true;
+    }
+    char temp_bsh_result_var[MAX_VAR_NAME_LEN]; // Temporary BSH var for the handler
+    snprintf(temp_bsh_result_var, sizeof(temp_bsh_result_var), "__bsh_expr_temp_%d", operator_handler_depth);
+    if (op_def->handler_epoch != function_table_epoch) {
+        op_def->handler_func = find_user_function(op_def->bsh_handler_name);
+        op_def->handler_epoch = function_table_epoch;
+    }
+    operator_handler_depth++;
+    bool ok = invoke_bsh_operator_handler(op_def->handler_func, op_def->bsh_handler_name, op_def->op_str, arg_count, args,
+                                          temp_bsh_result_var, result_buffer, result_buffer_size);
+    operator_handler_depth--;
+    return ok;
+}
+
+bool invoke_bsh_operator_handler(UserFunction* func, const char* bsh_handler_name_param,
                                  const char* op_symbol_param, // The operator itself, for context if handler handles multiple
                                  int arg_count_for_bsh,      // Number of string arguments for BSH
                                  const char* bsh_args_str_array[], // Array of string arguments
                                  const char* result_holder_bsh_var_name,
                                  char* c_result_buffer, size_t c_result_buffer_size) {
 
-    char bsh_handler_name[MAX_VAR_NAME_LEN];
-    strncpy(bsh_handler_name, bsh_handler_name_param, MAX_VAR_NAME_LEN -1);
-    bsh_handler_name[MAX_VAR_NAME_LEN -1] = '\0';
-    
-    char op_symbol[MAX_OPERATOR_LEN +1];
-    strncpy(op_symbol, op_symbol_param ? op_symbol_param : "", MAX_OPERATOR_LEN);
-    op_symbol[MAX_OPERATOR_LEN] = '\0';
-
+    const char* bsh_handler_name = bsh_handler_name_param;
 
-    UserFunction* func = function_list;
-    while (func) {
-        if (strcmp(func->name, bsh_handler_name) == 0) break;
-        func = func->next;
-    }
     if (!func) {
         fprintf(stderr, "Error: BSH operator handler function '%s' not found.\n", bsh_handler_name);
         snprintf(c_result_buffer, c_result_buffer_size, "BSH_HANDLER_NOT_FOUND<%s>", bsh_handler_name);
@@ -846,45 +1764,23 @@ bool invoke_bsh_operator_handler(const char* bsh_handler_name_param,
         return false;
     }
 
-    Token call_tokens_to_bsh[MAX_ARGS]; // Max args for a user function
     if (expected_bsh_params > MAX_ARGS) {
          fprintf(stderr, "Error: Too many arguments for BSH handler call internal limit.\n");
          snprintf(c_result_buffer, c_result_buffer_size, "BSH_HANDLER_ARG_LIMIT_EXCEEDED");
          return false;
     }
 
-    // We need storage for the token text for these dynamic arguments.
-    // Let's create a temporary buffer. This is a simplification.
-    // A more robust solution would manage this memory more carefully or use a list of allocated strings.
-    char arg_storage_for_bsh_call[MAX_ARGS][INPUT_BUFFER_SIZE]; // Max length for each arg string
-
-    int current_bsh_token_idx = 0;
-
-    // 1. Operator Symbol
-    strncpy(arg_storage_for_bsh_call[current_bsh_token_idx], op_symbol, INPUT_BUFFER_SIZE -1);
-    call_tokens_to_bsh[current_bsh_token_idx].type = TOKEN_STRING;
-    call_tokens_to_bsh[current_bsh_token_idx].text = arg_storage_for_bsh_call[current_bsh_token_idx];
-    call_tokens_to_bsh[current_bsh_token_idx].len = strlen(op_symbol);
-    current_bsh_token_idx++;
-
-    // 2. Actual arguments from C expression evaluation
+    // The operand strings are passed by reference and bound verbatim to the handler's
+    // parameters; the only copies made are the parameter variables themselves.
+    const char* handler_args[MAX_ARGS];
+    int handler_arg_count = 0;
+    handler_args[handler_arg_count++] = op_symbol_param ? op_symbol_param : "";   // 1. Operator Symbol
     for (int i = 0; i < arg_count_for_bsh; ++i) {
-        strncpy(arg_storage_for_bsh_call[current_bsh_token_idx], bsh_args_str_array[i], INPUT_BUFFER_SIZE -1);
-        call_tokens_to_bsh[current_bsh_token_idx].type = TOKEN_STRING; // Pass evaluated C strings as BSH strings
-        call_tokens_to_bsh[current_bsh_token_idx].text = arg_storage_for_bsh_call[current_bsh_token_idx];
-        call_tokens_to_bsh[current_bsh_token_idx].len = strlen(bsh_args_str_array[i]);
-        current_bsh_token_idx++;
+        handler_args[handler_arg_count++] = bsh_args_str_array[i];                 // 2. Evaluated operands
     }
-    
-    // 3. Result Holder Variable Name
-    strncpy(arg_storage_for_bsh_call[current_bsh_token_idx], result_holder_bsh_var_name, INPUT_BUFFER_SIZE -1);
-    call_tokens_to_bsh[current_bsh_token_idx].type = TOKEN_WORD; // Pass as variable name
-    call_tokens_to_bsh[current_bsh_token_idx].text = arg_storage_for_bsh_call[current_bsh_token_idx];
-    call_tokens_to_bsh[current_bsh_token_idx].len = strlen(result_holder_bsh_var_name);
-    current_bsh_token_idx++;
+    handler_args[handler_arg_count++] = result_holder_bsh_var_name;               // 3. Result Holder Variable Name
 
-
-    execute_user_function(func, call_tokens_to_bsh, current_bsh_token_idx, NULL); // NULL for file context
+    execute_user_function_with_values(func, handler_args, handler_arg_count, false);
 
     char* result_from_bsh = get_variable_scoped(result_holder_bsh_var_name);
     if (result_from_bsh) {
@@ -944,7 +1840,7 @@ bool parse_operand(ExprParseContext* ctx, char* operand_result_buffer, size_t op
         }
         ctx->current_token_idx++; // Consume ')'
     } else if (current_token.type == TOKEN_OPERATOR) {
-        OperatorDefinition* op_def = get_operator_definition(current_token.text);
+        OperatorDefinition* op_def = current_token.prefix_op;
         if (op_def && op_def->op_type_prop == OP_TYPE_UNARY_PREFIX) {
             ctx->current_token_idx++; // Consume prefix operator
             char rhs_operand_value[INPUT_BUFFER_SIZE];
@@ -958,11 +1854,7 @@ bool parse_operand(ExprParseContext* ctx, char* operand_result_buffer, size_t op
             strncpy(rhs_operand_value, ctx->result_buffer, sizeof(rhs_operand_value)-1);
 
             const char* bsh_args[] = {rhs_operand_value}; // Argument for unary prefix is the operand's value
-            char temp_bsh_result_var[MAX_VAR_NAME_LEN]; // Temporary BSH var for the handler
-            snprintf(temp_bsh_result_var, sizeof(temp_bsh_result_var), "__bsh_expr_temp_%d", rand());
-
-            if (!invoke_bsh_operator_handler(op_def->bsh_handler_name, op_def->op_str, 1, bsh_args,
-                                             temp_bsh_result_var, operand_result_buffer, operand_buffer_size)) {
+            if (!apply_operator_definition(op_def, 1, bsh_args, operand_result_buffer, operand_buffer_size)) {
                 // Error already printed by invoke_bsh_operator_handler or result indicates error
                 // operand_result_buffer might contain "BSH_HANDLER_NOT_FOUND", etc.
             }
@@ -1010,7 +1902,7 @@ bool parse_expression_recursive(ExprParseContext* ctx, int min_precedence) {
         OperatorDefinition* op_def = NULL;
 
         if (lookahead_op_token.type == TOKEN_OPERATOR) {
-            op_def = get_operator_definition(lookahead_op_token.text);
+            op_def = lookahead_op_token.infix_op;
         } else if (lookahead_op_token.type == TOKEN_RPAREN || lookahead_op_token.type == TOKEN_EOF || 
                    lookahead_op_token.type == TOKEN_SEMICOLON /*or other expression terminators*/) {
             break; // End of current expression part
@@ -1046,11 +1938,7 @@ bool parse_expression_recursive(ExprParseContext* ctx, int min_precedence) {
             // Now have LHS (in lhs_value), operator (op_def), RHS (in rhs_value)
             // Invoke BSH handler
             const char* bsh_args[] = {lhs_value, rhs_value};
-            char temp_bsh_result_var[MAX_VAR_NAME_LEN];
-            snprintf(temp_bsh_result_var, sizeof(temp_bsh_result_var), "__bsh_expr_temp_%d", rand());
-
-            if (!invoke_bsh_operator_handler(op_def->bsh_handler_name, op_def->op_str, 2, bsh_args,
-                                             temp_bsh_result_var, lhs_value, sizeof(lhs_value))) { // Result stored back in lhs_value for next iteration
+            if (!apply_operator_definition(op_def, 2, bsh_args, lhs_value, sizeof(lhs_value))) { // Result stored back in lhs_value for next iteration
                 // Error from BSH handler; lhs_value now contains the error string.
             }
             strncpy(ctx->result_buffer, lhs_value, ctx->result_buffer_size-1); // Update main result with new LHS
@@ -1062,11 +1950,7 @@ bool parse_expression_recursive(ExprParseContext* ctx, int min_precedence) {
 
             // LHS is in lhs_value. Apply postfix op to it.
             const char* bsh_args[] = {lhs_value}; // For postfix, operand is the LHS.
-            char temp_bsh_result_var[MAX_VAR_NAME_LEN];
-            snprintf(temp_bsh_result_var, sizeof(temp_bsh_result_var), "__bsh_expr_temp_%d", rand());
-
-            if (!invoke_bsh_operator_handler(op_def->bsh_handler_name, op_def->op_str, 1, bsh_args,
-                                             temp_bsh_result_var, lhs_value, sizeof(lhs_value))) { // Result stored back
+            if (!apply_operator_definition(op_def, 1, bsh_args, lhs_value, sizeof(lhs_value))) { // Result stored back
                 // Error from BSH handler
             }
             strncpy(ctx->result_buffer, lhs_value, ctx->result_buffer_size-1); // Update main result
@@ -1104,12 +1988,8 @@ bool parse_expression_recursive(ExprParseContext* ctx, int min_precedence) {
             // Now have Cond (lhs_value), TrueExpr (true_branch_value), FalseExpr (false_branch_value)
             // Invoke BSH handler for ternary. It expects 3 operands.
             const char* bsh_args[] = {lhs_value, true_branch_value, false_branch_value};
-            char temp_bsh_result_var[MAX_VAR_NAME_LEN];
-            snprintf(temp_bsh_result_var, sizeof(temp_bsh_result_var), "__bsh_expr_temp_%d", rand());
-
             // The BSH handler name for '?' (op_def->bsh_handler_name) should be designed for this.
-            if (!invoke_bsh_operator_handler(op_def->bsh_handler_name, op_def->op_str, 3, bsh_args,
-                                             temp_bsh_result_var, lhs_value, sizeof(lhs_value))) {
+            if (!apply_operator_definition(op_def, 3, bsh_args, lhs_value, sizeof(lhs_value))) {
                 // Error
             }
             strncpy(ctx->result_buffer, lhs_value, ctx->result_buffer_size-1);
@@ -1174,18 +2054,42 @@ bool evaluate_expression_from_tokens(Token* expression_tokens, int num_expr_toke
 
 // --- process_line updated to use new expression evaluation ---
 void process_line(char *line_raw, FILE *input_source, int current_line_no, ExecutionState exec_mode_param) {
-    char line[MAX_LINE_LENGTH];
-    strncpy(line, line_raw, MAX_LINE_LENGTH -1);
-    line[MAX_LINE_LENGTH-1] = '\0';
-    trim_whitespace(line);
+    char line_buffer[MAX_LINE_LENGTH];
+    strncpy(line_buffer, line_raw, MAX_LINE_LENGTH -1);
+    line_buffer[MAX_LINE_LENGTH-1] = '\0';
+    char *line = trim_whitespace(line_buffer); // Leading '}' must be visible to capture_function_body_line
 
     if (line[0] == '\0') return;
 
-    // ... (function definition body capture remains similar) ...
+    if (capture_function_body_line(line, exec_mode_param)) return;
+
+    Token tokens[MAX_EXPRESSION_TOKENS]; // Max tokens for one line/expression
+    char token_storage[TOKEN_STORAGE_SIZE];
+    int num_tokens = advanced_tokenize_line(line, current_line_no, tokens, MAX_EXPRESSION_TOKENS, token_storage, TOKEN_STORAGE_SIZE);
+
+    execute_tokenized_line(tokens, num_tokens, NULL, input_source, current_line_no, exec_mode_param);
+}
+
+// Runs a line whose token stream is cached (e.g. a function body line), skipping
+// the copy/trim/tokenize work of process_line. 'tl->text' must already be trimmed.
+void process_tokenized_line(TokenizedLine *tl, FILE *input_source, int current_line_no, ExecutionState exec_mode_param) {
+    if (tl->text[0] == '\0') return;
+    if (capture_function_body_line(tl->text, exec_mode_param)) return;
+    if (!tokenize_line_cached(tl, current_line_no)) return;
+    execute_tokenized_line(tl->tokens, tl->num_tokens, tl, input_source, current_line_no, exec_mode_param);
+}
+
+// While a 'defunc' body is open, lines are stored verbatim instead of executed.
+// Braces of blocks inside the body are counted so that only the '}' matching the
+// definition ends it. Returns true if 'line' was consumed as part of a function body.
+bool capture_function_body_line(const char *line, ExecutionState exec_mode_param) {
     if (is_defining_function && current_function_definition &&
         (current_exec_state == STATE_DEFINE_FUNC_BODY || current_exec_state == STATE_IMPORT_PARSING || exec_mode_param == STATE_IMPORT_PARSING) &&
         block_stack_top_bf >=0 && peek_block_bf() && peek_block_bf()->type == BLOCK_TYPE_FUNCTION_DEF && 
-        strncmp(line, "}", 1) != 0 && strncmp(line, "}", strlen(line)) != 0 ) { 
+        (line[0] != '}' || function_body_brace_depth > 0)) { 
+
+        if (line[0] == '}') function_body_brace_depth--;
+        if (bytecode_line_opens_block(line)) function_body_brace_depth++;
 
         if (current_function_definition->line_count < MAX_FUNC_LINES) {
             current_function_definition->body[current_function_definition->line_count] = strdup(line);
@@ -1195,20 +2099,43 @@ void process_line(char *line_raw, FILE *input_source, int current_line_no, Execu
                 current_function_definition->line_count++;
             }
         } else { /* ... error handling for too many lines ... */ }
-        return; 
+        return true; 
     }
+    return false;
+}
 
+// Line engine over in-memory lines; line N is lines[N-1]. 'cached_lines' (optional)
+// holds their token streams, used while they match the operator table. With
+// 'refresh_cache' the streams are built on first use and rebuilt in place when
+// stale, so loop iterations after the first skip the tokenizer.
+void execute_line_sequence(char **lines, TokenizedLine *cached_lines, int line_count, bool refresh_cache, ExecutionState exec_mode_param) {
+    line_sequence_depth++;
+    int outer_record_loops = record_loop_count;
+    for (int i = 0; i < line_count; ++i) {
+        if (cached_lines && (refresh_cache || (cached_lines[i].tokens && cached_lines[i].op_epoch == operator_table_epoch))) {
+            process_tokenized_line(&cached_lines[i], NULL, i + 1, exec_mode_param);
+        } else {
+            char line_copy[MAX_LINE_LENGTH]; 
+            strncpy(line_copy, lines[i], MAX_LINE_LENGTH-1); line_copy[MAX_LINE_LENGTH-1] = '\0';
+            process_line(line_copy, NULL, i + 1, exec_mode_param); 
+        }
+        if (loop_restart_line_no > 0) {
+            i = loop_restart_line_no - 2; // Loop increment lands on the 'while' line
+            loop_restart_line_no = 0;
+        }
+    }
+    close_record_loops_above(outer_record_loops); // Left by 'return'/'exit' inside the body
+    line_sequence_depth--;
+}
 
-    Token tokens[MAX_EXPRESSION_TOKENS]; // Max tokens for one line/expression
-    char token_storage[TOKEN_STORAGE_SIZE];
-    int num_tokens = advanced_tokenize_line(line, current_line_no, tokens, MAX_EXPRESSION_TOKENS, token_storage, TOKEN_STORAGE_SIZE);
-
+void execute_tokenized_line(Token *tokens, int num_tokens, TokenizedLine *call_site, FILE *input_source, int current_line_no, ExecutionState exec_mode_param) {
     if (num_tokens == 0 || tokens[0].type == TOKEN_EMPTY || tokens[0].type == TOKEN_EOF) return;
     if (tokens[0].type == TOKEN_COMMENT) return; // Already handled if tokenizer skips comments entirely
 
     // ... ( '{' and '}' handling for blocks remains similar, but ensure exec_state is checked ) ...
-    if (tokens[0].type == TOKEN_LBRACE && num_tokens == 1) { handle_opening_brace_token(tokens[0]); return; }
-    if (tokens[0].type == TOKEN_RBRACE && num_tokens == 1) { handle_closing_brace_token(tokens[0], input_source); return; }
+    bool lone_token = (num_tokens == 1 || tokens[1].type == TOKEN_EOF);
+    if (tokens[0].type == TOKEN_LBRACE && lone_token) { handle_opening_brace_token(tokens[0]); return; }
+    if (tokens[0].type == TOKEN_RBRACE && lone_token) { handle_closing_brace_token(tokens[0]); return; }
 
 
     // ... (current_exec_state == STATE_BLOCK_SKIP logic remains similar) ...
@@ -1219,7 +2146,7 @@ void process_line(char *line_raw, FILE *input_source, int current_line_no, Execu
         }
 
         if (tokens[0].type == TOKEN_RBRACE) { 
-            handle_closing_brace_token(tokens[0], input_source);
+            handle_closing_brace_token(tokens[0]);
         } else if (first_token_text_resolved &&
                    (strcmp(first_token_text_resolved, "else") == 0 )) {
             handle_else_statement_advanced(tokens, num_tokens, input_source, current_line_no);
@@ -1227,6 +2154,8 @@ void process_line(char *line_raw, FILE *input_source, int current_line_no, Execu
             push_block_bf(BLOCK_TYPE_IF, false, 0, current_line_no);
         } else if (first_token_text_resolved && strcmp(first_token_text_resolved, "while") == 0){
             push_block_bf(BLOCK_TYPE_WHILE, false, 0, current_line_no);
+        } else if (first_token_text_resolved && strcmp(first_token_text_resolved, "foreach_record") == 0){
+            push_block_bf(BLOCK_TYPE_FOREACH_RECORD, false, 0, current_line_no);
         } else if (first_token_text_resolved && strcmp(first_token_text_resolved, "defunc") == 0){
              push_block_bf(BLOCK_TYPE_FUNCTION_DEF, false, 0, current_line_no); 
         } else if (tokens[0].type == TOKEN_LBRACE) { 
@@ -1241,6 +2170,15 @@ void process_line(char *line_raw, FILE *input_source, int current_line_no, Execu
         // If a return/exit happened, subsequent lines in the current context (script/function) are skipped.
         return;
     }
+    if (child_status_changed) reap_background_jobs();
+
+    // 'command args... &' runs without waiting (see start_background_job).
+    int command_end = num_tokens;
+    while (command_end > 0 && (tokens[command_end - 1].type == TOKEN_EOF || tokens[command_end - 1].type == TOKEN_COMMENT)) command_end--;
+    if (command_end > 0 && tokens[command_end - 1].type == TOKEN_AMPERSAND) {
+        start_background_job(tokens, command_end - 1, call_site, input_source);
+        return;
+    }
 
 
     // --- Actual command/statement processing ---
@@ -1268,31 +2206,28 @@ void process_line(char *line_raw, FILE *input_source, int current_line_no, Execu
         }
     }
 
+    // A '|' makes a pipeline unless the line is a block statement (e.g. an 'if' whose
+    // condition uses '||' while no '||' operator is defined); those see every token.
+    bool is_pipeline = false;
+    for (int i = 1; !is_assignment && tokens[0].type == TOKEN_WORD && i < num_tokens; i++) {
+        if (tokens[i].type == TOKEN_PIPE) { is_pipeline = !word_starts_block_statement(tokens[0].text); break; }
+    }
+
     if (is_assignment) {
         handle_assignment_advanced(tokens, num_tokens); // This will use evaluate_expression_from_tokens for RHS
     }
+    else if (is_pipeline) { execute_pipeline(tokens, num_tokens); }
     // 2. Built-in keywords (if, while, defunc, echo, etc.)
     else if (tokens[0].type == TOKEN_WORD) {
-        const char* command_name = resolve_keyword_alias(tokens[0].text);
-        // ... (dispatch to handle_if, handle_while, handle_echo, handle_defunc, handle_defoperator, etc.) ...
+        // One lookup resolves aliases and finds the builtin (see builtin_commands[]).
         // These handlers for if/while will use evaluate_expression_from_tokens for their conditions.
-        if (strcmp(command_name, "echo") == 0) { handle_echo_advanced(tokens, num_tokens); }
-        else if (strcmp(command_name, "defkeyword") == 0) { handle_defkeyword_statement(tokens, num_tokens); }
-        else if (strcmp(command_name, "defoperator") == 0) { handle_defoperator_statement(tokens, num_tokens); }
-        else if (strcmp(command_name, "if") == 0) { handle_if_statement_advanced(tokens, num_tokens, input_source, current_line_no); }
-        else if (strcmp(command_name, "else") == 0) { handle_else_statement_advanced(tokens, num_tokens, input_source, current_line_no); }
-        else if (strcmp(command_name, "while") == 0) { handle_while_statement_advanced(tokens, num_tokens, input_source, current_line_no); }
-        else if (strcmp(command_name, "defunc") == 0) { handle_defunc_statement_advanced(tokens, num_tokens); }
-        else if (strcmp(command_name, "loadlib") == 0) { handle_loadlib_statement(tokens, num_tokens); }
-        else if (strcmp(command_name, "calllib") == 0) { handle_calllib_statement(tokens, num_tokens); }
-        else if (strcmp(command_name, "import") == 0) { handle_import_statement(tokens, num_tokens); }
-        else if (strcmp(command_name, "update_cwd") == 0) { handle_update_cwd_statement(tokens, num_tokens); }
-        else if (strcmp(command_name, "eval") == 0) { handle_eval_statement(tokens, num_tokens); }
-        else if (strcmp(command_name, "exit") == 0) { handle_exit_statement(tokens, num_tokens); }
-        // Add other built-ins here
+        KeywordEntry *keyword = find_keyword_entry(tokens[0].text);
+        const BuiltinCommand *builtin = keyword ? keyword->builtin : NULL;
+        if (builtin && builtin->block_handler) { builtin->block_handler(tokens, num_tokens, input_source, current_line_no); }
+        else if (builtin) { builtin->handler(tokens, num_tokens); }
         else {
             // Not a built-in keyword. Could be user function or external command OR standalone expression.
-            UserFunction* func_to_run = function_list; /* ... find func ... */
+            UserFunction* func_to_run = resolve_call_site_function(call_site, tokens[0].text);
             if (func_to_run) {
                 execute_user_function(func_to_run, &tokens[1], num_tokens - 1, input_source);
             } else {
@@ -1300,8 +2235,10 @@ void process_line(char *line_raw, FILE *input_source, int current_line_no, Execu
                 char command_path_ext[MAX_FULL_PATH_LEN];
                 if (find_command_in_path_dynamic(tokens[0].text, command_path_ext)) {
                     // ... (original external command execution logic) ...
-                     char *args[MAX_ARGS + 1]; /* ... populate args ... */
-                     execute_external_command(command_path_ext, args, num_tokens /*adjust*/, NULL, 0);
+                     char *args[MAX_ARGS + 1];
+                     int arg_count = build_command_argv(tokens, num_tokens, args);
+                     execute_external_command(command_path_ext, args, arg_count, NULL, 0);
+                     free_command_argv(args, arg_count);
                 } else {
                     // Not a known command, try to evaluate the whole line as an expression
                     char expression_result_buffer[INPUT_BUFFER_SIZE];
@@ -1347,9 +2284,31 @@ void handle_assignment_advanced(Token *tokens, int num_tokens) {
     // Operator at tokens[1] should be "=" (or its equivalent if defined differently)
     if (current_exec_state == STATE_BLOCK_SKIP) return;
 
+    // RHS: Evaluate tokens from index 2 onwards
+    char rhs_value_buffer[INPUT_BUFFER_SIZE];
+    if (num_tokens > 2) { // If there is an RHS
+        if (!evaluate_expression_from_tokens(&tokens[2], num_tokens - 2, rhs_value_buffer, sizeof(rhs_value_buffer))) {
+            // Evaluation failed, error already printed or in rhs_value_buffer.
+            // Optionally, set target variable to error string or do nothing.
+            // For now, let's proceed to set whatever is in rhs_value_buffer (could be an error marker string).
+             fprintf(stderr, "Error evaluating RHS for assignment to '%s'. Result: %s\n", tokens[0].text, rhs_value_buffer);
+             // Decide if assignment should still happen with the error string, or if it should be skipped.
+             // Let's assign the error string for now, so it's visible.
+        }
+    } else { // No RHS (e.g., $var =), set to empty string
+        rhs_value_buffer[0] = '\0';
+    }
+
+    assign_evaluated_value(&tokens[0], rhs_value_buffer);
+}
+
+// Stores an already-evaluated RHS into the variable or array element named by the
+// TOKEN_VARIABLE 'target_token', parsing "object:"/"json:" payloads on the way.
+// 'rhs_value_buffer' may be rewritten in place.
+void assign_evaluated_value(const Token *target_token, char *rhs_value_buffer) {
     // LHS (variable name or array element)
     char var_token_text_copy[MAX_VAR_NAME_LEN * 2]; 
-    strncpy(var_token_text_copy, tokens[0].text + 1, sizeof(var_token_text_copy) -1); 
+    strncpy(var_token_text_copy, target_token->text + 1, sizeof(var_token_text_copy) -1); 
     var_token_text_copy[sizeof(var_token_text_copy)-1] = '\0';
 
     char base_var_name[MAX_VAR_NAME_LEN]; char index_str_raw[MAX_VAR_NAME_LEN] = ""; bool is_array_assignment = false;
@@ -1363,25 +2322,9 @@ void handle_assignment_advanced(Token *tokens, int num_tokens) {
             strncpy(base_var_name, var_token_text_copy, base_len); base_var_name[base_len] = '\0';
             size_t index_len = end_bracket_ptr - (bracket_ptr + 1);
             strncpy(index_str_raw, bracket_ptr + 1, index_len); index_str_raw[index_len] = '\0';
-        } else { fprintf(stderr, "Malformed array assignment: %s\n", tokens[0].text); return; }
+        } else { fprintf(stderr, "Malformed array assignment: %s\n", target_token->text); return; }
     } else { strncpy(base_var_name, var_token_text_copy, MAX_VAR_NAME_LEN - 1); base_var_name[MAX_VAR_NAME_LEN - 1] = '\0'; }
 
-
-    // RHS: Evaluate tokens from index 2 onwards
-    char rhs_value_buffer[INPUT_BUFFER_SIZE];
-    if (num_tokens > 2) { // If there is an RHS
-        if (!evaluate_expression_from_tokens(&tokens[2], num_tokens - 2, rhs_value_buffer, sizeof(rhs_value_buffer))) {
-            // Evaluation failed, error already printed or in rhs_value_buffer.
-            // Optionally, set target variable to error string or do nothing.
-            // For now, let's proceed to set whatever is in rhs_value_buffer (could be an error marker string).
-             fprintf(stderr, "Error evaluating RHS for assignment to '%s'. Result: %s\n", base_var_name, rhs_value_buffer);
-             // Decide if assignment should still happen with the error string, or if it should be skipped.
-             // Let's assign the error string for now, so it's visible.
-        }
-    } else { // No RHS (e.g., $var =), set to empty string
-        rhs_value_buffer[0] = '\0';
-    }
-    
     // Check for "object:" or "json:" prefix on the evaluated RHS result
     bool structured_data_parsed = false;
     const char* data_to_parse = NULL;
@@ -1397,12 +2340,14 @@ void handle_assignment_advanced(Token *tokens, int num_tokens) {
         structured_data_parsed = true;
     }
 
+    // The variable keeps the raw data (minus prefix) as its value; a plain variable
+    // also gets the parsed tree for dot access and echo.
+    BshObject *parsed_object = NULL;
     if (structured_data_parsed) {
-        int current_scope_id_for_obj = (scope_stack_top >= 0) ? scope_stack[scope_stack_top].scope_id : GLOBAL_SCOPE_ID;
-        parse_and_flatten_bsh_object_string(data_to_parse, base_var_name, current_scope_id_for_obj); //
-        
-        // The main variable ($base_var_name) can be set to the raw data (minus prefix) or a special marker.
-        // Let's use the raw data (minus prefix).
+        if (!is_array_assignment) {
+            parsed_object = strcmp(detected_prefix_str, JSON_STDOUT_PREFIX) == 0 ? parse_json_string(data_to_parse, strlen(data_to_parse))
+                                                                                  : parse_bsh_object_string(data_to_parse, strlen(data_to_parse));
+        }
         memmove(rhs_value_buffer, (char*)data_to_parse, strlen(data_to_parse) + 1);
     }
 
@@ -1411,6 +2356,9 @@ void handle_assignment_advanced(Token *tokens, int num_tokens) {
         set_array_element_scoped(base_var_name, index_str_raw, rhs_value_buffer);
     } else {
         set_variable_scoped(base_var_name, rhs_value_buffer, false);
+        Variable *assigned = scope_stack_top >= 0 ? find_variable_in_frame(assignment_frame(base_var_name), base_var_name, hash_variable_name(base_var_name)) : NULL;
+        if (assigned && parsed_object) { assigned->object = parsed_object; parsed_object = NULL; }
+        free_bsh_object(parsed_object);
     }
 }
 
@@ -1423,17 +2371,15 @@ void handle_if_statement_advanced(Token *tokens, int num_tokens, FILE* input_sou
         char condition_result_str[INPUT_BUFFER_SIZE];
         // The condition is from tokens[1] to before '{' or end of line.
         int condition_end_idx = num_tokens -1;
-        if (tokens[num_tokens-1].type == TOKEN_LBRACE) condition_end_idx--;
+        if (tokens[condition_end_idx].type == TOKEN_EOF) condition_end_idx--;
+        if (tokens[condition_end_idx].type == TOKEN_LBRACE) condition_end_idx--;
         if (tokens[condition_end_idx].type == TOKEN_COMMENT) condition_end_idx--;
 
 
         if (condition_end_idx >= 1) {
             if (evaluate_expression_from_tokens(&tokens[1], (condition_end_idx - 1) + 1,
                                                 condition_result_str, sizeof(condition_result_str))) {
-                // Evaluate truthiness of condition_result_str
-                condition_is_true = (strcmp(condition_result_str, "1") == 0 ||
-                                     strcasecmp(condition_result_str, "true") == 0 ||
-                                     (strlen(condition_result_str) > 0 && strcmp(condition_result_str,"0") != 0 && strcasecmp(condition_result_str,"false") !=0 ) );
+                condition_is_true = bsh_value_is_truthy(condition_result_str);
             } else {
                 fprintf(stderr, "Error evaluating 'if' condition: %s (line %d)\n", condition_result_str, current_line_no);
                 condition_is_true = false; // Treat evaluation error as false condition
@@ -1459,25 +2405,25 @@ void initialize_shell() {
     // Initialize core structural operators if they are not dynamically defined
     initialize_operators_core_structural(); // Call the new initializer
 
-    // ... rest of initialize_shell (PATH, BSH_MODULE_PATH, default vars) ...
-    char *path_env = getenv("PATH"); //
-    if (path_env) { //
-        char *path_copy = strdup(path_env); //
-        if (path_copy) { //
-            char *token_path = strtok(path_copy, ":"); //
-            while (token_path) { //
-                add_path_to_list(&path_list_head, token_path); //
-                token_path = strtok(NULL, ":"); //
-            }
-            free(path_copy); //
-        } else { perror("strdup for PATH failed in initialize_shell"); } //
-    }
-
-    initialize_module_path();  //
-
     set_variable_scoped("SHELL_VERSION", "bsh-dynamic-expr-0.9", false); // Updated version
     set_variable_scoped("PS1", "bsh", false);  //
 
+    initialize_process_state();
+}
+
+// State taken from the running process (SIGCHLD handler, PATH, module search path, CWD). Separate from
+// initialize_shell so a restored snapshot picks these up from the current environment.
+void initialize_process_state() {
+    struct sigaction sigchld_action;
+    memset(&sigchld_action, 0, sizeof(sigchld_action));
+    sigchld_action.sa_handler = handle_sigchld;
+    sigemptyset(&sigchld_action.sa_mask);
+    sigchld_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sigchld_action, NULL);
+
+    build_path_list();
+    initialize_module_path();  //
+
     char* initial_module_path_env = getenv("BSH_MODULE_PATH"); //
     if (!initial_module_path_env || strlen(initial_module_path_env) == 0) { //
         initial_module_path_env = DEFAULT_MODULE_PATH; //
@@ -1493,14 +2439,55 @@ void initialize_shell() {
     }
 }
 
+// Releases everything the shell allocated, before exiting.
+void cleanup_shell() {
+    free_all_variables();
+    free_function_list();
+    free_operator_list();
+    free_keyword_alias_list();
+    free_path_dir_list(&path_list_head);
+    free_path_dir_list(&module_path_list_head);
+    clear_command_cache();
+    free_job_list();
+    free_loaded_libs();
+    free_expression_stack_pool();
+
+    while (scope_stack_top >= 0) {
+        leave_scope(scope_stack[scope_stack_top].scope_id);
+    }
+}
+
 int main(int argc, char *argv[]) {
-    initialize_shell(); //
+    int script_arg_idx = 1;
+    const char *snapshot_save_path = NULL;
+    const char *snapshot_load_path = NULL;
+    while (script_arg_idx < argc && strncmp(argv[script_arg_idx], "--", 2) == 0) {
+        const char *option = argv[script_arg_idx];
+        if (strncmp(option, "--engine=", 9) == 0) {
+            const char *engine_name = option + 9;
+            if (strcmp(engine_name, "vm") == 0) bsh_engine_mode = ENGINE_VM;
+            else if (strcmp(engine_name, "line") == 0) bsh_engine_mode = ENGINE_LINE;
+            else { fprintf(stderr, "bsh: unknown engine '%s' (expected 'vm' or 'line')\n", engine_name); return 1; }
+        } else if (strcmp(option, "--snapshot-save") == 0 && script_arg_idx + 1 < argc) {
+            snapshot_save_path = argv[++script_arg_idx];
+        } else if (strcmp(option, "--snapshot-load") == 0 && script_arg_idx + 1 < argc) {
+            snapshot_load_path = argv[++script_arg_idx];
+        } else {
+            fprintf(stderr, "bsh: unknown option '%s'\n", option); return 1;
+        }
+        script_arg_idx++;
+    }
+
+    // A usable snapshot replaces initialize_shell and the startup script.
+    bool restored_snapshot = snapshot_load_path && load_interpreter_snapshot(snapshot_load_path);
+    if (!restored_snapshot) initialize_shell(); //
+    set_variable_scoped("BSH_ENGINE", bsh_engine_mode == ENGINE_VM ? "vm" : "line", false);
 
     // Execute default startup script
     char startup_script_path[MAX_FULL_PATH_LEN]; //
     char* home_dir = getenv("HOME"); //
-    bool startup_executed = false; //
-    if (home_dir) { //
+    bool startup_executed = restored_snapshot; //
+    if (home_dir && !startup_executed) { //
         snprintf(startup_script_path, sizeof(startup_script_path), "%s/%s", home_dir, DEFAULT_STARTUP_SCRIPT); //
         if (access(startup_script_path, F_OK) == 0) { //
             execute_script(startup_script_path, false, true);  //
@@ -1513,8 +2500,13 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (argc > 1) {  //
-        execute_script(argv[1], false, false);  //
+    if (snapshot_save_path) {
+        if (!save_interpreter_snapshot(snapshot_save_path)) { cleanup_shell(); return 1; }
+        if (argc <= script_arg_idx) { cleanup_shell(); return 0; } // Nothing to run: just build the snapshot
+    }
+
+    if (argc > script_arg_idx) {  //
+        execute_script(argv[script_arg_idx], false, false);  //
     } else { // Interactive mode
         char line_buffer[INPUT_BUFFER_SIZE]; //
         char prompt_buffer[MAX_VAR_NAME_LEN + 30];  //
@@ -1525,6 +2517,14 @@ int main(int argc, char *argv[]) {
             bsh_return_value_is_set = false;
             current_exec_state = STATE_NORMAL; // Ensure normal state for new prompt
 
+            // Report background jobs that finished since the last prompt ('wait' drops them)
+            if (child_status_changed) reap_background_jobs();
+            for (Job *job = job_list_head; job; job = job->next) {
+                if (job->running_count > 0 || job->reported) continue;
+                printf("[%d] Done (%d) %s\n", job->id, job->status, job->command);
+                job->reported = true;
+            }
+
             char* current_prompt_val = get_variable_scoped("PS1"); //
             if (!current_prompt_val || strlen(current_prompt_val) == 0) { //
                 current_prompt_val = "bsh";  //
@@ -1538,6 +2538,7 @@ int main(int argc, char *argv[]) {
                     if (top_block->type == BLOCK_TYPE_IF) block_type_str = "if";
                     else if (top_block->type == BLOCK_TYPE_ELSE) block_type_str = "else";
                     else if (top_block->type == BLOCK_TYPE_WHILE) block_type_str = "while";
+                    else if (top_block->type == BLOCK_TYPE_FOREACH_RECORD) block_type_str = "foreach_record";
                     else if (top_block->type == BLOCK_TYPE_FUNCTION_DEF) block_type_str = "defunc_body";
                 }
 
@@ -1683,21 +2684,7 @@ void handle_while_statement_advanced(Token *tokens, int num_tokens, FILE* input_
             condition_token_idx = 2;
         }
 
-        if (num_tokens >= condition_token_idx + 3 && tokens[condition_token_idx + 1].type == TOKEN_OPERATOR) {
-             condition_result = evaluate_condition_advanced(&tokens[condition_token_idx], &tokens[condition_token_idx+1], &tokens[condition_token_idx+2]);
-        } else { 
-            char condition_value_expanded[INPUT_BUFFER_SIZE];
-            if (tokens[condition_token_idx].type == TOKEN_STRING) {
-                char unescaped[INPUT_BUFFER_SIZE];
-                unescape_string(tokens[condition_token_idx].text, unescaped, sizeof(unescaped));
-                expand_variables_in_string_advanced(unescaped, condition_value_expanded, sizeof(condition_value_expanded));
-            } else {
-                expand_variables_in_string_advanced(tokens[condition_token_idx].text, condition_value_expanded, sizeof(condition_value_expanded));
-            }
-            condition_result = (strcmp(condition_value_expanded, "1") == 0 || 
-                                (strcmp(condition_value_expanded, "true") == 0) ||
-                                (strlen(condition_value_expanded) > 0 && strcmp(condition_value_expanded,"0") != 0 && strcmp(condition_value_expanded,"false") !=0 ) );
-        }
+        condition_result = evaluate_condition_tokens(&tokens[condition_token_idx], num_tokens - condition_token_idx);
 
         if (negate_result) {
             condition_result = !condition_result;
@@ -1761,21 +2748,7 @@ void handle_else_statement_advanced(Token *tokens, int num_tokens, FILE* input_s
                 }
                 if (execute_this_else_branch == false && !(negate_result && num_tokens <4) && !(num_tokens <3) ) { 
                     if (current_exec_state != STATE_BLOCK_SKIP) { 
-                        if (num_tokens >= condition_token_idx + 3 && tokens[condition_token_idx + 1].type == TOKEN_OPERATOR) {
-                             execute_this_else_branch = evaluate_condition_advanced(&tokens[condition_token_idx], &tokens[condition_token_idx+1], &tokens[condition_token_idx+2]);
-                        } else { 
-                            char condition_value_expanded[INPUT_BUFFER_SIZE];
-                            if (tokens[condition_token_idx].type == TOKEN_STRING) {
-                                char unescaped[INPUT_BUFFER_SIZE];
-                                unescape_string(tokens[condition_token_idx].text, unescaped, sizeof(unescaped));
-                                expand_variables_in_string_advanced(unescaped, condition_value_expanded, sizeof(condition_value_expanded));
-                            } else {
-                                expand_variables_in_string_advanced(tokens[condition_token_idx].text, condition_value_expanded, sizeof(condition_value_expanded));
-                            }
-                             execute_this_else_branch = (strcmp(condition_value_expanded, "1") == 0 || 
-                                (strcmp(condition_value_expanded, "true") == 0) ||
-                                (strlen(condition_value_expanded) > 0 && strcmp(condition_value_expanded,"0") != 0 && strcmp(condition_value_expanded,"false") !=0 ) );
-                        }
+                        execute_this_else_branch = evaluate_condition_tokens(&tokens[condition_token_idx], num_tokens - condition_token_idx);
                         if (negate_result) execute_this_else_branch = !execute_this_else_branch;
                     } else { 
                         execute_this_else_branch = false;
@@ -1854,6 +2827,7 @@ void handle_defunc_statement_advanced(Token *tokens, int num_tokens) {
         token_idx++;
     }
 
+    function_body_brace_depth = 0;
     if (token_idx < num_tokens && tokens[token_idx].type == TOKEN_LBRACE) { 
         is_defining_function = true;
         if (current_exec_state != STATE_IMPORT_PARSING) current_exec_state = STATE_DEFINE_FUNC_BODY;
@@ -1938,6 +2912,7 @@ void handle_inc_dec_statement_advanced(Token *tokens, int num_tokens, bool incre
 
 void handle_loadlib_statement(Token *tokens, int num_tokens) {
     // ... (remains the same)
+    if (num_tokens > 0 && tokens[num_tokens - 1].type == TOKEN_EOF) num_tokens--;
     if (num_tokens != 3) { fprintf(stderr, "Syntax: loadlib <path_or_$var> <alias_or_$var>\n"); return; }
     if (current_exec_state == STATE_BLOCK_SKIP) return;
     char lib_path[MAX_FULL_PATH_LEN], alias[MAX_VAR_NAME_LEN];
@@ -1959,17 +2934,54 @@ void handle_loadlib_statement(Token *tokens, int num_tokens) {
     }
 
     if (strlen(lib_path) == 0 || strlen(alias) == 0) { fprintf(stderr, "loadlib error: Path or alias is empty.\n"); return; }
-    DynamicLib* current_lib = loaded_libs; while(current_lib) { if (strcmp(current_lib->alias, alias) == 0) { fprintf(stderr, "Error: Lib alias '%s' in use.\n", alias); return; } current_lib = current_lib->next; }
+    load_dynamic_library(lib_path, alias);
+}
+
+// dlopens 'lib_path' and registers it under 'alias'; prints why on failure.
+bool load_dynamic_library(const char *lib_path, const char *alias) {
+    DynamicLib* current_lib = loaded_libs; while(current_lib) { if (strcmp(current_lib->alias, alias) == 0) { fprintf(stderr, "Error: Lib alias '%s' in use.\n", alias); return false; } current_lib = current_lib->next; }
     void *handle = dlopen(lib_path, RTLD_LAZY | RTLD_GLOBAL);
-    if (!handle) { fprintf(stderr, "Error loading library '%s': %s\n", lib_path, dlerror()); return; }
+    if (!handle) { fprintf(stderr, "Error loading library '%s': %s\n", lib_path, dlerror()); return false; }
     DynamicLib *new_lib_entry = (DynamicLib*)malloc(sizeof(DynamicLib));
-    if (!new_lib_entry) { perror("malloc for new_lib_entry failed"); dlclose(handle); return; }
+    if (!new_lib_entry) { perror("malloc for new_lib_entry failed"); dlclose(handle); return false; }
     strncpy(new_lib_entry->alias, alias, MAX_VAR_NAME_LEN -1); new_lib_entry->alias[MAX_VAR_NAME_LEN-1] = '\0';
+    strncpy(new_lib_entry->path, lib_path, MAX_FULL_PATH_LEN -1); new_lib_entry->path[MAX_FULL_PATH_LEN-1] = '\0';
     new_lib_entry->handle = handle; new_lib_entry->next = loaded_libs; loaded_libs = new_lib_entry;
+    return true;
+}
+
+// Resolves a "native:<lib_alias>:<symbol>" operator handler spec; prints why on failure.
+BshLibFunction resolve_native_operator_handler(const char *spec, const char *op_symbol) {
+    char lib_alias[MAX_VAR_NAME_LEN];
+    strncpy(lib_alias, spec + 7, sizeof(lib_alias) - 1); // Skip "native:"
+    lib_alias[sizeof(lib_alias) - 1] = '\0';
+    char *symbol = strchr(lib_alias, ':');
+    if (!symbol || symbol == lib_alias || symbol[1] == '\0') {
+        fprintf(stderr, "defoperator: Native handler for operator '%s' must be 'native:<lib_alias>:<symbol>'.\n", op_symbol);
+        return NULL;
+    }
+    *symbol++ = '\0';
+    BshLibFunction handler = find_lib_function(lib_alias, symbol);
+    if (!handler) {
+        fprintf(stderr, "defoperator: Operator '%s' not defined (load the library with 'loadlib' first).\n", op_symbol);
+    }
+    return handler;
+}
+
+// Looks up func_name in the library loaded under alias; prints why on failure.
+BshLibFunction find_lib_function(const char *alias, const char *func_name) {
+    DynamicLib* lib_entry = loaded_libs; void* lib_handle = NULL;
+    while(lib_entry) { if (strcmp(lib_entry->alias, alias) == 0) { lib_handle = lib_entry->handle; break; } lib_entry = lib_entry->next; }
+    if (!lib_handle) { fprintf(stderr, "Error: Library alias '%s' not found.\n", alias); return NULL; }
+    dlerror(); void* func_ptr = dlsym(lib_handle, func_name); char* dlsym_error = dlerror();
+    if (dlsym_error != NULL) { fprintf(stderr, "Error finding func '%s' in lib '%s': %s\n", func_name, alias, dlsym_error); return NULL; }
+    if (!func_ptr) { fprintf(stderr, "Error finding func '%s' (ptr NULL, no dlerror).\n", func_name); return NULL; }
+    return (BshLibFunction)func_ptr;
 }
 
 void handle_calllib_statement(Token *tokens, int num_tokens) {
     // ... (remains the same)
+    if (num_tokens > 0 && tokens[num_tokens - 1].type == TOKEN_EOF) num_tokens--; // Not a library argument
     if (num_tokens < 3) { fprintf(stderr, "Syntax: calllib <alias> <func_name> [args...]\n"); return; }
     if (current_exec_state == STATE_BLOCK_SKIP) return;
     char alias[MAX_VAR_NAME_LEN], func_name[MAX_VAR_NAME_LEN];
@@ -1991,15 +3003,8 @@ void handle_calllib_statement(Token *tokens, int num_tokens) {
     }
 
     if (strlen(alias) == 0 || strlen(func_name) == 0) { fprintf(stderr, "calllib error: Alias or func name empty.\n"); return; }
-    DynamicLib* lib_entry = loaded_libs; void* lib_handle = NULL;
-    while(lib_entry) { if (strcmp(lib_entry->alias, alias) == 0) { lib_handle = lib_entry->handle; break; } lib_entry = lib_entry->next; }
-    if (!lib_handle) { fprintf(stderr, "Error: Library alias '%s' not found.\n", alias); return; }
-    dlerror(); void* func_ptr = dlsym(lib_handle, func_name); char* dlsym_error = dlerror();
-    if (dlsym_error != NULL) { fprintf(stderr, "Error finding func '%s' in lib '%s': %s\n", func_name, alias, dlsym_error); return; }
-    if (!func_ptr) { fprintf(stderr, "Error finding func '%s' (ptr NULL, no dlerror).\n", func_name); return; }
-
-    typedef int (*lib_func_sig_t)(int, char**, char*, int); 
-    lib_func_sig_t target_func = (lib_func_sig_t)func_ptr;
+    BshLibFunction target_func = find_lib_function(alias, func_name);
+    if (!target_func) return;
     int lib_argc = num_tokens - 3;
     char* lib_argv_expanded_storage[MAX_ARGS][INPUT_BUFFER_SIZE]; char* lib_argv[MAX_ARGS + 1];
     for(int i=0; i < lib_argc; ++i) {
@@ -2052,13 +3057,499 @@ void handle_import_statement(Token *tokens, int num_tokens) {
     }
 }
 
-void handle_update_cwd_statement(Token *tokens, int num_tokens) {
-    // ... (remains the same)
-    if (current_exec_state == STATE_BLOCK_SKIP) return;
+// (Re)builds path_list_head from the current $PATH; cached command locations are dropped.
+void build_path_list() {
+    free_path_dir_list(&path_list_head);
+    clear_command_cache();
+    char *path_env = getenv("PATH"); //
+    if (path_env) { //
+        char *path_copy = strdup(path_env); //
+        if (path_copy) { //
+            char *token_path = strtok(path_copy, ":"); //
+            while (token_path) { //
+                add_path_to_list(&path_list_head, token_path); //
+                token_path = strtok(NULL, ":"); //
+            }
+            free(path_copy); //
+        } else { perror("strdup for PATH failed in build_path_list"); } //
+    }
+}
 
-    if (num_tokens != 1) {
-        fprintf(stderr, "Syntax: update_cwd (takes no arguments)\n");
-        return;
+void free_path_dir_list(PathDirNode **list_head) {
+    PathDirNode *current = *list_head;
+    while (current) {
+        PathDirNode *next_node = current->next;
+        free(current->path);
+        free(current);
+        current = next_node;
+    }
+    *list_head = NULL;
+}
+
+void clear_command_cache() {
+    for (int i = 0; i < COMMAND_CACHE_SIZE; i++) {
+        CommandCacheEntry *entry = command_cache[i];
+        while (entry) {
+            CommandCacheEntry *next_entry = entry->next;
+            free(entry->name);
+            free(entry->full_path);
+            free(entry);
+            entry = next_entry;
+        }
+        command_cache[i] = NULL;
+    }
+    command_cache_miss_count = 0;
+}
+
+// rehash: forget cached command locations (e.g. after installing a program).
+void handle_rehash_statement(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    if (num_tokens > 1 && tokens[1].type != TOKEN_EOF) {
+        fprintf(stderr, "Syntax: rehash (takes no arguments)\n");
+        return;
+    }
+    build_path_list();
+}
+
+// capture $var command [args...]: runs an external command and stores its complete
+// stdout/stderr in $var (no size limit; "object:" output is parsed as on assignment).
+void handle_capture_statement(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    if (num_tokens > 0 && tokens[num_tokens - 1].type == TOKEN_EOF) num_tokens--;
+    if (num_tokens < 3 || tokens[1].type != TOKEN_VARIABLE) {
+        fprintf(stderr, "Syntax: capture $variable command [args...]\n");
+        return;
+    }
+    char command_path[MAX_FULL_PATH_LEN];
+    if (!find_command_in_path_dynamic(tokens[2].text, command_path)) {
+        fprintf(stderr, "capture: command not found: %s\n", tokens[2].text);
+        set_variable_scoped("LAST_COMMAND_STATUS", "127", false);
+        return;
+    }
+    char *args[MAX_ARGS + 1];
+    int arg_count = build_command_argv(&tokens[2], num_tokens - 2, args);
+    StringBuilder captured = {0};
+    int status = capture_external_command(command_path, args, &captured);
+    free_command_argv(args, arg_count);
+    if (status >= 0) assign_evaluated_value(&tokens[1], captured.data ? captured.data : (char*)"");
+    string_builder_free(&captured);
+}
+
+// jobs: lists background jobs oldest first. Finished jobs stay listed until 'wait'
+// collects their status.
+void handle_jobs_statement(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    if (num_tokens > 1 && tokens[1].type != TOKEN_EOF) {
+        fprintf(stderr, "Syntax: jobs (takes no arguments)\n");
+        return;
+    }
+    reap_background_jobs();
+    for (Job *job = job_list_head; job; job = job->next) {
+        if (job->running_count > 0) printf("[%d] Running %s\n", job->id, job->command);
+        else printf("[%d] Done (%d) %s\n", job->id, job->status, job->command);
+    }
+}
+
+// wait [job_id]: blocks until the job (default: every job) has finished. Each waited
+// job's status is stored in $JOB_STATUS[id]; 'wait id' also sets $LAST_COMMAND_STATUS.
+void handle_wait_statement(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    if (num_tokens > 0 && tokens[num_tokens - 1].type == TOKEN_EOF) num_tokens--;
+    if (num_tokens > 2) {
+        fprintf(stderr, "Syntax: wait [job_id]\n");
+        return;
+    }
+    if (num_tokens == 1) {
+        while (job_list_head) { wait_for_job(job_list_head); remove_job(job_list_head); }
+        set_variable_scoped("LAST_COMMAND_STATUS", "0", false);
+        return;
+    }
+
+    char expanded_id[INPUT_BUFFER_SIZE];
+    expand_variables_in_string_advanced(tokens[1].text, expanded_id, sizeof(expanded_id));
+    int job_id = atoi(expanded_id);
+    Job *job = job_list_head;
+    while (job && job->id != job_id) job = job->next;
+    if (!job) {
+        fprintf(stderr, "wait: no such job: %s\n", expanded_id);
+        set_variable_scoped("LAST_COMMAND_STATUS", "127", false);
+        return;
+    }
+    char status_str[12];
+    snprintf(status_str, sizeof(status_str), "%d", wait_for_job(job));
+    remove_job(job);
+    set_variable_scoped("LAST_COMMAND_STATUS", status_str, false);
+}
+
+// foreach_record <file|command args...> $record { ... }
+// Runs the body once per line of the source: a single argument naming a file is read
+// directly ("-" is stdin), anything else is run as a command and its stdout is read.
+// Each non-blank line is parsed like an assignment of "object:"/"json:" data (bare
+// lines are JSON, i.e. JSON Lines) into $record, which is local to the loop; each record
+// replaces the last, so memory stays flat however long the input is. Anything else the
+// body assigns goes to the enclosing scope, as in an 'if' or 'while' body.
+void handle_foreach_record_statement(Token *tokens, int num_tokens, FILE* input_source, int current_line_no) {
+    (void)input_source; // Records come from the loop's own source, not the script
+    bool have_record = false;
+    if (current_exec_state != STATE_BLOCK_SKIP) have_record = foreach_record_advance(tokens, num_tokens);
+
+    push_block_bf(BLOCK_TYPE_FOREACH_RECORD, have_record, 0, current_line_no);
+    if (have_record && current_exec_state != STATE_BLOCK_SKIP) {
+        current_exec_state = STATE_BLOCK_EXECUTE;
+    } else {
+        current_exec_state = STATE_BLOCK_SKIP;
+    }
+}
+
+// Header of a foreach_record iteration (both engines): continues the innermost loop
+// if its body just ended, otherwise opens a new one. Returns false, with the loop
+// closed, once the source has no more records.
+bool foreach_record_advance(Token *tokens, int num_tokens) {
+    RecordLoop *loop = record_loop_stack;
+    if (loop && loop->resuming) {
+        loop->resuming = false;
+    } else if (!(loop = open_record_loop(tokens, num_tokens))) {
+        return false;
+    }
+    if (read_next_record(loop)) return true;
+    close_record_loop(loop);
+    return false;
+}
+
+RecordLoop* open_record_loop(Token *tokens, int num_tokens) {
+    int end = num_tokens;
+    while (end > 0 && (tokens[end - 1].type == TOKEN_EOF || tokens[end - 1].type == TOKEN_COMMENT || tokens[end - 1].type == TOKEN_LBRACE)) end--;
+    if (end < 3 || tokens[end - 1].type != TOKEN_VARIABLE || strchr(tokens[end - 1].text, '[') || strchr(tokens[end - 1].text, '.')) {
+        fprintf(stderr, "Syntax: foreach_record <file|command [args...]> $record {\n");
+        return NULL;
+    }
+
+    int fd = -1;
+    pid_t pid = -1;
+    char source[INPUT_BUFFER_SIZE];
+    expand_word_token(&tokens[1], source, sizeof(source));
+    struct stat source_stat;
+    if (end == 3 && strcmp(source, "-") == 0) {
+        fd = dup(STDIN_FILENO);
+        if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    } else if (end == 3 && stat(source, &source_stat) == 0 && !S_ISDIR(source_stat.st_mode)) {
+        fd = open(source, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) fprintf(stderr, "foreach_record: cannot open '%s': %s\n", source, strerror(errno));
+    } else {
+        char command_path[MAX_FULL_PATH_LEN];
+        int pipefd[2];
+        if (!find_command_in_path_dynamic(source, command_path)) {
+            fprintf(stderr, "foreach_record: no such file or command: %s\n", source);
+            set_variable_scoped("LAST_COMMAND_STATUS", "127", false);
+            return NULL;
+        }
+        if (!open_cloexec_pipe(pipefd)) { perror("foreach_record: pipe failed"); return NULL; }
+        char *args[MAX_ARGS + 1];
+        int arg_count = build_command_argv(&tokens[1], end - 2, args);
+        pid = launch_external_command(command_path, args, -1, pipefd[1], false);
+        free_command_argv(args, arg_count);
+        close(pipefd[1]);
+        if (pid < 0) close(pipefd[0]); else fd = pipefd[0];
+    }
+    if (fd < 0) return NULL;
+
+    RecordLoop *loop = (RecordLoop*)calloc(1, sizeof(RecordLoop));
+    if (loop) loop->buffer = (char*)malloc(RECORD_READ_CHUNK);
+    if (!loop || !loop->buffer || (loop->scope_id = enter_scope()) == -1) {
+        if (loop && loop->buffer) perror("foreach_record: out of memory");
+        if (loop) free(loop->buffer);
+        free(loop);
+        close(fd);
+        if (pid > 0) wait_for_external_command(pid);
+        return NULL;
+    }
+    loop->fd = fd;
+    loop->pid = pid;
+    loop->capacity = RECORD_READ_CHUNK;
+    strncpy(loop->var_name, tokens[end - 1].text + 1, MAX_VAR_NAME_LEN - 1);
+    scope_stack[scope_stack_top].record_var_name = loop->var_name;
+    loop->next = record_loop_stack;
+    record_loop_stack = loop;
+    record_loop_count++;
+    return loop;
+}
+
+// Assigns the next non-blank line of the source to the record variable. The buffer
+// only grows for a line longer than everything read so far.
+bool read_next_record(RecordLoop *loop) {
+    for (;;) {
+        char *line = loop->buffer + loop->start;
+        char *newline = (char*)memchr(line, '\n', loop->end - loop->start);
+        if (newline || (loop->at_eof && loop->start < loop->end)) {
+            size_t length = newline ? (size_t)(newline - line) : loop->end - loop->start;
+            loop->start += newline ? length + 1 : length;
+            if (length > 0 && line[length - 1] == '\r') length--;
+            line[length] = '\0'; // Over the '\n', or the spare byte kept after 'end'
+            size_t blank = 0;
+            while (blank < length && isspace((unsigned char)line[blank])) blank++;
+            if (blank == length) continue;
+            assign_record(loop, line, length);
+            return true;
+        }
+        if (loop->at_eof) return false;
+
+        // Keep the partial line and make room after it (plus a byte for its terminator)
+        if (loop->start > 0) {
+            memmove(loop->buffer, loop->buffer + loop->start, loop->end - loop->start);
+            loop->end -= loop->start;
+            loop->start = 0;
+        }
+        if (loop->capacity - loop->end < RECORD_READ_CHUNK / 2 + 1) {
+            char *grown = (char*)realloc(loop->buffer, loop->capacity * 2);
+            if (!grown) { perror("foreach_record: line too long"); return false; }
+            loop->buffer = grown;
+            loop->capacity *= 2;
+        }
+        ssize_t bytes_read = read(loop->fd, loop->buffer + loop->end, loop->capacity - loop->end - 1);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read < 0) perror("foreach_record: read failed");
+        if (bytes_read <= 0) loop->at_eof = true; else loop->end += (size_t)bytes_read;
+    }
+}
+
+// Stores one line in the record variable, replacing the previous record: "object:"/
+// "json:" data is parsed as on assignment; a bare line is taken to be JSON.
+void assign_record(RecordLoop *loop, char *text, size_t length) {
+    BshObject *object;
+    if (strncmp(text, OBJECT_STDOUT_PREFIX, strlen(OBJECT_STDOUT_PREFIX)) == 0) {
+        text += strlen(OBJECT_STDOUT_PREFIX); length -= strlen(OBJECT_STDOUT_PREFIX);
+        object = parse_bsh_object_string(text, length);
+    } else {
+        if (strncmp(text, JSON_STDOUT_PREFIX, strlen(JSON_STDOUT_PREFIX)) == 0) {
+            text += strlen(JSON_STDOUT_PREFIX); length -= strlen(JSON_STDOUT_PREFIX);
+        }
+        object = parse_json_string(text, length);
+    }
+    set_variable_scoped(loop->var_name, text, false);
+    Variable *record = find_variable_in_frame(assignment_frame(loop->var_name), loop->var_name, hash_variable_name(loop->var_name));
+    if (record && object) record->object = object; else free_bsh_object(object);
+}
+
+// The body of the innermost loop finished. The record stays in place until the next
+// one is assigned over it.
+void end_record_iteration() {
+    if (record_loop_stack) record_loop_stack->resuming = true;
+}
+
+// Closes the innermost loop. A source command that hasn't finished (the body
+// returned early) is terminated; its status goes to $LAST_COMMAND_STATUS.
+void close_record_loop(RecordLoop *loop) {
+    record_loop_stack = loop->next;
+    record_loop_count--;
+    if (scope_stack_top >= 0 && scope_stack[scope_stack_top].scope_id == loop->scope_id) leave_scope(loop->scope_id);
+    close(loop->fd);
+    if (loop->pid > 0) {
+        if (!loop->at_eof) kill(loop->pid, SIGTERM);
+        wait_for_external_command(loop->pid);
+    }
+    free(loop->buffer);
+    free(loop);
+}
+
+void close_record_loops_above(int count) {
+    while (record_loop_count > count && record_loop_stack) close_record_loop(record_loop_stack);
+}
+
+// Expands a word or quoted string argument the way command arguments are expanded.
+void expand_word_token(const Token *token, char *out, size_t out_size) {
+    if (token->type == TOKEN_STRING) {
+        char unescaped[INPUT_BUFFER_SIZE];
+        unescape_string(token->text, unescaped, sizeof(unescaped));
+        expand_variables_in_string_advanced(unescaped, out, out_size);
+    } else {
+        expand_variables_in_string_advanced(token->text, out, out_size);
+    }
+}
+
+// parallel_map <array> <function|command|"native:<alias>:<func>"> <result_array> [-j N]
+// Calls the target with each element of <array> (elements 0, 1, ... up to the first
+// missing index) and stores the outputs in the same slots of <result_array>. Functions
+// and commands run in up to N child processes (their stdout is the result); native
+// library functions run on N threads. N defaults to the number of online CPUs.
+void handle_parallel_map_statement(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    if (num_tokens > 0 && tokens[num_tokens - 1].type == TOKEN_EOF) num_tokens--;
+
+    long worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    char *options[MAX_ARGS + 1];
+    int option_count = num_tokens > 4 ? build_command_argv(&tokens[4], num_tokens - 4, options) : 0;
+    bool options_ok = (option_count == 0);
+    if (option_count == 2 && strcmp(options[0], "-j") == 0) {
+        worker_count = atol(options[1]);
+        options_ok = true;
+    }
+    free_command_argv(options, option_count);
+    if (num_tokens < 4 || !options_ok || worker_count < 1) {
+        fprintf(stderr, "Syntax: parallel_map <array> <function|command|\"native:<alias>:<func>\"> <result_array> [-j N]\n");
+        return;
+    }
+    if (worker_count > MAX_ARGS) worker_count = MAX_ARGS;
+
+    // Arrays may be named bare or as $name
+    char array_name[MAX_VAR_NAME_LEN], target[MAX_FULL_PATH_LEN], result_name[MAX_VAR_NAME_LEN];
+    snprintf(array_name, sizeof(array_name), "%s", tokens[1].text + (tokens[1].type == TOKEN_VARIABLE));
+    expand_word_token(&tokens[2], target, sizeof(target));
+    snprintf(result_name, sizeof(result_name), "%s", tokens[3].text + (tokens[3].type == TOKEN_VARIABLE));
+
+    UserFunction *func = NULL;
+    BshLibFunction native_func = NULL;
+    char command_path[MAX_FULL_PATH_LEN];
+    if (strncmp(target, "native:", 7) == 0) {
+        char *symbol = strchr(target + 7, ':');
+        if (!symbol || symbol == target + 7 || symbol[1] == '\0') {
+            fprintf(stderr, "parallel_map: native target must be 'native:<lib_alias>:<symbol>'.\n");
+            return;
+        }
+        *symbol++ = '\0';
+        if (!(native_func = find_lib_function(target + 7, symbol))) return;
+    } else if (!(func = find_user_function(target)) && !find_command_in_path_dynamic(target, command_path)) {
+        fprintf(stderr, "parallel_map: no function or command named '%s'\n", target);
+        set_variable_scoped("LAST_COMMAND_STATUS", "127", false);
+        return;
+    }
+
+    // Elements are copied out first: workers must not read the variable table
+    int count = 0;
+    char index_str[12];
+    for (;; count++) {
+        snprintf(index_str, sizeof(index_str), "%d", count);
+        if (!get_array_element_scoped(array_name, index_str)) break;
+    }
+    char **elements = (char**)calloc(count > 0 ? count : 1, sizeof(char*));
+    char **results = (char**)calloc(count > 0 ? count : 1, sizeof(char*));
+    if (!elements || !results) { perror("calloc for parallel_map failed"); free(elements); free(results); return; }
+    for (int i = 0; i < count; i++) {
+        snprintf(index_str, sizeof(index_str), "%d", i);
+        elements[i] = strdup(get_array_element_scoped(array_name, index_str));
+        if (!elements[i]) { perror("strdup for parallel_map element failed"); count = i; break; }
+    }
+
+    int status = 0;
+    if (count > 0) {
+        status = native_func ? run_native_map(native_func, elements, results, count, (int)worker_count)
+                             : run_process_map(func, func ? NULL : command_path, elements, results, count, (int)worker_count);
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(index_str, sizeof(index_str), "%d", i);
+        set_array_element_scoped(result_name, index_str, results[i] ? results[i] : "");
+        free(results[i]);
+        free(elements[i]);
+    }
+    free(results);
+    free(elements);
+
+    char status_str[12];
+    snprintf(status_str, sizeof(status_str), "%d", status);
+    set_variable_scoped("LAST_COMMAND_STATUS", status_str, false);
+}
+
+// array_length <array> $var: stores the array's length (0 if it does not exist).
+void handle_array_length_statement(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    if (num_tokens > 0 && tokens[num_tokens - 1].type == TOKEN_EOF) num_tokens--;
+    if (num_tokens != 3 || tokens[2].type != TOKEN_VARIABLE) {
+        fprintf(stderr, "Syntax: array_length <array> $variable\n");
+        return;
+    }
+    char array_name[MAX_VAR_NAME_LEN];
+    snprintf(array_name, sizeof(array_name), "%s", tokens[1].text + (tokens[1].type == TOKEN_VARIABLE));
+    BshArray *array = find_array_scoped(array_name);
+    char length_str[24];
+    snprintf(length_str, sizeof(length_str), "%zu", array ? array->length : 0);
+    assign_evaluated_value(&tokens[2], length_str);
+}
+
+// array_push <array> value...: appends each value, creating the array if needed.
+void handle_array_push_statement(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    if (num_tokens > 0 && tokens[num_tokens - 1].type == TOKEN_EOF) num_tokens--;
+    if (num_tokens < 3) {
+        fprintf(stderr, "Syntax: array_push <array> value [value...]\n");
+        return;
+    }
+    char array_name[MAX_VAR_NAME_LEN];
+    snprintf(array_name, sizeof(array_name), "%s", tokens[1].text + (tokens[1].type == TOKEN_VARIABLE));
+    BshArray *array = get_or_create_array_scoped(array_name);
+    if (!array) return;
+    char value[INPUT_BUFFER_SIZE];
+    for (int i = 2; i < num_tokens; i++) {
+        expand_word_token(&tokens[i], value, sizeof(value));
+        if (!array_push(array, value)) { perror("bsh: array_push"); return; }
+    }
+}
+
+// array_pop <array> [$var]: removes the last element, storing it in $var.
+// $LAST_COMMAND_STATUS is 1 if the array was empty.
+void handle_array_pop_statement(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    if (num_tokens > 0 && tokens[num_tokens - 1].type == TOKEN_EOF) num_tokens--;
+    if (num_tokens < 2 || num_tokens > 3 || (num_tokens == 3 && tokens[2].type != TOKEN_VARIABLE)) {
+        fprintf(stderr, "Syntax: array_pop <array> [$variable]\n");
+        return;
+    }
+    char array_name[MAX_VAR_NAME_LEN];
+    snprintf(array_name, sizeof(array_name), "%s", tokens[1].text + (tokens[1].type == TOKEN_VARIABLE));
+    BshArray *array = find_array_scoped(array_name);
+    if (!array || array->length == 0) {
+        set_variable_scoped("LAST_COMMAND_STATUS", "1", false);
+        return;
+    }
+    char *last = array->items[--array->length];
+    array->items[array->length] = NULL;
+    if (num_tokens == 3) assign_evaluated_value(&tokens[2], last ? last : (char*)"");
+    free(last);
+    set_variable_scoped("LAST_COMMAND_STATUS", "0", false);
+}
+
+// array_slice <array> <start> <end> <result_array>: copies elements [start, end)
+// (clamped to the array) into a new <result_array>.
+void handle_array_slice_statement(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    if (num_tokens > 0 && tokens[num_tokens - 1].type == TOKEN_EOF) num_tokens--;
+    char array_name[MAX_VAR_NAME_LEN], start_str[INPUT_BUFFER_SIZE], end_str[INPUT_BUFFER_SIZE], result_name[MAX_VAR_NAME_LEN];
+    size_t start, end;
+    if (num_tokens == 5) {
+        expand_word_token(&tokens[2], start_str, sizeof(start_str));
+        expand_word_token(&tokens[3], end_str, sizeof(end_str));
+    }
+    if (num_tokens != 5 || !parse_array_index(start_str, &start) || !parse_array_index(end_str, &end)) {
+        fprintf(stderr, "Syntax: array_slice <array> <start> <end> <result_array>\n");
+        return;
+    }
+    snprintf(array_name, sizeof(array_name), "%s", tokens[1].text + (tokens[1].type == TOKEN_VARIABLE));
+    snprintf(result_name, sizeof(result_name), "%s", tokens[4].text + (tokens[4].type == TOKEN_VARIABLE));
+
+    BshArray *source = find_array_scoped(array_name);
+    size_t length = source ? source->length : 0;
+    if (end > length) end = length;
+    if (start > end) start = end;
+    BshArray slice = {0};
+    if (!array_reserve(&slice, end - start)) { perror("bsh: array_slice"); return; }
+    for (size_t i = start; i < end; i++) {
+        if (source->items[i] && !(slice.items[i - start] = strdup(source->items[i]))) { perror("bsh: array_slice"); break; }
+    }
+    slice.length = end - start;
+
+    // Built aside first so slicing an array into itself works
+    BshArray *result = get_or_create_array_scoped(result_name);
+    if (!result) { for (size_t i = 0; i < slice.length; i++) free(slice.items[i]); free(slice.items); return; }
+    for (size_t i = 0; i < result->length; i++) free(result->items[i]);
+    free(result->items);
+    *result = slice;
+}
+
+void handle_update_cwd_statement(Token *tokens, int num_tokens) {
+    // ... (remains the same)
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+
+    if (num_tokens != 1) {
+        fprintf(stderr, "Syntax: update_cwd (takes no arguments)\n");
+        return;
     }
 
     char cwd_buffer[PATH_MAX];
@@ -2190,7 +3681,7 @@ void handle_opening_brace_token(Token token) {
     else current_exec_state = STATE_BLOCK_SKIP;
 }
 
-void handle_closing_brace_token(Token token, FILE* input_source) {
+void handle_closing_brace_token(Token token) {
     BlockFrame* closed_block_frame = pop_block_bf();
     if (!closed_block_frame) { fprintf(stderr, "Error: '}' found without a matching open block.\n"); current_exec_state = STATE_NORMAL; return; }
 
@@ -2200,24 +3691,29 @@ void handle_closing_brace_token(Token token, FILE* input_source) {
     if (closed_block_frame->type == BLOCK_TYPE_WHILE && closed_block_frame->condition_true && 
         (current_exec_state == STATE_BLOCK_EXECUTE || current_exec_state == STATE_NORMAL || current_exec_state == STATE_IMPORT_PARSING) ) { 
         
-        bool can_loop_via_fseek = false;
-        if (input_source_is_file(input_source) && closed_block_frame->loop_start_fpos != -1) {
-             // Before seeking, re-evaluate the condition. This requires re-tokenizing the while header.
-             // This is a complex part. A simpler (but less flexible) model is to just seek.
-             // For now, we'll stick to the seek model, assuming the condition might change due to side effects in the loop.
-            if (fseek(input_source, closed_block_frame->loop_start_fpos, SEEK_SET) == 0) {
-                can_loop_via_fseek = true;
-                current_exec_state = STATE_NORMAL; // Allow re-processing of the while line by execute_script
-                return; 
-            } else { 
-                perror("fseek failed for while loop"); 
-            }
-        } else if (!input_source_is_file(input_source) && closed_block_frame->loop_start_line_no > 0) { 
-             // This case is for loops inside function bodies (not read from file)
-             // True looping here would require re-executing the function lines from the loop header.
-             // This is not implemented by simple fseek.
-             fprintf(stderr, "Warning: 'while' loop repetition for non-file input (e.g. function body, line %d) is not supported by fseek. Loop will terminate.\n", closed_block_frame->loop_start_line_no);
+        if (closed_block_frame->loop_start_line_no > 0 && line_sequence_depth > 0) {
+            // Script, function body or eval: execute_line_sequence resumes at the 'while'
+            // line, replaying the already tokenized lines instead of re-reading the input.
+            loop_restart_line_no = closed_block_frame->loop_start_line_no;
+            current_exec_state = STATE_NORMAL;
+            return;
+        } else if (closed_block_frame->loop_start_line_no > 0) { 
+             // Interactive input: the loop header has already been consumed from stdin.
+             fprintf(stderr, "Warning: 'while' loop repetition for interactive input (line %d) is not supported. Loop will terminate.\n", closed_block_frame->loop_start_line_no);
+        }
+    }
+    if (closed_block_frame->type == BLOCK_TYPE_FOREACH_RECORD && closed_block_frame->condition_true && record_loop_stack) {
+        if ((current_exec_state == STATE_BLOCK_EXECUTE || current_exec_state == STATE_NORMAL || current_exec_state == STATE_IMPORT_PARSING) &&
+            line_sequence_depth > 0) {
+            end_record_iteration();
+            loop_restart_line_no = closed_block_frame->loop_start_line_no;
+            current_exec_state = STATE_NORMAL;
+            return;
+        }
+        if (line_sequence_depth == 0) {
+            fprintf(stderr, "Warning: 'foreach_record' repetition for interactive input (line %d) is not supported. Loop will terminate.\n", closed_block_frame->loop_start_line_no);
         }
+        close_record_loop(record_loop_stack);
     }
 
     if (!parent_block) { 
@@ -2234,8 +3730,7 @@ void handle_closing_brace_token(Token token, FILE* input_source) {
 
     if (closed_block_frame->type == BLOCK_TYPE_FUNCTION_DEF) {
         if (current_function_definition) { 
-            current_function_definition->next = function_list; 
-            function_list = current_function_definition;
+            register_user_function(current_function_definition);
             current_function_definition = NULL; 
         }
         is_defining_function = false; 
@@ -2307,7 +3802,7 @@ void handle_eval_statement(Token *tokens, int num_tokens) {
 
     // Concatenate all arguments to 'eval' into a single string, expanding them.
     for (int i = 1; i < num_tokens; i++) {
-        if (tokens[i].type == TOKEN_COMMENT) break;
+        if (tokens[i].type == TOKEN_COMMENT || tokens[i].type == TOKEN_EOF) break;
 
         char expanded_arg_part[INPUT_BUFFER_SIZE];
         if (tokens[i].type == TOKEN_STRING) {
@@ -2341,12 +3836,36 @@ void handle_eval_statement(Token *tokens, int num_tokens) {
         // int original_line_no = current_line_no;     // from process_line params (if needed)
 
         // Execute the constructed string.
-        // The `process_line` function is designed to handle a single line of BSH code.
-        // `input_source` is NULL because this code doesn't come from a seekable file stream for `while` loops.
-        // `current_line_no` can be set to 0 or 1 for the context of the eval'd string.
+        // A single line goes straight to `process_line`. Code spanning several lines
+        // (e.g. "while ... {\n...\n}") is run as a line sequence so blocks and loops
+        // inside it work; it is compiled first when the VM engine is active.
+        // `input_source` is NULL because this code doesn't come from a seekable file stream.
         // The `exec_mode_param` should be STATE_NORMAL, as eval'd code should execute normally
         // within the current block and scope context.
-        process_line(code_to_eval, NULL, 0, STATE_NORMAL);
+        if (!strchr(code_to_eval, '\n')) {
+            process_line(code_to_eval, NULL, 0, STATE_NORMAL);
+        } else {
+            int eval_line_count = 1;
+            for (const char *c = code_to_eval; *c; c++) if (*c == '\n') eval_line_count++;
+            char **eval_lines = (char**)malloc(sizeof(char*) * eval_line_count);
+            if (!eval_lines) { perror("malloc for eval lines failed"); set_variable_scoped("LAST_COMMAND_STATUS", "1", false); return; }
+            char *line_start = code_to_eval;
+            for (int i = 0; i < eval_line_count; i++) {
+                char *line_end = strchr(line_start, '\n');
+                if (line_end) *line_end = '\0';
+                eval_lines[i] = trim_whitespace(line_start);
+                line_start = line_end ? line_end + 1 : line_start + strlen(line_start);
+            }
+
+            BytecodeProgram *eval_prog = (bsh_engine_mode == ENGINE_VM) ? compile_bytecode_program(eval_lines, eval_line_count, "eval") : NULL;
+            if (eval_prog) {
+                run_bytecode_program(eval_prog, STATE_NORMAL);
+                free_bytecode_program(eval_prog);
+            } else {
+                execute_line_sequence(eval_lines, NULL, eval_line_count, false, STATE_NORMAL);
+            }
+            free(eval_lines);
+        }
 
         // Restore original line_no/input_source if they were modified by process_line or its callees
         // (This depends on how `process_line` uses these for context in loops, etc.)
@@ -2362,6 +3881,28 @@ void handle_eval_statement(Token *tokens, int num_tokens) {
 
 // --- Utility Implementations ---
 // ... (trim_whitespace, free_function_list, free_operator_list, free_loaded_libs, get_file_pos, unescape_string, input_source_is_file remain the same)
+bool string_builder_append(StringBuilder *sb, const char *data, size_t len) {
+    if (sb->length + len + 1 > sb->capacity) {
+        size_t new_capacity = sb->capacity ? sb->capacity : INPUT_BUFFER_SIZE;
+        while (new_capacity < sb->length + len + 1) new_capacity *= 2;
+        char *grown = (char*)realloc(sb->data, new_capacity);
+        if (!grown) { perror("realloc for string builder failed"); return false; }
+        sb->data = grown;
+        sb->capacity = new_capacity;
+    }
+    memcpy(sb->data + sb->length, data, len);
+    sb->length += len;
+    sb->data[sb->length] = '\0';
+    return true;
+}
+
+void string_builder_free(StringBuilder *sb) {
+    free(sb->data);
+    sb->data = NULL;
+    sb->length = 0;
+    sb->capacity = 0;
+}
+
 char* trim_whitespace(char *str) {
     if (!str) return NULL; char *end;
     while (isspace((unsigned char)*str)) str++;
@@ -2372,14 +3913,97 @@ char* trim_whitespace(char *str) {
     return str;
 }
 
+void free_user_function(UserFunction *func) {
+    free_function_token_cache(func);
+    free_bytecode_program(func->compiled_body);
+    for (int i = 0; i < func->line_count; ++i) if(func->body[i]) free(func->body[i]);
+    free(func);
+}
+
 void free_function_list() {
     UserFunction *current = function_list; UserFunction *next_func;
     while (current != NULL) {
         next_func = current->next;
-        for (int i = 0; i < current->line_count; ++i) if(current->body[i]) free(current->body[i]);
-        free(current); current = next_func;
+        free_user_function(current); current = next_func;
     }
     function_list = NULL;
+    memset(function_table, 0, sizeof(function_table));
+    function_table_epoch++;
+    current = retired_function_list;
+    while (current != NULL) {
+        next_func = current->next;
+        free_user_function(current); current = next_func;
+    }
+    retired_function_list = NULL;
+}
+
+// Tokenizes every body line once, when the definition is closed.
+void build_function_token_cache(UserFunction *func) {
+    free_function_token_cache(func);
+    if (func->line_count == 0) return;
+    func->tokenized_body = (TokenizedLine*)calloc(func->line_count, sizeof(TokenizedLine));
+    if (!func->tokenized_body) { perror("calloc for function token cache failed"); return; }
+    for (int i = 0; i < func->line_count; ++i) {
+        func->tokenized_body[i].text = func->body[i];
+        tokenize_line_cached(&func->tokenized_body[i], i + 1);
+    }
+}
+
+void free_function_token_cache(UserFunction *func) {
+    if (!func->tokenized_body) return;
+    for (int i = 0; i < func->line_count; ++i) free_tokenized_line(&func->tokenized_body[i]);
+    free(func->tokenized_body);
+    func->tokenized_body = NULL;
+}
+
+// Adds a completed definition to function_list and function_table. A previous
+// definition with the same name is dropped together with its token cache; if it is
+// still executing (it redefined itself), it is parked on retired_function_list until
+// shutdown. Bumps function_table_epoch so cached call targets are looked up again.
+void register_user_function(UserFunction *func) {
+    UserFunction **bucket = &function_table[hash_variable_name(func->name) & (FUNCTION_TABLE_SIZE - 1)];
+    for (UserFunction **entry = bucket; *entry; entry = &(*entry)->table_next) {
+        if (strcmp((*entry)->name, func->name) == 0) { *entry = (*entry)->table_next; break; }
+    }
+    UserFunction **link = &function_list;
+    while (*link) {
+        if (strcmp((*link)->name, func->name) == 0) {
+            UserFunction *old_def = *link;
+            *link = old_def->next;
+            if (old_def->active_calls > 0) {
+                old_def->next = retired_function_list;
+                retired_function_list = old_def;
+            } else {
+                free_user_function(old_def);
+            }
+            break;
+        }
+        link = &(*link)->next;
+    }
+    build_function_token_cache(func);
+    func->next = function_list;
+    function_list = func;
+    func->table_next = *bucket;
+    *bucket = func;
+    function_table_epoch++;
+}
+
+UserFunction* find_user_function(const char *name) {
+    UserFunction *func = function_table[hash_variable_name(name) & (FUNCTION_TABLE_SIZE - 1)];
+    while (func && strcmp(func->name, name) != 0) func = func->table_next;
+    return func;
+}
+
+// Function called by a command line. With a call site the lookup is done once and
+// reused until a function is next (re)defined.
+UserFunction* resolve_call_site_function(TokenizedLine *call_site, const char *name) {
+    if (call_site && call_site->call_epoch == function_table_epoch) return call_site->call_target;
+    UserFunction *func = find_user_function(name);
+    if (call_site) {
+        call_site->call_target = func;
+        call_site->call_epoch = function_table_epoch;
+    }
+    return func;
 }
 
 void free_loaded_libs() {
@@ -2434,6 +4058,390 @@ bool input_source_is_file(FILE* f) {
     return (fd != STDIN_FILENO && fd != STDOUT_FILENO && fd != STDERR_FILENO);
 }
 
+// Reads a whole script into trimmed, heap-allocated lines (line N is lines[N-1]).
+// Returns the number of lines read; on errors, what was read so far.
+int read_script_lines(FILE *script_file, char ***lines_out) {
+    char **lines = NULL;
+    int line_count = 0, line_capacity = 0;
+    char line_buffer[INPUT_BUFFER_SIZE];
+
+    while (fgets(line_buffer, sizeof(line_buffer), script_file)) {
+        if (line_count == line_capacity) {
+            int new_capacity = line_capacity ? line_capacity * 2 : 64;
+            char **grown = (char**)realloc(lines, sizeof(char*) * new_capacity);
+            if (!grown) { perror("realloc for script lines failed"); break; }
+            lines = grown;
+            line_capacity = new_capacity;
+        }
+        line_buffer[MAX_LINE_LENGTH - 1] = '\0'; // Same limit as process_line
+        lines[line_count] = strdup(trim_whitespace(line_buffer));
+        if (!lines[line_count]) { perror("strdup for script line failed"); break; }
+        line_count++;
+    }
+    if (ferror(script_file)) perror("Error reading script file");
+
+    *lines_out = lines;
+    return line_count;
+}
+
+void free_script_lines(char **lines, int line_count) {
+    for (int i = 0; i < line_count; i++) free(lines[i]);
+    free(lines);
+}
+
+// --- Precompiled Script Cache (.bshc) ---
+// One file per script path, in host byte order (the cache is per machine):
+//   "BSHC" u32 version, u64 mtime, size, content hash and language signature
+//       (operator definitions and keyword aliases), canonical path
+//   u32 line count, then each trimmed line
+//   u32 instruction count (0 = not compiled), then per instruction u32 op, jump_target,
+//       line_no, arg_start, body_first_line, body_line_count, has_text
+//   u32 token stream count, then per stream u32 line index, u64 operator signature,
+//       u32 token count, storage bytes, per token u32 type, len, line, col
+//   u64 hash of everything before it
+// Strings are a u32 length followed by the bytes. Token streams are only reused if the
+// same operator symbols are defined when their line runs (see tokenize_line_cached).
+
+uint64_t hash_bytes_fnv1a(const void *data, size_t len, uint64_t hash) {
+    const unsigned char *p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= BSH_FNV1A_PRIME;
+    }
+    return hash;
+}
+
+// Fills 'info' from the open script (which is rewound afterwards). Returns false if
+// the script cannot be identified, in which case it is not cached.
+bool read_script_source_info(FILE *script_file, const char *filename, ScriptSourceInfo *info) {
+    struct stat st;
+    if (fstat(fileno(script_file), &st) != 0) return false;
+    char *resolved = realpath(filename, NULL);
+    if (!resolved || strlen(resolved) >= sizeof(info->path)) { free(resolved); return false; }
+    strcpy(info->path, resolved);
+    free(resolved);
+    info->mtime = (int64_t)st.st_mtime;
+    info->size = (int64_t)st.st_size;
+
+    uint64_t hash = BSH_FNV1A_OFFSET;
+    char chunk[8192];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), script_file)) > 0) hash = hash_bytes_fnv1a(chunk, n, hash);
+    bool ok = !ferror(script_file);
+    rewind(script_file);
+    info->content_hash = hash;
+    uint64_t signatures[2] = { operator_definition_signature, keyword_alias_signature };
+    info->language_signature = hash_bytes_fnv1a(signatures, sizeof(signatures), BSH_FNV1A_OFFSET);
+    return ok;
+}
+
+// $BSH_CACHE_DIR/<hash of path>.bshc, defaulting to ~/.bsh_cache. An empty
+// BSH_CACHE_DIR disables the cache.
+bool script_cache_file_path(const ScriptSourceInfo *info, char *cache_path, size_t cache_path_size) {
+    const char *cache_dir = getenv("BSH_CACHE_DIR");
+    char default_dir[MAX_FULL_PATH_LEN];
+    if (!cache_dir) {
+        const char *home_dir = getenv("HOME");
+        if (!home_dir) return false;
+        snprintf(default_dir, sizeof(default_dir), "%s/%s", home_dir, BSH_CACHE_DIR_NAME);
+        cache_dir = default_dir;
+    }
+    if (cache_dir[0] == '\0') return false;
+    uint64_t path_hash = hash_bytes_fnv1a(info->path, strlen(info->path), BSH_FNV1A_OFFSET);
+    int written = snprintf(cache_path, cache_path_size, "%s/%016llx.bshc", cache_dir, (unsigned long long)path_hash);
+    return written > 0 && (size_t)written < cache_path_size;
+}
+
+void cache_put_u32(FILE *cache_file, uint32_t value) { fwrite(&value, sizeof(value), 1, cache_file); }
+void cache_put_u64(FILE *cache_file, uint64_t value) { fwrite(&value, sizeof(value), 1, cache_file); }
+void cache_put_string(FILE *cache_file, const char *str) {
+    uint32_t len = (uint32_t)strlen(str);
+    cache_put_u32(cache_file, len);
+    fwrite(str, 1, len, cache_file);
+}
+
+bool cache_get_u32(FILE *cache_file, uint32_t *value) { return fread(value, sizeof(*value), 1, cache_file) == 1; }
+bool cache_get_u64(FILE *cache_file, uint64_t *value) { return fread(value, sizeof(*value), 1, cache_file) == 1; }
+bool cache_get_string(FILE *cache_file, char *buffer, size_t buffer_size) {
+    uint32_t len;
+    if (!cache_get_u32(cache_file, &len) || len >= buffer_size) return false;
+    if (fread(buffer, 1, len, cache_file) != len) return false;
+    buffer[len] = '\0';
+    return true;
+}
+
+// Like cache_get_string for strings of any length; returns a malloc'd copy or NULL.
+char* cache_get_string_alloc(FILE *cache_file) {
+    uint32_t len;
+    if (!cache_get_u32(cache_file, &len) || len == UINT32_MAX) return NULL;
+    char *str = (char*)malloc((size_t)len + 1);
+    if (!str) return NULL;
+    if (fread(str, 1, len, cache_file) != len) { free(str); return NULL; }
+    str[len] = '\0';
+    return str;
+}
+
+// Reads one token stream (after its line index) into 'tl', validating it against the
+// layout tokenize_line_cached produces. The tokens still need their definitions resolved.
+bool cache_get_token_stream(FILE *cache_file, TokenizedLine *tl) {
+    uint64_t signature;
+    uint32_t count, storage_size;
+    if (!cache_get_u64(cache_file, &signature) || !cache_get_u32(cache_file, &count) ||
+        count == 0 || count > MAX_EXPRESSION_TOKENS ||
+        !cache_get_u32(cache_file, &storage_size) || storage_size > TOKEN_STORAGE_SIZE) {
+        return false;
+    }
+    Token *tokens = (Token*)calloc(count, sizeof(Token));
+    char *storage = (char*)malloc(storage_size > 0 ? storage_size : 1);
+    if (!tokens || !storage || fread(storage, 1, storage_size, cache_file) != storage_size) {
+        free(tokens); free(storage);
+        return false;
+    }
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t type, len, line, col;
+        if (!cache_get_u32(cache_file, &type) || !cache_get_u32(cache_file, &len) ||
+            !cache_get_u32(cache_file, &line) || !cache_get_u32(cache_file, &col) || type > TOKEN_ERROR) {
+            free(tokens); free(storage);
+            return false;
+        }
+        tokens[i].type = (TokenType)type;
+        tokens[i].len = (int)len;
+        tokens[i].line = (int)line;
+        tokens[i].col = (int)col;
+        if (tokens[i].type == TOKEN_EOF) {
+            tokens[i].text = "EOF";
+            continue;
+        }
+        if (len >= storage_size - offset || storage[offset + len] != '\0') { // Also rejects storage_size == 0
+            free(tokens); free(storage);
+            return false;
+        }
+        tokens[i].text = storage + offset;
+        offset += len + 1;
+    }
+    free_tokenized_line(tl);
+    tl->tokens = tokens;
+    tl->token_storage = storage;
+    tl->num_tokens = (int)count;
+    tl->op_epoch = 0; // Never current: the first use re-resolves operator definitions
+    tl->op_signature = signature;
+    return true;
+}
+
+// Loads the cache entry for 'info' if it exists and matches. On success the caller owns
+// the lines, the program (NULL if none was cached) and the per-line token array.
+bool load_script_cache(const ScriptSourceInfo *info, char ***lines_out, int *line_count_out,
+                       BytecodeProgram **prog_out, TokenizedLine **line_tokens_out) {
+    char cache_path[MAX_FULL_PATH_LEN];
+    if (!script_cache_file_path(info, cache_path, sizeof(cache_path))) return false;
+    size_t payload_size, map_size;
+    const char *image = map_checksummed_file(cache_path, &payload_size, &map_size);
+    if (!image) return false;
+    FILE *cache_file = fmemopen((void*)image, payload_size, "rb");
+    if (!cache_file) { munmap((void*)image, map_size); return false; }
+
+    char magic[4], cached_path[MAX_FULL_PATH_LEN];
+    uint32_t version, line_count = 0, instr_count = 0, stream_count = 0;
+    uint64_t mtime, size, content_hash, language_signature;
+    bool ok = fread(magic, 1, sizeof(magic), cache_file) == sizeof(magic) &&
+              memcmp(magic, BSH_CACHE_MAGIC, sizeof(magic)) == 0 &&
+              cache_get_u32(cache_file, &version) && version == BSH_CACHE_FORMAT_VERSION &&
+              cache_get_u64(cache_file, &mtime) && mtime == (uint64_t)info->mtime &&
+              cache_get_u64(cache_file, &size) && size == (uint64_t)info->size &&
+              cache_get_u64(cache_file, &content_hash) && content_hash == info->content_hash &&
+              cache_get_u64(cache_file, &language_signature) && language_signature == info->language_signature &&
+              cache_get_string(cache_file, cached_path, sizeof(cached_path)) && strcmp(cached_path, info->path) == 0 &&
+              cache_get_u32(cache_file, &line_count) && line_count <= (uint32_t)info->size + 1;
+
+    char **lines = NULL;
+    TokenizedLine *line_tokens = NULL;
+    BytecodeProgram *prog = NULL;
+    if (ok && line_count > 0) {
+        lines = (char**)calloc(line_count, sizeof(char*));
+        line_tokens = (TokenizedLine*)calloc(line_count, sizeof(TokenizedLine));
+        ok = lines && line_tokens;
+    }
+    char line_buffer[MAX_LINE_LENGTH];
+    for (uint32_t i = 0; ok && i < line_count; i++) {
+        ok = cache_get_string(cache_file, line_buffer, sizeof(line_buffer)) && (lines[i] = strdup(line_buffer)) != NULL;
+        if (ok) line_tokens[i].text = lines[i];
+    }
+
+    if (ok) ok = cache_get_u32(cache_file, &instr_count) && instr_count <= line_count * 4 + 4;
+    if (ok && instr_count > 0) {
+        prog = (BytecodeProgram*)calloc(1, sizeof(BytecodeProgram));
+        if (prog) prog->code = (BytecodeInstr*)calloc(instr_count, sizeof(BytecodeInstr));
+        ok = prog && prog->code;
+        if (ok) {
+            prog->count = prog->capacity = (int)instr_count;
+            prog->lines = lines;
+        }
+    }
+    for (uint32_t pc = 0; ok && pc < instr_count; pc++) {
+        uint32_t fields[7]; // op, jump_target, line_no, arg_start, body_first_line, body_line_count, has_text
+        for (int f = 0; ok && f < 7; f++) ok = cache_get_u32(cache_file, &fields[f]);
+        if (!ok) break;
+        BytecodeInstr *instr = &prog->code[pc];
+        instr->op = (BytecodeOp)fields[0];
+        instr->jump_target = (int32_t)fields[1];
+        instr->line_no = (int)fields[2];
+        instr->arg_start = (int)fields[3];
+        instr->body_first_line = (int32_t)fields[4];
+        instr->body_line_count = (int)fields[5];
+        ok = fields[0] <= BC_NEXT_RECORD && instr->jump_target >= -1 && instr->jump_target <= (int)instr_count &&
+             fields[2] <= line_count && fields[3] < MAX_EXPRESSION_TOKENS && fields[5] <= line_count &&
+             (instr->op != BC_DEFUNC || (instr->body_first_line >= 0 &&
+                                         instr->body_first_line + instr->body_line_count <= (int)line_count));
+        if (ok && fields[6]) {
+            ok = instr->line_no >= 1;
+            if (ok) instr->line.text = lines[instr->line_no - 1];
+        }
+    }
+
+    if (ok) ok = cache_get_u32(cache_file, &stream_count) && stream_count <= line_count;
+    for (uint32_t i = 0; ok && i < stream_count; i++) {
+        uint32_t line_idx;
+        ok = cache_get_u32(cache_file, &line_idx) && line_idx < line_count && !line_tokens[line_idx].tokens &&
+             cache_get_token_stream(cache_file, &line_tokens[line_idx]);
+    }
+    fclose(cache_file);
+    munmap((void*)image, map_size);
+
+    if (!ok) {
+        for (uint32_t i = 0; line_tokens && i < line_count; i++) free_tokenized_line(&line_tokens[i]);
+        free(line_tokens);
+        free_bytecode_program(prog);
+        free_script_lines(lines, (int)line_count);
+        return false;
+    }
+    *lines_out = lines;
+    *line_count_out = (int)line_count;
+    *prog_out = prog;
+    *line_tokens_out = line_tokens;
+    return true;
+}
+
+// Writes the cache entry for 'info'. Token streams come from the program's instructions
+// and/or 'line_tokens' (either may be NULL). Failures are ignored; the script simply
+// runs uncached next time.
+void save_script_cache(const ScriptSourceInfo *info, char **lines, int line_count,
+                       BytecodeProgram *prog, TokenizedLine *line_tokens) {
+    char cache_path[MAX_FULL_PATH_LEN];
+    if (!script_cache_file_path(info, cache_path, sizeof(cache_path))) return;
+    char *slash = strrchr(cache_path, '/');
+    if (slash && slash != cache_path) {
+        *slash = '\0';
+        mkdir(cache_path, 0700); // Usually exists already
+        *slash = '/';
+    }
+
+    TokenizedLine **streams = line_count > 0 ? (TokenizedLine**)calloc(line_count, sizeof(TokenizedLine*)) : NULL;
+    if (line_count > 0 && !streams) return;
+    for (int i = 0; line_tokens && i < line_count; i++) {
+        if (line_tokens[i].tokens) streams[i] = &line_tokens[i];
+    }
+    for (int pc = 0; prog && pc < prog->count; pc++) {
+        BytecodeInstr *instr = &prog->code[pc];
+        if (instr->line.tokens && instr->line_no >= 1 && instr->line_no <= line_count) streams[instr->line_no - 1] = &instr->line;
+    }
+
+    char *image = NULL;
+    size_t image_size = 0;
+    FILE *cache_file = open_memstream(&image, &image_size);
+    if (!cache_file) { free(streams); return; }
+
+    fwrite(BSH_CACHE_MAGIC, 1, 4, cache_file);
+    cache_put_u32(cache_file, BSH_CACHE_FORMAT_VERSION);
+    cache_put_u64(cache_file, (uint64_t)info->mtime);
+    cache_put_u64(cache_file, (uint64_t)info->size);
+    cache_put_u64(cache_file, info->content_hash);
+    cache_put_u64(cache_file, info->language_signature);
+    cache_put_string(cache_file, info->path);
+
+    cache_put_u32(cache_file, (uint32_t)line_count);
+    for (int i = 0; i < line_count; i++) cache_put_string(cache_file, lines[i]);
+
+    cache_put_u32(cache_file, prog ? (uint32_t)prog->count : 0);
+    for (int pc = 0; prog && pc < prog->count; pc++) {
+        BytecodeInstr *instr = &prog->code[pc];
+        cache_put_u32(cache_file, (uint32_t)instr->op);
+        cache_put_u32(cache_file, (uint32_t)instr->jump_target);
+        cache_put_u32(cache_file, (uint32_t)instr->line_no);
+        cache_put_u32(cache_file, (uint32_t)instr->arg_start);
+        cache_put_u32(cache_file, (uint32_t)instr->body_first_line);
+        cache_put_u32(cache_file, (uint32_t)instr->body_line_count);
+        cache_put_u32(cache_file, instr->line.text ? 1 : 0);
+    }
+
+    uint32_t stream_count = 0;
+    for (int i = 0; i < line_count; i++) if (streams[i]) stream_count++;
+    cache_put_u32(cache_file, stream_count);
+    for (int i = 0; i < line_count; i++) {
+        TokenizedLine *tl = streams[i];
+        if (!tl) continue;
+        uint32_t storage_size = 0;
+        for (int t = 0; t < tl->num_tokens; t++) {
+            if (tl->tokens[t].type != TOKEN_EOF) storage_size += tl->tokens[t].len + 1;
+        }
+        cache_put_u32(cache_file, (uint32_t)i);
+        cache_put_u64(cache_file, tl->op_signature);
+        cache_put_u32(cache_file, (uint32_t)tl->num_tokens);
+        cache_put_u32(cache_file, storage_size);
+        fwrite(tl->token_storage, 1, storage_size, cache_file);
+        for (int t = 0; t < tl->num_tokens; t++) {
+            cache_put_u32(cache_file, (uint32_t)tl->tokens[t].type);
+            cache_put_u32(cache_file, (uint32_t)tl->tokens[t].len);
+            cache_put_u32(cache_file, (uint32_t)tl->tokens[t].line);
+            cache_put_u32(cache_file, (uint32_t)tl->tokens[t].col);
+        }
+    }
+    free(streams);
+    bool ok = !ferror(cache_file);
+    if (fclose(cache_file) != 0) ok = false;
+    if (ok) write_checksummed_file(cache_path, image, image_size);
+    free(image);
+}
+
+// Writes 'image' plus a trailing u64 FNV-1a checksum to a temporary file and renames it
+// to 'path', so concurrent readers never see a partial file.
+bool write_checksummed_file(const char *path, const char *image, size_t image_size) {
+    char temp_path[MAX_FULL_PATH_LEN + 32];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+    uint64_t checksum = hash_bytes_fnv1a(image, image_size, BSH_FNV1A_OFFSET);
+    FILE *disk_file = fopen(temp_path, "wb");
+    if (!disk_file) return false;
+    bool ok = fwrite(image, 1, image_size, disk_file) == image_size &&
+              fwrite(&checksum, sizeof(checksum), 1, disk_file) == 1;
+    if (fclose(disk_file) != 0) ok = false;
+    if (!ok || rename(temp_path, path) != 0) { unlink(temp_path); return false; }
+    return true;
+}
+
+// Maps a file written by write_checksummed_file read-only and verifies its checksum.
+// Returns the payload (munmap it with *map_size_out) or NULL.
+const char* map_checksummed_file(const char *path, size_t *payload_size_out, size_t *map_size_out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= (off_t)sizeof(uint64_t)) { close(fd); return NULL; }
+    size_t map_size = (size_t)st.st_size;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    size_t payload_size = map_size - sizeof(uint64_t);
+    uint64_t stored_checksum;
+    memcpy(&stored_checksum, (const char*)map + payload_size, sizeof(stored_checksum));
+    if (stored_checksum != hash_bytes_fnv1a(map, payload_size, BSH_FNV1A_OFFSET)) {
+        munmap(map, map_size);
+        return NULL;
+    }
+    *payload_size_out = payload_size;
+    *map_size_out = map_size;
+    return (const char*)map;
+}
+
 void execute_script(const char *filename, bool is_import_call, bool is_startup_script) {
     // ... (remains largely the same, ensure loop_start_fpos is correctly passed if used by while)
     FILE *script_file = fopen(filename, "r");
@@ -2444,23 +4452,62 @@ void execute_script(const char *filename, bool is_import_call, bool is_startup_s
         return;
     }
     
-    char line_buffer[INPUT_BUFFER_SIZE]; int line_no = 0;
     ExecutionState script_exec_mode = is_import_call ? STATE_IMPORT_PARSING : STATE_NORMAL;
 
     ExecutionState outer_exec_state_backup = current_exec_state;
     int outer_block_stack_top_bf_backup = block_stack_top_bf;
     bool restore_context = (!is_import_call && !is_startup_script);
 
-    while (true) {
-        if (!fgets(line_buffer, sizeof(line_buffer), script_file)) {
-            if (feof(script_file)) break; 
-            if (ferror(script_file)) { perror("Error reading script file"); break; }
-        }
-        line_no++;
-        process_line(line_buffer, script_file, line_no, script_exec_mode);
+    // Imports and the startup script go through the .bshc cache, which supplies the
+    // trimmed lines, compiled program and token streams recorded by an earlier run.
+    ScriptSourceInfo source_info;
+    bool use_cache = (is_import_call || is_startup_script) && read_script_source_info(script_file, filename, &source_info);
+    char **script_lines = NULL;
+    int script_line_count = 0;
+    BytecodeProgram *prog = NULL;
+    TokenizedLine *script_tokens = NULL;
+    bool cache_hit = use_cache && load_script_cache(&source_info, &script_lines, &script_line_count, &prog, &script_tokens);
+    if (!cache_hit) {
+        // The script is read once; loops replay its lines from memory.
+        script_line_count = read_script_lines(script_file, &script_lines);
     }
     fclose(script_file);
 
+    bool compiled_now = false;
+    if (bsh_engine_mode == ENGINE_VM && !prog) {
+        prog = compile_bytecode_program(script_lines, script_line_count, filename);
+        compiled_now = (prog != NULL);
+    }
+    if (bsh_engine_mode == ENGINE_VM && prog) {
+        for (int pc = 0; script_tokens && pc < prog->count; pc++) { // Move cached token streams onto their instructions
+            BytecodeInstr *instr = &prog->code[pc];
+            if (!instr->line.text || instr->line.tokens || !script_tokens[instr->line_no - 1].tokens) continue;
+            instr->line = script_tokens[instr->line_no - 1];
+            memset(&script_tokens[instr->line_no - 1], 0, sizeof(TokenizedLine));
+            script_tokens[instr->line_no - 1].text = script_lines[instr->line_no - 1];
+        }
+        run_bytecode_program(prog, script_exec_mode);
+    } else if (script_line_count > 0) {
+        if (!script_tokens) {
+            script_tokens = (TokenizedLine*)calloc(script_line_count, sizeof(TokenizedLine));
+            if (script_tokens) {
+                for (int i = 0; i < script_line_count; i++) script_tokens[i].text = script_lines[i];
+            } else {
+                perror("calloc for script token cache failed"); // Still runnable, just re-tokenized every time
+            }
+        }
+        execute_line_sequence(script_lines, script_tokens, script_line_count, true, script_exec_mode);
+    }
+
+    if (use_cache && (!cache_hit || compiled_now)) {
+        save_script_cache(&source_info, script_lines, script_line_count,
+                          bsh_engine_mode == ENGINE_VM ? prog : NULL, script_tokens);
+    }
+    free_bytecode_program(prog);
+    for (int i = 0; script_tokens && i < script_line_count; i++) free_tokenized_line(&script_tokens[i]);
+    free(script_tokens);
+    free_script_lines(script_lines, script_line_count);
+
     if (is_import_call) { 
         if (is_defining_function && current_function_definition) {
             fprintf(stderr, "Warning: Unterminated function definition '%s' at end of imported file '%s'.\n", current_function_definition->name, filename);
@@ -2494,327 +4541,1481 @@ void execute_script(const char *filename, bool is_import_call, bool is_startup_s
     }
 }
 
-///
-/// Objects (JSON-like)
-///
-
-// Helper to skip whitespace in the object string
-const char* skip_whitespace_in_obj_str(const char* s) {
-    while (*s && isspace((unsigned char)*s)) s++;
-    return s;
-}
-
-// Helper to parse a BSH-style quoted string from the object string
-// Returns a pointer to the character after the parsed string (and closing quote).
-// Stores the unescaped string content in 'dest_buffer'.
-// This is a simplified string parser for this specific context.
-const char* parse_quoted_string_from_obj_str(const char* s, char* dest_buffer, size_t buffer_size) {
-    dest_buffer[0] = '\0';
-    s = skip_whitespace_in_obj_str(s);
-    if (*s != '"') return s; // Expected opening quote
-
-    s++; // Skip opening quote
-    char* out = dest_buffer;
-    size_t count = 0;
-    while (*s && count < buffer_size - 1) {
-        if (*s == '"') { // End of string
-            s++; // Skip closing quote
-            *out = '\0';
-            return s;
-        }
-        // Basic escape handling (add more if needed: \n, \t, etc.)
-        if (*s == '\\' && *(s + 1) != '\0') {
-            s++;
-            if (*s == '"' || *s == '\\') {
-                *out++ = *s++;
-            } else { // Keep backslash if not a recognized escape for this simple parser
-                *out++ = '\\';
-                *out++ = *s++;
-            }
-        } else {
-            *out++ = *s++;
+// --- Interpreter Snapshots ---
+// Everything startup defines, so later shells can skip initialize_shell and the startup
+// script. Same encoding and checksum trailer as .bshc files:
+//   "BSHS" u32 version
+//   u32 library count, then per library alias, path
+//   u32 operator count, then per operator op_str, u32 token type, op type, precedence,
+//       associativity, handler name ("native:lib:sym" handlers are re-resolved on load)
+//   u32 keyword alias count, then per alias original, alias
+//   u32 function count, then per function name, u32 param count, params, u32 line
+//       count, lines
+//   u32 global variable count, then per variable name, value, u32 is_array_element,
+//       u32 array length + 1 (0 for scalars), then per element u32 is-set, value if set,
+//       u32 object kind: 0 none, 1 object:, 2 json: (the tree is re-parsed from the value)
+// Lists are written oldest entry first so reloading them rebuilds the same order.
+// PATH, module search directories and CWD are not stored; they come from the loading
+// process (initialize_process_state).
+
+bool save_interpreter_snapshot(const char *path) {
+    char *image = NULL;
+    size_t image_size = 0;
+    FILE *snap_file = open_memstream(&image, &image_size);
+    if (!snap_file) { perror("bsh: open_memstream for snapshot failed"); return false; }
+    fwrite(BSH_SNAPSHOT_MAGIC, 1, 4, snap_file);
+    cache_put_u32(snap_file, BSH_SNAPSHOT_FORMAT_VERSION);
+
+    // Lists are newest-first in memory, so walk them backwards via a pointer array.
+    int count = 0;
+    for (DynamicLib *lib = loaded_libs; lib; lib = lib->next) count++;
+    cache_put_u32(snap_file, (uint32_t)count);
+    DynamicLib **libs = (DynamicLib**)malloc(sizeof(DynamicLib*) * (count + 1));
+    int idx = 0;
+    for (DynamicLib *lib = loaded_libs; libs && lib; lib = lib->next) libs[idx++] = lib;
+    for (int i = idx - 1; i >= 0; i--) {
+        cache_put_string(snap_file, libs[i]->alias);
+        cache_put_string(snap_file, libs[i]->path);
+    }
+    free(libs);
+
+    count = 0;
+    for (OperatorDefinition *op = operator_list_head; op; op = op->next) count++;
+    cache_put_u32(snap_file, (uint32_t)count);
+    OperatorDefinition **ops = (OperatorDefinition**)malloc(sizeof(OperatorDefinition*) * (count + 1));
+    idx = 0;
+    for (OperatorDefinition *op = operator_list_head; ops && op; op = op->next) ops[idx++] = op;
+    for (int i = idx - 1; i >= 0; i--) {
+        cache_put_string(snap_file, ops[i]->op_str);
+        cache_put_u32(snap_file, (uint32_t)ops[i]->token_type);
+        cache_put_u32(snap_file, (uint32_t)ops[i]->op_type_prop);
+        cache_put_u32(snap_file, (uint32_t)ops[i]->precedence);
+        cache_put_u32(snap_file, (uint32_t)ops[i]->associativity);
+        cache_put_string(snap_file, ops[i]->bsh_handler_name);
+    }
+    free(ops);
+
+    count = 0; // Aliases resolve one level, so their order does not matter
+    for (size_t i = 0; i < keyword_table_capacity; i++) if (keyword_table[i].is_alias) count++;
+    cache_put_u32(snap_file, (uint32_t)count);
+    for (size_t i = 0; i < keyword_table_capacity; i++) {
+        if (!keyword_table[i].is_alias) continue;
+        cache_put_string(snap_file, keyword_table[i].original);
+        cache_put_string(snap_file, keyword_table[i].word);
+    }
+
+    count = 0;
+    for (UserFunction *func = function_list; func; func = func->next) count++;
+    cache_put_u32(snap_file, (uint32_t)count);
+    UserFunction **funcs = (UserFunction**)malloc(sizeof(UserFunction*) * (count + 1));
+    idx = 0;
+    for (UserFunction *func = function_list; funcs && func; func = func->next) funcs[idx++] = func;
+    for (int i = idx - 1; i >= 0; i--) {
+        cache_put_string(snap_file, funcs[i]->name);
+        cache_put_u32(snap_file, (uint32_t)funcs[i]->param_count);
+        for (int p = 0; p < funcs[i]->param_count; p++) cache_put_string(snap_file, funcs[i]->params[p]);
+        cache_put_u32(snap_file, (uint32_t)funcs[i]->line_count);
+        for (int l = 0; l < funcs[i]->line_count; l++) cache_put_string(snap_file, funcs[i]->body[l]);
+    }
+    free(funcs);
+
+    ScopeFrame *global_frame = &scope_stack[0];
+    count = 0;
+    for (Variable *var = global_frame->variables; var; var = var->next) count++;
+    cache_put_u32(snap_file, (uint32_t)count);
+    Variable **vars = (Variable**)malloc(sizeof(Variable*) * (count + 1));
+    idx = 0;
+    for (Variable *var = global_frame->variables; vars && var; var = var->next) vars[idx++] = var;
+    for (int i = idx - 1; i >= 0; i--) {
+        cache_put_string(snap_file, vars[i]->name);
+        cache_put_string(snap_file, vars[i]->value ? vars[i]->value : "");
+        cache_put_u32(snap_file, vars[i]->is_array_element ? 1 : 0);
+        BshArray *array = vars[i]->array;
+        cache_put_u32(snap_file, array ? (uint32_t)array->length + 1 : 0);
+        for (size_t e = 0; array && e < array->length; e++) {
+            cache_put_u32(snap_file, array->items[e] ? 1 : 0);
+            if (array->items[e]) cache_put_string(snap_file, array->items[e]);
         }
-        count++;
+        cache_put_u32(snap_file, !vars[i]->object ? 0 : vars[i]->object->from_json ? 2 : 1);
+    }
+    free(vars);
+
+    bool ok = libs && ops && funcs && vars && !ferror(snap_file);
+    if (fclose(snap_file) != 0) ok = false;
+    if (ok && !write_checksummed_file(path, image, image_size)) {
+        fprintf(stderr, "bsh: cannot write snapshot '%s': %s\n", path, strerror(errno));
+        ok = false;
+    } else if (!ok) {
+        fprintf(stderr, "bsh: failed to build snapshot '%s'\n", path);
     }
-    *out = '\0'; // Ensure null termination
-    // If loop ended due to buffer full or end of string without closing quote, it's an error
-    // or implies the string was truncated. For simplicity, we return current 's'.
-    return s;
+    free(image);
+    return ok;
 }
 
-// Main recursive parsing function
-// data_ptr is a pointer-to-pointer to traverse the input string
-void parse_bsh_object_recursive(const char** data_ptr, const char* current_base_bsh_var_name, int scope_id) {
-    const char* p = skip_whitespace_in_obj_str(*data_ptr);
+// Restores a snapshot written by save_interpreter_snapshot in place of initialize_shell.
+// Returns false (nothing changed) if the file is missing, from another format version
+// or corrupt; exits if a valid snapshot cannot be applied (e.g. a library is gone).
+bool load_interpreter_snapshot(const char *path) {
+    size_t payload_size, map_size;
+    const char *image = map_checksummed_file(path, &payload_size, &map_size);
+    if (!image) {
+        fprintf(stderr, "bsh: snapshot '%s' is missing or corrupt; starting normally.\n", path);
+        return false;
+    }
+    FILE *snap_file = fmemopen((void*)image, payload_size, "rb");
+    char magic[4];
+    uint32_t version = 0;
+    if (!snap_file || fread(magic, 1, 4, snap_file) != 4 || memcmp(magic, BSH_SNAPSHOT_MAGIC, 4) != 0 ||
+        !cache_get_u32(snap_file, &version) || version != BSH_SNAPSHOT_FORMAT_VERSION) {
+        fprintf(stderr, "bsh: '%s' is not a compatible snapshot; starting normally.\n", path);
+        if (snap_file) fclose(snap_file);
+        munmap((void*)image, map_size);
+        return false;
+    }
 
-    if (*p != '[') {
-        fprintf(stderr, "BSH Object Parse Error: Expected '[' for object/array start. At: %s\n", p);
-        // To prevent infinite loops on malformed input, consume something or error out.
-        // For simplicity, we'll try to find the end or a known delimiter if things go wrong.
-        *data_ptr = p + strlen(p); // Consume rest of string on error
-        return;
+    scope_stack_top = -1;
+    enter_scope();
+    bool ok = restore_snapshot_sections(snap_file);
+    fclose(snap_file);
+    munmap((void*)image, map_size);
+    if (!ok) {
+        fprintf(stderr, "bsh: failed to restore snapshot '%s'\n", path);
+        exit(1);
     }
-    p++; // Consume '['
+    initialize_process_state();
+    return true;
+}
 
-    bool first_element = true;
-    while (*p) {
-        p = skip_whitespace_in_obj_str(p);
-        if (*p == ']') {
-            p++; // Consume ']'
-            break; // End of current object/array
+bool restore_snapshot_sections(FILE *snap_file) {
+    char name[MAX_FULL_PATH_LEN], text[MAX_FULL_PATH_LEN];
+    uint32_t count;
+
+    if (!cache_get_u32(snap_file, &count)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!cache_get_string(snap_file, name, MAX_VAR_NAME_LEN) ||
+            !cache_get_string(snap_file, text, sizeof(text)) ||
+            !load_dynamic_library(text, name)) return false;
+    }
+
+    if (!cache_get_u32(snap_file, &count)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t token_type, op_type, precedence, assoc;
+        if (!cache_get_string(snap_file, name, MAX_OPERATOR_LEN + 1) ||
+            !cache_get_u32(snap_file, &token_type) || !cache_get_u32(snap_file, &op_type) ||
+            !cache_get_u32(snap_file, &precedence) || !cache_get_u32(snap_file, &assoc) ||
+            !cache_get_string(snap_file, text, MAX_VAR_NAME_LEN)) return false;
+        BshLibFunction native_handler = NULL;
+        if (strncmp(text, "native:", 7) == 0 && !(native_handler = resolve_native_operator_handler(text, name))) return false;
+        add_operator_definition(name, (TokenType)token_type, (OperatorType)op_type, (int)precedence,
+                                (OperatorAssociativity)assoc, text, native_handler);
+    }
+
+    if (!cache_get_u32(snap_file, &count)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!cache_get_string(snap_file, name, MAX_KEYWORD_LEN + 1) ||
+            !cache_get_string(snap_file, text, MAX_KEYWORD_LEN + 1)) return false;
+        add_keyword_alias(name, text);
+    }
+
+    if (!cache_get_u32(snap_file, &count)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        UserFunction *func = (UserFunction*)malloc(sizeof(UserFunction));
+        if (!func) { perror("malloc for UserFunction failed"); return false; }
+        memset(func, 0, sizeof(UserFunction));
+        uint32_t param_count, line_count;
+        bool ok = cache_get_string(snap_file, func->name, sizeof(func->name)) &&
+                  cache_get_u32(snap_file, &param_count) && param_count <= MAX_FUNC_PARAMS;
+        for (uint32_t p = 0; ok && p < param_count; p++) {
+            ok = cache_get_string(snap_file, func->params[p], MAX_VAR_NAME_LEN);
+            func->param_count = (int)p + 1;
         }
-
-        if (!first_element) {
-            if (*p == ',') {
-                p++; // Consume ','
-                p = skip_whitespace_in_obj_str(p);
-            } else {
-                fprintf(stderr, "BSH Object Parse Error: Expected ',' or ']' between elements. At: %s\n", p);
-                *data_ptr = p + strlen(p); return; // Error
+        ok = ok && cache_get_u32(snap_file, &line_count) && line_count <= MAX_FUNC_LINES;
+        for (uint32_t l = 0; ok && l < line_count; l++) {
+            ok = (func->body[l] = cache_get_string_alloc(snap_file)) != NULL;
+            func->line_count = (int)l + (ok ? 1 : 0);
+        }
+        if (!ok) { free_user_function(func); return false; }
+        register_user_function(func);
+    }
+
+    if (!cache_get_u32(snap_file, &count)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t is_array_element, array_length_plus_one;
+        char *value = NULL;
+        if (!cache_get_string(snap_file, name, MAX_VAR_NAME_LEN) ||
+            !(value = cache_get_string_alloc(snap_file)) ||
+            !cache_get_u32(snap_file, &is_array_element) ||
+            !cache_get_u32(snap_file, &array_length_plus_one)) { free(value); return false; }
+        set_variable_scoped(name, value, is_array_element != 0);
+        free(value);
+        if (array_length_plus_one > 0) {
+            BshArray *array = get_or_create_array_scoped(name);
+            if (!array || !array_reserve(array, array_length_plus_one - 1)) return false;
+            for (uint32_t e = 0; e + 1 < array_length_plus_one; e++) {
+                uint32_t is_set;
+                if (!cache_get_u32(snap_file, &is_set)) return false;
+                if (is_set && !(array->items[e] = cache_get_string_alloc(snap_file))) return false;
+                array->length = e + 1;
             }
         }
-        first_element = false;
-
-        // Parse Key
-        char key_buffer[MAX_VAR_NAME_LEN]; // For "0", "ciao"
-        p = parse_quoted_string_from_obj_str(p, key_buffer, sizeof(key_buffer));
-        if (strlen(key_buffer) == 0) {
-            fprintf(stderr, "BSH Object Parse Error: Expected valid key string. At: %s\n", p);
-            *data_ptr = p + strlen(p); return; // Error
-        }
-
-        p = skip_whitespace_in_obj_str(p);
-        if (*p != ':') {
-            fprintf(stderr, "BSH Object Parse Error: Expected ':' after key '%s'. At: %s\n", key_buffer, p);
-            *data_ptr = p + strlen(p); return; // Error
-        }
-        p++; // Consume ':'
-        p = skip_whitespace_in_obj_str(p);
-
-        // Construct new base name for BSH variable
-        char next_base_bsh_var_name[MAX_VAR_NAME_LEN * 2]; // Increased size for nested names
-        // Sanitize key_buffer for use in variable names (e.g., replace disallowed chars with '_')
-        // For now, assume keys are simple enough or BSH var names allow them.
-        snprintf(next_base_bsh_var_name, sizeof(next_base_bsh_var_name), "%s_%s", current_base_bsh_var_name, key_buffer);
-
-        // Parse Value
-        if (*p == '[') { // Nested object/array
-            // Set a type for the current key indicating it's a nested structure
-            char type_var_for_key[MAX_VAR_NAME_LEN * 2 + 20];
-            snprintf(type_var_for_key, sizeof(type_var_for_key), "%s_BSH_STRUCT_TYPE", next_base_bsh_var_name);
-            set_variable_scoped(type_var_for_key, "BSH_OBJECT", false); // Using current scope
-
-            parse_bsh_object_recursive(&p, next_base_bsh_var_name, scope_id);
-        } else if (*p == '"') { // String value
-            char value_buffer[INPUT_BUFFER_SIZE]; // Assuming values fit here
-            p = parse_quoted_string_from_obj_str(p, value_buffer, sizeof(value_buffer));
-            set_variable_scoped(next_base_bsh_var_name, value_buffer, false); // Using current scope
-        } else {
-            fprintf(stderr, "BSH Object Parse Error: Expected value (string or nested object) after key '%s'. At: %s\n", key_buffer, p);
-            *data_ptr = p + strlen(p); return; // Error
+        uint32_t is_object;
+        if (!cache_get_u32(snap_file, &is_object)) return false;
+        Variable *var = find_variable_scoped(name);
+        if (is_object && var) {
+            var->object = is_object == 2 ? parse_json_string(var->value, strlen(var->value))
+                                         : parse_bsh_object_string(var->value, strlen(var->value));
         }
-    } // End while
-    *data_ptr = p; // Update the main pointer
+    }
+    return true;
 }
 
-// The public function called by handle_assignment_advanced
-void parse_and_flatten_bsh_object_string(const char* object_data_string, const char* base_var_name, int current_scope_id) {
-    const char* p = object_data_string; // p will be advanced by the recursive parser
-
-    // Set a root type for the base variable name
-    char root_type_var_key[MAX_VAR_NAME_LEN + 30]; // Enough for _BSH_STRUCT_TYPE and safety
-    snprintf(root_type_var_key, sizeof(root_type_var_key), "%s_BSH_STRUCT_TYPE", base_var_name);
-    set_variable_scoped(root_type_var_key, "BSH_OBJECT_ROOT", false); // Or "BSH_ARRAY_ROOT"
-
-    // Temporarily push the target scope if different from current, or ensure set_variable_scoped uses it.
-    // For simplicity, we assume set_variable_scoped in our recursive calls will use the active scope
-    // which should be the one where the assignment is happening.
-    // If 'current_scope_id' is different from scope_stack[scope_stack_top].scope_id,
-    // you might need a temporary scope push/pop or pass scope_id to set_variable_scoped.
-    // The current set_variable_scoped uses scope_stack[scope_stack_top].scope_id implicitly.
-
-    parse_bsh_object_recursive(&p, base_var_name, current_scope_id);
+///
+/// Bytecode Engine
+///
 
-    // p should now point to the end of the parsed structure or where parsing stopped.
-    // You can check if *p is whitespace or null to see if the whole string was consumed.
-    p = skip_whitespace_in_obj_str(p);
-    if (*p != '\0') {
-        fprintf(stderr, "BSH Object Parse Warning: Extra characters found after main object structure. At: %s\n", p);
-    }
-    fprintf(stdout, "[BSH_DEBUG] Flattening complete for base var '%s'.\n", base_var_name);
+// --- Expression Code ---
+
+void expr_emit(ExprCompileContext *ctx, ExprOpCode op, const Token *token, OperatorDefinition *op_def, int arity) {
+    ExprInstr *ins = &ctx->out->code[ctx->out->count++];
+    ins->op = op;
+    ins->token = token;
+    ins->op_def = op_def;
+    ins->arity = arity;
+    if (op == EXPR_OP_APPLY) ctx->stack_depth -= arity - 1;
+    else ctx->stack_depth++;
+    if (ctx->stack_depth > ctx->out->max_stack) ctx->out->max_stack = ctx->stack_depth;
 }
 
-/// Stringify object
-
-// Helper for stringification: find all variables prefixed by base_var_name_
-// This is a conceptual helper, actual iteration would be over variable_list_head.
-typedef struct VarPair { char key[MAX_VAR_NAME_LEN]; char* value; char type_info[MAX_VAR_NAME_LEN]; struct VarPair* next; } VarPair;
-
-// Recursive helper
-bool build_object_string_recursive(const char* current_base_name, char** p_out, size_t* remaining_size, int scope_id) {
-    char prefix_pattern[MAX_VAR_NAME_LEN * 2];
-    snprintf(prefix_pattern, sizeof(prefix_pattern), "%s_", current_base_name);
-    size_t prefix_len = strlen(prefix_pattern);
-
-    VarPair* pairs_head = NULL;
-    VarPair* pairs_tail = NULL;
-    int element_count = 0;
-
-    // Step 1: Collect all direct children of current_base_name in the current scope
-    Variable* var_node = variable_list_head;
-    while (var_node) {
-        if (var_node->scope_id == scope_id && strncmp(var_node->name, prefix_pattern, prefix_len) == 0) {
-            const char* sub_key_full = var_node->name + prefix_len;
-            // Ensure this is a direct child, not a grandchild (e.g., base_key1_subkey vs base_key1)
-            if (strchr(sub_key_full, '_') == NULL || 
-                (strstr(sub_key_full, "_BSH_STRUCT_TYPE") != NULL && strchr(sub_key_full, '_') == strstr(sub_key_full, "_BSH_STRUCT_TYPE")) ) {
-                
-                char actual_key[MAX_VAR_NAME_LEN];
-                strncpy(actual_key, sub_key_full, sizeof(actual_key)-1);
-                actual_key[sizeof(actual_key)-1] = '\0';
-                
-                char* type_suffix_ptr = strstr(actual_key, "_BSH_STRUCT_TYPE");
-                if (type_suffix_ptr) { // It's a type variable for a sub-object, not a direct value itself (unless it's the root)
-                    *type_suffix_ptr = '\0'; // Get the key name before "_BSH_STRUCT_TYPE"
-                }
+// Mirrors parse_operand. Any input the recursive parser would report an error for
+// makes compilation fail, so the caller falls back to it and the user sees the
+// same diagnostics.
+bool expr_compile_operand(ExprCompileContext *ctx) {
+    if (ctx->current_token_idx >= ctx->num_tokens) return false;
+    if (ctx->recursion_depth >= MAX_EXPR_RECURSION_DEPTH) return false;
+    ctx->recursion_depth++;
 
-                // Avoid adding duplicates if we process type var and value var separately
-                bool key_already_added = false;
-                for(VarPair* vp = pairs_head; vp; vp = vp->next) { if(strcmp(vp->key, actual_key) == 0) {key_already_added = true; break;}}
-                if(key_already_added && !type_suffix_ptr) continue; // If value var and key is added from type, skip
-                if(key_already_added && type_suffix_ptr) { // Update type if key exists
-                     for(VarPair* vp = pairs_head; vp; vp = vp->next) { if(strcmp(vp->key, actual_key) == 0) { strncpy(vp->type_info, var_node->value, sizeof(vp->type_info)-1); break;}}
-                     continue;
+    Token *current_token = &ctx->tokens[ctx->current_token_idx];
+    if (current_token->type == TOKEN_NUMBER || current_token->type == TOKEN_VARIABLE || current_token->type == TOKEN_WORD) {
+        expr_emit(ctx, EXPR_OP_PUSH_VALUE, current_token, NULL, 0);
+        ctx->current_token_idx++;
+    } else if (current_token->type == TOKEN_STRING) {
+        expr_emit(ctx, EXPR_OP_PUSH_STRING, current_token, NULL, 0);
+        ctx->current_token_idx++;
+    } else if (current_token->type == TOKEN_LPAREN) {
+        ctx->current_token_idx++;
+        if (!expr_compile_recursive(ctx, 0)) return false;
+        if (ctx->current_token_idx >= ctx->num_tokens || ctx->tokens[ctx->current_token_idx].type != TOKEN_RPAREN) return false;
+        ctx->current_token_idx++;
+    } else if (current_token->type == TOKEN_OPERATOR) {
+        OperatorDefinition *op_def = current_token->prefix_op;
+        if (!op_def || op_def->op_type_prop != OP_TYPE_UNARY_PREFIX) return false;
+        ctx->current_token_idx++;
+        if (!expr_compile_recursive(ctx, op_def->precedence)) return false;
+        expr_emit(ctx, EXPR_OP_APPLY, current_token, op_def, 1);
+    } else {
+        return false;
+    }
+    ctx->recursion_depth--;
+    return true;
+}
+
+// Mirrors parse_expression_recursive, emitting operators in the order it applies them.
+bool expr_compile_recursive(ExprCompileContext *ctx, int min_precedence) {
+    if (ctx->recursion_depth >= MAX_EXPR_RECURSION_DEPTH) return false;
+    ctx->recursion_depth++;
+
+    if (!expr_compile_operand(ctx)) return false;
+
+    while (ctx->current_token_idx < ctx->num_tokens) {
+        Token *lookahead_op_token = &ctx->tokens[ctx->current_token_idx];
+        OperatorDefinition *op_def = NULL;
+
+        if (lookahead_op_token->type == TOKEN_OPERATOR) {
+            op_def = lookahead_op_token->infix_op;
+        } else if (lookahead_op_token->type == TOKEN_RPAREN || lookahead_op_token->type == TOKEN_EOF ||
+                   lookahead_op_token->type == TOKEN_SEMICOLON) {
+            break;
+        } else {
+            return false;
+        }
+
+        if (!op_def || op_def->precedence < min_precedence) break;
+
+        if (op_def->op_type_prop == OP_TYPE_BINARY_INFIX) {
+            if (op_def->associativity == ASSOC_LEFT && op_def->precedence <= min_precedence) break;
+            ctx->current_token_idx++;
+            int next_min_precedence = (op_def->associativity == ASSOC_LEFT) ? (op_def->precedence + 1) : op_def->precedence;
+            if (!expr_compile_recursive(ctx, next_min_precedence)) return false;
+            expr_emit(ctx, EXPR_OP_APPLY, lookahead_op_token, op_def, 2);
+        } else if (op_def->op_type_prop == OP_TYPE_UNARY_POSTFIX) {
+            ctx->current_token_idx++;
+            expr_emit(ctx, EXPR_OP_APPLY, lookahead_op_token, op_def, 1);
+        } else if (op_def->op_type_prop == OP_TYPE_TERNARY_PRIMARY && strcmp(op_def->op_str, "?") == 0) {
+            ctx->current_token_idx++;
+            if (!expr_compile_recursive(ctx, 0)) return false;
+            if (ctx->current_token_idx >= ctx->num_tokens ||
+                ctx->tokens[ctx->current_token_idx].type != TOKEN_OPERATOR ||
+                strcmp(ctx->tokens[ctx->current_token_idx].text, ":") != 0) return false;
+            ctx->current_token_idx++;
+            if (!expr_compile_recursive(ctx, 0)) return false;
+            expr_emit(ctx, EXPR_OP_APPLY, lookahead_op_token, op_def, 3);
+        } else {
+            return false;
+        }
+    }
+    ctx->recursion_depth--;
+    return true;
+}
+
+// Lowers an expression to postfix code. Returns NULL if the expression is empty or
+// anything about it would make evaluate_expression_from_tokens report an error.
+// The code points into 'tokens', which must outlive it.
+ExprCode* compile_expression_code(Token *tokens, int num_tokens) {
+    if (num_tokens <= 0) return NULL;
+
+    ExprCode *code = (ExprCode*)malloc(sizeof(ExprCode));
+    if (!code) { perror("malloc for expression code failed"); return NULL; }
+    code->code = (ExprInstr*)malloc(sizeof(ExprInstr) * num_tokens); // At most one instruction per token
+    if (!code->code) { perror("malloc for expression code failed"); free(code); return NULL; }
+    code->count = 0;
+    code->max_stack = 0;
+
+    ExprCompileContext ctx;
+    ctx.tokens = tokens;
+    ctx.num_tokens = num_tokens;
+    ctx.current_token_idx = 0;
+    ctx.recursion_depth = 0;
+    ctx.out = code;
+    ctx.stack_depth = 0;
+
+    if (!expr_compile_recursive(&ctx, 0) || ctx.stack_depth != 1 ||
+        (ctx.current_token_idx < num_tokens && tokens[ctx.current_token_idx].type != TOKEN_EOF)) {
+        free_expression_code(code);
+        return NULL;
+    }
+    return code;
+}
+
+void free_expression_code(ExprCode *code) {
+    if (!code) return;
+    free(code->code);
+    free(code);
+}
+
+// Value stacks for run_expression_code, one per nesting level: operator handlers
+// can re-enter the VM, so an evaluation never shares its slots with the ones it calls.
+// Each buffer is kept and only grows, so steady-state evaluation does not allocate.
+char **expr_stack_pool = NULL;
+size_t *expr_stack_pool_slots = NULL;
+int expr_stack_pool_levels = 0;
+int expr_stack_depth = 0;
+
+// Returns 'slots' INPUT_BUFFER_SIZE slots for the current nesting level, or NULL.
+char (*reserve_expression_stack(int slots))[INPUT_BUFFER_SIZE] {
+    if (expr_stack_depth >= expr_stack_pool_levels) {
+        int new_levels = expr_stack_pool_levels ? expr_stack_pool_levels * 2 : 8;
+        char **grown_pool = (char**)realloc(expr_stack_pool, sizeof(char*) * new_levels);
+        if (!grown_pool) return NULL;
+        expr_stack_pool = grown_pool;
+        size_t *grown_slots = (size_t*)realloc(expr_stack_pool_slots, sizeof(size_t) * new_levels);
+        if (!grown_slots) return NULL;
+        expr_stack_pool_slots = grown_slots;
+        for (int i = expr_stack_pool_levels; i < new_levels; i++) {
+            expr_stack_pool[i] = NULL;
+            expr_stack_pool_slots[i] = 0;
+        }
+        expr_stack_pool_levels = new_levels;
+    }
+    int level = expr_stack_depth;
+    if (expr_stack_pool_slots[level] < (size_t)slots) {
+        char *grown = (char*)realloc(expr_stack_pool[level], (size_t)slots * INPUT_BUFFER_SIZE);
+        if (!grown) return NULL;
+        expr_stack_pool[level] = grown;
+        expr_stack_pool_slots[level] = slots;
+    }
+    return (char (*)[INPUT_BUFFER_SIZE])expr_stack_pool[level];
+}
+
+void free_expression_stack_pool() {
+    for (int i = 0; i < expr_stack_pool_levels; i++) free(expr_stack_pool[i]);
+    free(expr_stack_pool);
+    free(expr_stack_pool_slots);
+    expr_stack_pool = NULL;
+    expr_stack_pool_slots = NULL;
+    expr_stack_pool_levels = 0;
+}
+
+bool run_expression_code(ExprCode *code, char *result_buffer, size_t buffer_size) {
+    // The last slot is scratch space for unescaping string literals.
+    char (*stack)[INPUT_BUFFER_SIZE] = reserve_expression_stack(code->max_stack + 1);
+    if (!stack) {
+        perror("malloc for expression stack failed");
+        strncpy(result_buffer, "EXPR_EVAL_ERROR_NO_MEMORY", buffer_size - 1);
+        result_buffer[buffer_size - 1] = '\0';
+        return false;
+    }
+    char *scratch = stack[code->max_stack];
+    expr_stack_depth++;
+
+    int sp = 0;
+    for (int pc = 0; pc < code->count; pc++) {
+        ExprInstr *ins = &code->code[pc];
+        switch (ins->op) {
+            case EXPR_OP_PUSH_VALUE:
+                expand_variables_in_string_advanced(ins->token->text, stack[sp++], INPUT_BUFFER_SIZE);
+                break;
+            case EXPR_OP_PUSH_STRING:
+                unescape_string(ins->token->text, scratch, INPUT_BUFFER_SIZE);
+                expand_variables_in_string_advanced(scratch, stack[sp++], INPUT_BUFFER_SIZE);
+                break;
+            case EXPR_OP_APPLY: {
+                const char *bsh_args[3];
+                sp -= ins->arity;
+                for (int i = 0; i < ins->arity; i++) bsh_args[i] = stack[sp + i];
+                // On handler errors the result slot holds the error string, as in the recursive parser.
+                apply_operator_definition(ins->op_def, ins->arity, bsh_args, stack[sp], INPUT_BUFFER_SIZE);
+                sp++;
+                break;
+            }
+        }
+    }
+
+    strncpy(result_buffer, stack[0], buffer_size - 1);
+    result_buffer[buffer_size - 1] = '\0';
+    expr_stack_depth--;
+    return true;
+}
+
+// --- Conditions ---
+
+bool bsh_value_is_truthy(const char *value) {
+    return strcmp(value, "1") == 0 || strcasecmp(value, "true") == 0 ||
+           (value[0] != '\0' && strcmp(value, "0") != 0 && strcasecmp(value, "false") != 0);
+}
+
+// Condition form used by 'while' and 'else if': either 'a <op> b', handed to
+// evaluate_condition_advanced, or a single (expanded) value tested for truthiness.
+// A leading '!' is left to the caller.
+bool evaluate_condition_tokens(Token *tokens, int count) {
+    if (count <= 0) return false;
+    if (count >= 3 && tokens[1].type == TOKEN_OPERATOR) {
+        return evaluate_condition_advanced(&tokens[0], &tokens[1], &tokens[2]);
+    }
+    char condition_value_expanded[INPUT_BUFFER_SIZE];
+    if (tokens[0].type == TOKEN_STRING) {
+        char unescaped[INPUT_BUFFER_SIZE];
+        unescape_string(tokens[0].text, unescaped, sizeof(unescaped));
+        expand_variables_in_string_advanced(unescaped, condition_value_expanded, sizeof(condition_value_expanded));
+    } else {
+        expand_variables_in_string_advanced(tokens[0].text, condition_value_expanded, sizeof(condition_value_expanded));
+    }
+    return bsh_value_is_truthy(condition_value_expanded);
+}
+
+// --- Compiler ---
+
+void bytecode_compile_error(BytecodeCompiler *comp, int line_no, const char *message) {
+    fprintf(stderr, "bsh: %s line %d: %s; using the line engine.\n", comp->origin_name, line_no, message);
+}
+
+int bytecode_emit(BytecodeCompiler *comp, BytecodeOp op, int line_no) {
+    BytecodeProgram *prog = comp->prog;
+    if (prog->count == prog->capacity) {
+        int new_capacity = prog->capacity ? prog->capacity * 2 : 16;
+        BytecodeInstr *grown = (BytecodeInstr*)realloc(prog->code, sizeof(BytecodeInstr) * new_capacity);
+        if (!grown) { perror("realloc for bytecode failed"); return -1; }
+        prog->code = grown;
+        prog->capacity = new_capacity;
+    }
+    BytecodeInstr *instr = &prog->code[prog->count];
+    memset(instr, 0, sizeof(BytecodeInstr));
+    instr->op = op;
+    instr->jump_target = -1;
+    instr->line_no = line_no;
+    return prog->count++;
+}
+
+// Emits an instruction for a source line. 'arg_start' skips the header words of
+// if/else if/while. The line is tokenized when the instruction first runs.
+int bytecode_emit_line(BytecodeCompiler *comp, BytecodeOp op, int line_idx, int arg_start) {
+    int pc = bytecode_emit(comp, op, line_idx + 1);
+    if (pc < 0) return -1;
+    BytecodeInstr *instr = &comp->prog->code[pc];
+    instr->line.text = comp->prog->lines[line_idx];
+    instr->arg_start = arg_start;
+    return pc;
+}
+
+bool bytecode_push_block(BytecodeCompiler *comp, BlockType type, int header_pc, int chain_head) {
+    if (comp->block_count >= MAX_NESTING_DEPTH) return false;
+    BytecodeCompileBlock *block = &comp->blocks[comp->block_count++];
+    block->type = type;
+    block->header_pc = header_pc;
+    block->chain_head = chain_head;
+    block->body_first_line = -1;
+    block->body_depth = 0;
+    return true;
+}
+
+// Every exit of the closed if/else chain lands on the next instruction to be emitted.
+void bytecode_finish_chain(BytecodeCompiler *comp) {
+    if (!comp->has_pending_chain) return;
+    BytecodeInstr *code = comp->prog->code;
+    int end_pc = comp->prog->count;
+    if (comp->pending_chain.header_pc >= 0) code[comp->pending_chain.header_pc].jump_target = end_pc;
+    for (int pc = comp->pending_chain.chain_head; pc >= 0; ) {
+        int next_pc = code[pc].jump_target;
+        code[pc].jump_target = end_pc;
+        pc = next_pc;
+    }
+    comp->has_pending_chain = false;
+}
+
+// Block structure is recovered from the source text, not from tokens: lines are
+// only tokenized when first executed, after any 'defoperator' before them has run.
+
+// True if the last character outside strings and comments is '{'.
+bool bytecode_line_opens_block(const char *text) {
+    char last = '\0';
+    bool in_string = false;
+    for (const char *p = text; *p; p++) {
+        if (in_string) {
+            if (*p == '\\' && p[1]) p++;
+            else if (*p == '"') in_string = false;
+            last = '"';
+            continue;
+        }
+        if (*p == '"') { in_string = true; last = '"'; continue; }
+        if (*p == '#') break;
+        if (!isspace((unsigned char)*p)) last = *p;
+    }
+    return last == '{';
+}
+
+// Reads the leading word (as the tokenizer would form it) after any whitespace and
+// resolves keyword aliases. Returns a pointer past the word; 'keyword' is "" if none.
+const char* bytecode_scan_keyword(const char *text, char *keyword, size_t keyword_size) {
+    const char *p = text;
+    while (isspace((unsigned char)*p)) p++;
+    size_t len = 0;
+    char word[MAX_KEYWORD_LEN + 1];
+    while ((isalnum((unsigned char)p[len]) || p[len] == '_') && len < sizeof(word) - 1) {
+        word[len] = p[len];
+        len++;
+    }
+    word[len] = '\0';
+    strncpy(keyword, len > 0 ? resolve_keyword_alias(word) : "", keyword_size - 1);
+    keyword[keyword_size - 1] = '\0';
+    return p + len;
+}
+
+bool bytecode_rest_is_empty(const char *p) {
+    while (isspace((unsigned char)*p)) p++;
+    return *p == '\0' || *p == '#';
+}
+
+// 'else' or 'else if ...' ('after_else' points past the 'else'); continues the pending chain.
+bool bytecode_compile_else(BytecodeCompiler *comp, int line_idx, const char *after_else, int header_words) {
+    int line_no = line_idx + 1;
+    if (!comp->has_pending_chain || comp->pending_chain.header_pc < 0) {
+        bytecode_compile_error(comp, line_no, "'else' without a preceding 'if'");
+        return false;
+    }
+    int jump_pc = bytecode_emit(comp, BC_JUMP, line_no);
+    if (jump_pc < 0) return false;
+    comp->prog->code[jump_pc].jump_target = comp->pending_chain.chain_head;
+    comp->prog->code[comp->pending_chain.header_pc].jump_target = comp->prog->count;
+    comp->has_pending_chain = false;
+
+    char keyword[MAX_KEYWORD_LEN + 1];
+    bytecode_scan_keyword(after_else, keyword, sizeof(keyword));
+    int header_pc = -1;
+    if (strcmp(keyword, "if") == 0) {
+        header_pc = bytecode_emit_line(comp, BC_ELSE_IF, line_idx, header_words + 1);
+        if (header_pc < 0) return false;
+    }
+    comp->awaiting_lbrace = !bytecode_line_opens_block(comp->prog->lines[line_idx]);
+    if (!bytecode_push_block(comp, BLOCK_TYPE_ELSE, header_pc, jump_pc)) {
+        bytecode_compile_error(comp, line_no, "blocks nested too deeply");
+        return false;
+    }
+    return true;
+}
+
+// Compiles one trimmed, non-empty source line. 'line_idx' indexes comp->prog->lines.
+bool bytecode_compile_line(BytecodeCompiler *comp, int line_idx) {
+    const char *text = comp->prog->lines[line_idx];
+    int line_no = line_idx + 1;
+    BytecodeCompileBlock *top = comp->block_count > 0 ? &comp->blocks[comp->block_count - 1] : NULL;
+
+    if (text[0] == '#') return true;
+
+    // Function bodies are copied verbatim by BC_DEFUNC; only their braces are tracked here.
+    if (top && top->type == BLOCK_TYPE_FUNCTION_DEF && !comp->awaiting_lbrace) {
+        if (text[0] == '}') {
+            if (top->body_depth == 0) {
+                if (!bytecode_rest_is_empty(text + 1)) {
+                    bytecode_compile_error(comp, line_no, "unexpected text after the '}' closing a function");
+                    return false;
                 }
+                BytecodeInstr *defunc_instr = &comp->prog->code[top->header_pc];
+                defunc_instr->body_first_line = top->body_first_line;
+                defunc_instr->body_line_count = line_idx - top->body_first_line;
+                defunc_instr->jump_target = comp->prog->count;
+                comp->block_count--;
+                return true;
+            }
+            top->body_depth--;
+        }
+        if (bytecode_line_opens_block(text)) top->body_depth++;
+        return true;
+    }
+
+    char keyword[MAX_KEYWORD_LEN + 1];
+    const char *after_keyword = bytecode_scan_keyword(text, keyword, sizeof(keyword));
+    bool is_else = strcmp(keyword, "else") == 0;
+    if (comp->has_pending_chain && !is_else) bytecode_finish_chain(comp);
+
+    if (comp->awaiting_lbrace) {
+        if (text[0] != '{' || !bytecode_rest_is_empty(text + 1)) {
+            bytecode_compile_error(comp, line_no, "'{' expected");
+            return false;
+        }
+        comp->awaiting_lbrace = false;
+        if (top && top->type == BLOCK_TYPE_FUNCTION_DEF) top->body_first_line = line_idx + 1;
+        return true;
+    }
+
+    if (text[0] == '{') {
+        bytecode_compile_error(comp, line_no, "'{' without a preceding if/else/while/foreach_record/defunc");
+        return false;
+    }
+    if (text[0] == '}') {
+        if (!top) {
+            bytecode_compile_error(comp, line_no, "'}' without a matching open block");
+            return false;
+        }
+        comp->block_count--;
+        if (top->type == BLOCK_TYPE_WHILE || top->type == BLOCK_TYPE_FOREACH_RECORD) {
+            int back_edge = bytecode_emit(comp, top->type == BLOCK_TYPE_WHILE ? BC_JUMP : BC_NEXT_RECORD, line_no);
+            if (back_edge < 0) return false;
+            comp->prog->code[back_edge].jump_target = top->header_pc;
+            comp->prog->code[top->header_pc].jump_target = comp->prog->count;
+        } else {
+            comp->pending_chain = *top;
+            comp->has_pending_chain = true;
+        }
+        if (bytecode_rest_is_empty(text + 1)) return true;
+        after_keyword = bytecode_scan_keyword(text + 1, keyword, sizeof(keyword));
+        if (strcmp(keyword, "else") != 0) {
+            bytecode_compile_error(comp, line_no, "unexpected text after '}'");
+            return false;
+        }
+        return bytecode_compile_else(comp, line_idx, after_keyword, 2); // '}' 'else'
+    }
+    if (is_else) return bytecode_compile_else(comp, line_idx, after_keyword, 1);
+
+    if (strcmp(keyword, "if") == 0 || strcmp(keyword, "while") == 0 || strcmp(keyword, "defunc") == 0 ||
+        strcmp(keyword, "foreach_record") == 0) {
+        BytecodeOp op = BC_DEFUNC;
+        BlockType block_type = BLOCK_TYPE_FUNCTION_DEF;
+        if (strcmp(keyword, "if") == 0) { op = BC_IF; block_type = BLOCK_TYPE_IF; }
+        else if (strcmp(keyword, "while") == 0) { op = BC_WHILE; block_type = BLOCK_TYPE_WHILE; }
+        else if (strcmp(keyword, "foreach_record") == 0) { op = BC_FOREACH_RECORD; block_type = BLOCK_TYPE_FOREACH_RECORD; }
+
+        int header_pc = bytecode_emit_line(comp, op, line_idx, 1);
+        if (header_pc < 0) return false;
+        if (!bytecode_push_block(comp, block_type, header_pc, -1)) {
+            bytecode_compile_error(comp, line_no, "blocks nested too deeply");
+            return false;
+        }
+        comp->awaiting_lbrace = !bytecode_line_opens_block(text);
+        if (!comp->awaiting_lbrace && op == BC_DEFUNC) comp->blocks[comp->block_count - 1].body_first_line = line_idx + 1;
+        return true;
+    }
+    if (strcmp(keyword, "defkeyword") == 0) {
+        // Block keywords are resolved at compile time, so aliases must exist before the script is compiled.
+        bytecode_compile_error(comp, line_no, "'defkeyword' changes block keywords while the script runs");
+        return false;
+    }
+    return bytecode_emit_line(comp, BC_COMMAND, line_idx, 0) >= 0;
+}
 
+// Compiles 'lines' (trimmed; line N of the source is lines[N-1]) into a program that
+// borrows them. Returns NULL, after saying why, if the block structure cannot be
+// resolved statically; the caller then runs the lines with the line engine.
+BytecodeProgram* compile_bytecode_program(char **lines, int line_count, const char *origin_name) {
+    BytecodeProgram *prog = (BytecodeProgram*)calloc(1, sizeof(BytecodeProgram));
+    if (!prog) { perror("calloc for bytecode program failed"); return NULL; }
+    prog->lines = lines;
+
+    BytecodeCompiler comp;
+    memset(&comp, 0, sizeof(comp));
+    comp.prog = prog;
+    comp.origin_name = origin_name;
+
+    for (int i = 0; i < line_count; i++) {
+        if (!lines[i] || lines[i][0] == '\0') continue;
+        if (!bytecode_compile_line(&comp, i)) {
+            free_bytecode_program(prog);
+            return NULL;
+        }
+    }
+    bytecode_finish_chain(&comp);
 
-                VarPair* new_pair = (VarPair*)malloc(sizeof(VarPair));
-                if (!new_pair) { /* error */ return false; }
-                strncpy(new_pair->key, actual_key, sizeof(new_pair->key)-1);
-                new_pair->key[sizeof(new_pair->key)-1] = '\0';
-                new_pair->value = NULL; // Will be filled if it's a direct value
-                new_pair->type_info[0] = '\0'; // Default no specific type
-                new_pair->next = NULL;
+    if (comp.block_count > 0 || comp.awaiting_lbrace) {
+        bytecode_compile_error(&comp, line_count, "unterminated block at end of input");
+        free_bytecode_program(prog);
+        return NULL;
+    }
+    return prog;
+}
 
-                if (type_suffix_ptr) { // This was a *_BSH_STRUCT_TYPE variable
-                    strncpy(new_pair->type_info, var_node->value, sizeof(new_pair->type_info)-1);
-                } else { // This is a direct value variable
-                    new_pair->value = var_node->value;
+void free_bytecode_program(BytecodeProgram *prog) {
+    if (!prog) return;
+    for (int i = 0; i < prog->count; i++) {
+        free_tokenized_line(&prog->code[i].line);
+        free_expression_code(prog->code[i].expr);
+    }
+    free(prog->code);
+    free(prog);
+}
+
+// --- VM ---
+
+// Brings an instruction's tokens up to the current operator table and works out
+// which tokens hold its condition or expression. Plain statements are reclassified,
+// since a new operator can turn e.g. '$x = y' into an assignment.
+bool vm_prepare_instruction(BytecodeInstr *instr) {
+    if (instr->op == BC_JUMP || instr->op == BC_NOP || instr->op == BC_NEXT_RECORD) return true;
+    if (instr->line.op_epoch != operator_table_epoch) {
+        if (!tokenize_line_cached(&instr->line, instr->line_no)) return false;
+        instr->classified = false;
+    }
+    if (instr->classified) return true;
+
+    free_expression_code(instr->expr);
+    instr->expr = NULL;
+    instr->expr_failed = false;
+
+    Token *tokens = instr->line.tokens;
+    int num_tokens = instr->line.num_tokens;
+    switch (instr->op) {
+        case BC_IF: case BC_ELSE_IF: case BC_WHILE:
+            instr->arg_end = num_tokens;
+            while (instr->arg_end > instr->arg_start &&
+                   (tokens[instr->arg_end - 1].type == TOKEN_EOF || tokens[instr->arg_end - 1].type == TOKEN_COMMENT ||
+                    tokens[instr->arg_end - 1].type == TOKEN_LBRACE)) {
+                instr->arg_end--;
+            }
+            break;
+        case BC_DEFUNC: case BC_FOREACH_RECORD:
+            break;
+        default:
+            instr->arg_end = num_tokens;
+            if (num_tokens == 0 || tokens[0].type == TOKEN_EOF || tokens[0].type == TOKEN_COMMENT) {
+                instr->op = BC_NOP;
+            } else if (num_tokens >= 3 && tokens[0].type == TOKEN_VARIABLE &&
+                       (tokens[1].type == TOKEN_ASSIGN || (tokens[1].type == TOKEN_OPERATOR && strcmp(tokens[1].text, "=") == 0))) {
+                instr->op = BC_ASSIGN;
+                instr->arg_start = 2;
+            } else if (tokens[0].type == TOKEN_WORD) {
+                instr->op = BC_COMMAND;
+                instr->arg_start = 0;
+            } else {
+                instr->op = BC_EXPR;
+                instr->arg_start = 0;
+            }
+            break;
+    }
+    instr->classified = true;
+    return true;
+}
+
+bool vm_evaluate_expression(BytecodeInstr *instr, char *result_buffer, size_t buffer_size) {
+    Token *expr_tokens = &instr->line.tokens[instr->arg_start];
+    int count = instr->arg_end - instr->arg_start;
+    if (!instr->expr && !instr->expr_failed) {
+        instr->expr = compile_expression_code(expr_tokens, count);
+        if (!instr->expr) instr->expr_failed = true;
+    }
+    if (instr->expr) return run_expression_code(instr->expr, result_buffer, buffer_size);
+    return evaluate_expression_from_tokens(expr_tokens, count, result_buffer, buffer_size);
+}
+
+// Condition of BC_ELSE_IF/BC_WHILE, with the optional leading '!'.
+bool vm_evaluate_block_condition(BytecodeInstr *instr) {
+    Token *tokens = &instr->line.tokens[instr->arg_start];
+    int count = instr->arg_end - instr->arg_start;
+    bool negate_result = false;
+    if (count > 0 && tokens[0].type == TOKEN_OPERATOR && strcmp(tokens[0].text, "!") == 0) {
+        negate_result = true;
+        tokens++; count--;
+    }
+    if (count <= 0) {
+        fprintf(stderr, "Syntax error for '%s': Missing condition (line %d)\n", instr->op == BC_WHILE ? "while" : "else if", instr->line_no);
+        return false;
+    }
+    bool condition_result = evaluate_condition_tokens(tokens, count);
+    return negate_result ? !condition_result : condition_result;
+}
+
+// Registers the function declared by a BC_DEFUNC, copying its body lines the way
+// capture_function_body_line would have.
+void vm_define_function(BytecodeProgram *prog, BytecodeInstr *instr) {
+    ExecutionState state_before_defunc = current_exec_state;
+    int block_stack_top_before_defunc = block_stack_top_bf;
+
+    handle_defunc_statement_advanced(instr->line.tokens, instr->line.num_tokens);
+    if (current_function_definition) {
+        UserFunction *func = current_function_definition;
+        for (int i = 0; i < instr->body_line_count; i++) {
+            const char *body_line = prog->lines[instr->body_first_line + i];
+            if (!body_line || body_line[0] == '\0') continue;
+            if (func->line_count >= MAX_FUNC_LINES) {
+                fprintf(stderr, "Error: Function '%s' exceeds %d lines; body truncated.\n", func->name, MAX_FUNC_LINES);
+                break;
+            }
+            func->body[func->line_count] = strdup(body_line);
+            if (!func->body[func->line_count]) { perror("strdup for function body line failed"); break; }
+            func->line_count++;
+        }
+        current_function_definition = NULL;
+        register_user_function(func);
+    }
+    is_defining_function = false;
+    block_stack_top_bf = block_stack_top_before_defunc;
+    current_exec_state = state_before_defunc;
+}
+
+void vm_execute_instruction(BytecodeProgram *prog, BytecodeInstr *instr, int *pc, ExecutionState exec_mode) {
+    switch (instr->op) {
+        case BC_NOP:
+            break;
+        case BC_JUMP:
+            *pc = instr->jump_target;
+            return;
+        case BC_IF: {
+            bool condition_is_true = false;
+            if (instr->arg_end <= instr->arg_start) {
+                fprintf(stderr, "Syntax error for 'if': Missing condition (line %d)\n", instr->line_no);
+            } else {
+                char condition_result_str[INPUT_BUFFER_SIZE];
+                if (vm_evaluate_expression(instr, condition_result_str, sizeof(condition_result_str))) {
+                    condition_is_true = bsh_value_is_truthy(condition_result_str);
+                } else {
+                    fprintf(stderr, "Error evaluating 'if' condition: %s (line %d)\n", condition_result_str, instr->line_no);
+                }
+            }
+            if (!condition_is_true) { *pc = instr->jump_target; return; }
+            break;
+        }
+        case BC_ELSE_IF:
+        case BC_WHILE:
+            if (!vm_evaluate_block_condition(instr)) { *pc = instr->jump_target; return; }
+            break;
+        case BC_DEFUNC:
+            vm_define_function(prog, instr);
+            *pc = instr->jump_target;
+            return;
+        case BC_FOREACH_RECORD:
+            if (!foreach_record_advance(instr->line.tokens, instr->line.num_tokens)) { *pc = instr->jump_target; return; }
+            break;
+        case BC_NEXT_RECORD:
+            end_record_iteration();
+            *pc = instr->jump_target;
+            return;
+        case BC_ASSIGN: {
+            char rhs_value_buffer[INPUT_BUFFER_SIZE];
+            if (!vm_evaluate_expression(instr, rhs_value_buffer, sizeof(rhs_value_buffer))) {
+                fprintf(stderr, "Error evaluating RHS for assignment to '%s'. Result: %s\n", instr->line.tokens[0].text, rhs_value_buffer);
+            }
+            assign_evaluated_value(&instr->line.tokens[0], rhs_value_buffer);
+            break;
+        }
+        case BC_EXPR: {
+            char expression_result_buffer[INPUT_BUFFER_SIZE];
+            if (vm_evaluate_expression(instr, expression_result_buffer, sizeof(expression_result_buffer))) {
+                if (strlen(expression_result_buffer) > 0 &&
+                     strncmp(expression_result_buffer, "EXPR_PARSE_ERROR", strlen("EXPR_PARSE_ERROR")) != 0 &&
+                     strncmp(expression_result_buffer, "BSH_HANDLER_NOT_FOUND", strlen("BSH_HANDLER_NOT_FOUND")) !=0 ) {
+                    printf("%s\n", expression_result_buffer);
                 }
-                
-                if (!pairs_head) pairs_head = pairs_tail = new_pair;
-                else { pairs_tail->next = new_pair; pairs_tail = new_pair; }
-                element_count++;
+            } else {
+                fprintf(stderr, "bsh: Failed to evaluate expression starting with '%s' (line %d)\n", instr->line.tokens[0].text, instr->line_no);
             }
+            set_variable_scoped("LAST_OP_RESULT", expression_result_buffer, false);
+            break;
         }
-        var_node = var_node->next;
+        case BC_COMMAND:
+            execute_tokenized_line(instr->line.tokens, instr->line.num_tokens, &instr->line, NULL, instr->line_no, exec_mode);
+            break;
     }
-    
-    // Step 1b: For keys found via _BSH_STRUCT_TYPE, find their actual value if they are simple
-    // (This logic might need refinement if a key is ONLY defined by its _BSH_STRUCT_TYPE but has no direct value, implying it's purely a container)
-    for(VarPair* vp = pairs_head; vp; vp = vp->next) {
-        if (vp->value == NULL && strlen(vp->type_info) == 0) { // No value and no type, try to get direct value
-             char direct_value_var_name[MAX_VAR_NAME_LEN *2];
-             snprintf(direct_value_var_name, sizeof(direct_value_var_name), "%s_%s", current_base_name, vp->key);
-             vp->value = get_variable_scoped(direct_value_var_name); // Relies on correct scope
-        }
-    }
-
-
-    // Step 2: Append '['
-    if (*remaining_size < 2) return false;
-    **p_out = '['; (*p_out)++; (*remaining_size)--;
-
-    // Step 3: Iterate through collected pairs and stringify them
-    // TODO: Sort pairs if necessary (e.g., numeric keys for array-like objects)
-    bool first = true;
-    VarPair* current_pair = pairs_head;
-    while (current_pair) {
-        if (!first) {
-            if (*remaining_size < 2) { /* free VarPairs */ return false; }
-            **p_out = ','; (*p_out)++;
-            **p_out = ' '; (*p_out)++; // Optional space
-            (*remaining_size) -= 2;
-        }
-        first = false;
-
-        // Append key (quoted)
-        if (*remaining_size < strlen(current_pair->key) + 3) { /* free VarPairs */ return false; }
-        **p_out = '"'; (*p_out)++; (*remaining_size)--;
-        strcpy(*p_out, current_pair->key); (*p_out) += strlen(current_pair->key); (*remaining_size) -= strlen(current_pair->key);
-        **p_out = '"'; (*p_out)++; (*remaining_size)--;
-
-        // Append ':'
-        if (*remaining_size < 2) { /* free VarPairs */ return false; }
-        **p_out = ':'; (*p_out)++;
-        **p_out = ' '; (*p_out)++; // Optional space
-        (*remaining_size) -= 2;
-
-        // Append value
-        char next_level_base_name[MAX_VAR_NAME_LEN * 2];
-        snprintf(next_level_base_name, sizeof(next_level_base_name), "%s_%s", current_base_name, current_pair->key);
-
-        if (strcmp(current_pair->type_info, "BSH_OBJECT") == 0 || strcmp(current_pair->type_info, "BSH_OBJECT_ROOT") == 0) { // It's a nested object
-            if (!build_object_string_recursive(next_level_base_name, p_out, remaining_size, scope_id)) {
-                 /* free VarPairs */ return false;
+    (*pc)++;
+}
+
+void run_bytecode_program(BytecodeProgram *prog, ExecutionState exec_mode) {
+    prog->active_runs++;
+    int outer_record_loops = record_loop_count;
+    int pc = 0;
+    while (pc < prog->count && current_exec_state != STATE_RETURN_REQUESTED) {
+        BytecodeInstr *instr = &prog->code[pc];
+        if (instr->line.tokens && instr->line.op_epoch != operator_table_epoch && prog->active_runs > 1) {
+            // An outer run of this program may still be using this instruction's
+            // tokens, so a stale line is re-tokenized into a private copy.
+            BytecodeInstr private_instr = *instr;
+            memset(&private_instr.line, 0, sizeof(TokenizedLine));
+            private_instr.line.text = instr->line.text;
+            private_instr.classified = false;
+            private_instr.expr = NULL;
+            if (vm_prepare_instruction(&private_instr)) {
+                vm_execute_instruction(prog, &private_instr, &pc, exec_mode);
+            } else {
+                pc++;
             }
-        } else if (current_pair->value) { // Simple string value
-            if (*remaining_size < strlen(current_pair->value) + 3) { /* free VarPairs */ return false; }
-            **p_out = '"'; (*p_out)++; (*remaining_size)--;
-            // TODO: Escape special characters in current_pair->value before strcpy
-            strcpy(*p_out, current_pair->value);
-            (*p_out) += strlen(current_pair->value);
-            (*remaining_size) -= strlen(current_pair->value);
-            **p_out = '"'; (*p_out)++; (*remaining_size)--;
-        } else { // Should have a value or be a known container type
-            if (*remaining_size < 3) { /* free VarPairs */ return false; }
-            strcpy(*p_out, "\"\""); (*p_out) += 2; (*remaining_size) -=2; // Empty string if no value found
-        }
-        current_pair = current_pair->next;
-    }
-
-    // Step 4: Append ']'
-    if (*remaining_size < 2) { /* free VarPairs */ return false; }
-    **p_out = ']'; (*p_out)++; (*remaining_size)--;
-    **p_out = '\0';
-
-    // Free the collected VarPair list
-    current_pair = pairs_head;
-    while(current_pair) {
-        VarPair* next = current_pair->next;
-        free(current_pair);
-        current_pair = next;
+            free_tokenized_line(&private_instr.line);
+            free_expression_code(private_instr.expr);
+            continue;
+        }
+        if (!vm_prepare_instruction(instr)) { pc++; continue; }
+        vm_execute_instruction(prog, instr, &pc, exec_mode);
+    }
+    close_record_loops_above(outer_record_loops); // Left by 'return'/'exit' inside the body
+    prog->active_runs--;
+}
+
+///
+/// Objects (JSON-like)
+///
+
+// Single-pass parser: every byte of the payload is looked at once and all reads are
+// bounded by 'end' rather than a NUL. Strings are decoded in place in the parser's copy
+// of the input (no fixed key/value buffers, so nothing is truncated, and no allocation
+// per string); entries point straight into that copy.
+void object_parser_skip_space(ObjectParser* parser) {
+    while (parser->p < parser->end && isspace((unsigned char)*parser->p)) parser->p++;
+}
+
+// Reports a syntax error once, showing a short excerpt of the remaining input.
+void object_parser_error(ObjectParser* parser, const char* message) {
+    if (parser->failed) return;
+    parser->failed = true;
+    int excerpt_len = (int)(parser->end - parser->p < 40 ? parser->end - parser->p : 40);
+    fprintf(stderr, "BSH %s Parse Error: %s at offset %zu. At: %.*s\n",
+            parser->format, message, (size_t)(parser->p - parser->start), excerpt_len, parser->p);
+}
+
+// Decodes the "quoted string" at the cursor in place and returns it NUL-terminated
+// (the terminator overwrites the closing quote). \" and \\ are unescaped; any other
+// backslash is kept as is.
+char* object_parser_read_string(ObjectParser* parser) {
+    if (parser->p >= parser->end || *parser->p != '"') { object_parser_error(parser, "Expected '\"'"); return NULL; }
+    char* text = parser->p + 1;
+    char* in = text;
+    while (in < parser->end && *in != '"' && *in != '\\') in++; // Common case: nothing to decode
+    char* out = in;
+    while (in < parser->end && *in != '"') {
+        if (*in == '\\' && in + 1 < parser->end && (in[1] == '"' || in[1] == '\\')) in++;
+        *out++ = *in++;
+    }
+    if (in >= parser->end) { object_parser_error(parser, "Unterminated string"); return NULL; }
+    *out = '\0';
+    parser->p = in + 1;
+    return text;
+}
+
+// Parses one [...] level at the cursor into 'object'. On error the entries parsed so
+// far are kept and false is returned.
+bool parse_bsh_object_recursive(ObjectParser* parser, BshObject* object) {
+    object_parser_skip_space(parser);
+    if (parser->p >= parser->end || *parser->p != '[') { object_parser_error(parser, "Expected '[' for object/array start"); return false; }
+    if (++parser->depth > MAX_OBJECT_DEPTH) { object_parser_error(parser, "Objects nested too deeply"); return false; }
+    parser->p++; // Consume '['
+
+    for (bool first_element = true; ; first_element = false) {
+        object_parser_skip_space(parser);
+        if (parser->p < parser->end && *parser->p == ']') { parser->p++; break; }
+        if (!first_element) {
+            if (parser->p >= parser->end || *parser->p != ',') { object_parser_error(parser, "Expected ',' or ']' between elements"); return false; }
+            parser->p++;
+            object_parser_skip_space(parser);
+        }
+
+        char* key = object_parser_read_string(parser);
+        if (!key) return false;
+        if (key[0] == '\0') { object_parser_error(parser, "Expected valid key string"); return false; }
+        object_parser_skip_space(parser);
+        if (parser->p >= parser->end || *parser->p != ':') { object_parser_error(parser, "Expected ':' after key"); return false; }
+        parser->p++;
+        object_parser_skip_space(parser);
+
+        // A repeated key replaces the earlier value
+        BshObjectEntry* entry;
+        if (parser->p < parser->end && *parser->p == '[') { // Nested object/array
+            BshObject* child = (BshObject*)calloc(1, sizeof(BshObject));
+            if (!child || !(entry = bsh_object_put(object, key))) { perror("bsh: object parse"); free(child); parser->failed = true; return false; }
+            entry->child = child;
+            if (!parse_bsh_object_recursive(parser, child)) return false;
+        } else if (parser->p < parser->end && *parser->p == '"') { // String value
+            char* value = object_parser_read_string(parser);
+            if (!value) return false;
+            if (!(entry = bsh_object_put(object, key))) { perror("bsh: object parse"); parser->failed = true; return false; }
+            entry->value = value;
+        } else {
+            object_parser_error(parser, "Expected value (string or nested object)");
+            return false;
+        }
     }
+    parser->depth--;
     return true;
 }
 
+// Parses 'length' bytes of "[...]" object data (the part after "object:") into a tree
+// owned by the caller. Returns NULL only if out of memory; malformed input yields what
+// parsed before the error.
+BshObject* parse_bsh_object_string(const char* object_data_string, size_t length) {
+    BshObject* object = (BshObject*)calloc(1, sizeof(BshObject));
+    if (!object || !(object->text = (char*)malloc(length + 1))) { perror("bsh: object parse"); free(object); return NULL; }
+    memcpy(object->text, object_data_string, length);
+    object->text[length] = '\0';
+    ObjectParser parser = { object->text, object->text, object->text + length, 0, false, "Object", object, NULL, 0 };
+    if (parse_bsh_object_recursive(&parser, object)) {
+        object_parser_skip_space(&parser);
+        if (parser.p < parser.end) {
+            fprintf(stderr, "BSH Object Parse Warning: Extra characters found after main object structure at offset %zu.\n",
+                    (size_t)(parser.p - parser.start));
+        }
+    }
+    return object;
+}
 
-bool stringify_bsh_object_to_string(const char* base_var_name, char* output_buffer, size_t buffer_size) {
-    output_buffer[0] = '\0';
-    if (buffer_size < strlen("object:[]") + 1) return false; // Min possible output
+BshObjectEntry* bsh_object_find(const BshObject* object, const char* key) {
+    unsigned long key_hash = hash_variable_name(key);
+    if (object->slots) {
+        size_t mask = object->slot_capacity - 1;
+        for (size_t slot = key_hash & mask; object->slots[slot] != 0; slot = (slot + 1) & mask) {
+            BshObjectEntry* entry = &object->entries[object->slots[slot] - 1];
+            if (entry->key_hash == key_hash && strcmp(entry->key, key) == 0) return entry;
+        }
+        return NULL;
+    }
+    for (size_t i = 0; i < object->count; i++) {
+        if (object->entries[i].key_hash == key_hash && strcmp(object->entries[i].key, key) == 0) return &object->entries[i];
+    }
+    return NULL;
+}
 
-    strcpy(output_buffer, "object:");
-    char* p_out = output_buffer + strlen("object:");
-    size_t remaining_size = buffer_size - strlen("object:") -1 /* for null terminator */;
-    
-    int current_scope = (scope_stack_top >= 0) ? scope_stack[scope_stack_top].scope_id : GLOBAL_SCOPE_ID;
+// Rebuilds the key index with 'new_slot_capacity' slots (a power of two).
+bool bsh_object_reindex(BshObject* object, size_t new_slot_capacity) {
+    size_t* new_slots = (size_t*)calloc(new_slot_capacity, sizeof(size_t));
+    if (!new_slots) return false;
+    for (size_t i = 0; i < object->count; i++) {
+        size_t slot = object->entries[i].key_hash & (new_slot_capacity - 1);
+        while (new_slots[slot] != 0) slot = (slot + 1) & (new_slot_capacity - 1);
+        new_slots[slot] = i + 1;
+    }
+    free(object->slots);
+    object->slots = new_slots;
+    object->slot_capacity = new_slot_capacity;
+    return true;
+}
+
+// Returns the entry for 'key', emptied if it already existed, or a new one at the end.
+// 'key' (and any value stored in the entry) must live in the root's 'text'.
+BshObjectEntry* bsh_object_put(BshObject* object, char* key) {
+    BshObjectEntry* entry = bsh_object_find(object, key);
+    if (entry) {
+        entry->value = NULL;
+        free_bsh_object(entry->child); entry->child = NULL;
+        return entry;
+    }
+    if (object->count == object->capacity) {
+        size_t new_capacity = object->capacity ? object->capacity * 2 : 4;
+        BshObjectEntry* new_entries = (BshObjectEntry*)realloc(object->entries, new_capacity * sizeof(BshObjectEntry));
+        if (!new_entries) return NULL;
+        object->entries = new_entries;
+        object->capacity = new_capacity;
+    }
+    entry = &object->entries[object->count];
+    entry->key = key;
+    entry->value = NULL;
+    entry->child = NULL;
+    entry->key_hash = hash_variable_name(key);
+    object->count++;
+
+    // Index kept at most half full once the object outgrows a linear scan
+    if (object->count > BSH_OBJECT_INDEX_THRESHOLD && object->count * 2 > object->slot_capacity) {
+        size_t new_slot_capacity = object->slot_capacity ? object->slot_capacity * 2 : BSH_OBJECT_INDEX_THRESHOLD * 4;
+        if (!bsh_object_reindex(object, new_slot_capacity)) { object->count--; return NULL; }
+    } else if (object->slots) {
+        size_t mask = object->slot_capacity - 1;
+        size_t slot = entry->key_hash & mask;
+        while (object->slots[slot] != 0) slot = (slot + 1) & mask;
+        object->slots[slot] = object->count;
+    }
+    return entry;
+}
+
+void free_bsh_object(BshObject* object) {
+    if (!object) return;
+    for (size_t i = 0; i < object->count; i++) free_bsh_object(object->entries[i].child);
+    free(object->entries);
+    free(object->slots);
+    free(object->text);
+    while (object->extra_text) {
+        BshTextChunk* next = object->extra_text->next;
+        free(object->extra_text);
+        object->extra_text = next;
+    }
+    free(object);
+}
 
-    if (!build_object_string_recursive(base_var_name, &p_out, &remaining_size, current_scope)) {
-        // Append error marker if something went wrong during build
-        strcat(output_buffer, "[ERROR_DURING_STRINGIFY]");
+/// JSON
+
+// Copies 'length' bytes of 'text' into the root's generated-string storage and returns
+// the NUL-terminated copy. Chunks double in size, so a document needs few of them.
+char* bsh_object_add_text(BshObject* root, const char* text, size_t length) {
+    BshTextChunk* chunk = root->extra_text;
+    if (!chunk || chunk->capacity - chunk->used < length + 1) {
+        size_t capacity = chunk ? chunk->capacity * 2 : 4096;
+        if (capacity > 1 << 20) capacity = 1 << 20;
+        if (capacity < length + 1) capacity = length + 1;
+        BshTextChunk* new_chunk = (BshTextChunk*)malloc(sizeof(BshTextChunk) + capacity);
+        if (!new_chunk) return NULL;
+        new_chunk->next = chunk;
+        new_chunk->used = 0;
+        new_chunk->capacity = capacity;
+        root->extra_text = chunk = new_chunk;
+    }
+    char* copy = chunk->data + chunk->used;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    chunk->used += length + 1;
+    return copy;
+}
+
+// JSON documents map onto the same tree as object: data. Objects keep their member
+// names; arrays become objects keyed "0", "1", ... (so $doc.items.0.name works); strings
+// are decoded; numbers keep their source text; true, false and null become those words.
+// Like the object: parser this is one pass over a private copy of the input, with
+// strings decoded in place, so multi-megabyte documents parse in linear time. Returns
+// NULL for a document that is a single scalar (the variable keeps its text) or if out
+// of memory.
+BshObject* parse_json_string(const char* json_text, size_t length) {
+    BshObject* object = (BshObject*)calloc(1, sizeof(BshObject));
+    if (!object || !(object->text = (char*)malloc(length + 1))) { perror("bsh: JSON parse"); free(object); return NULL; }
+    memcpy(object->text, json_text, length);
+    object->text[length] = '\0';
+    object->from_json = true;
+    ObjectParser parser = { object->text, object->text, object->text + length, 0, false, "JSON", object, NULL, 0 };
+    json_skip_space(&parser);
+    if (parser.p >= parser.end || (*parser.p != '{' && *parser.p != '[')) { // A scalar document: the text is the value
+        free_bsh_object(object);
+        return NULL;
+    }
+    if (parse_json_container(&parser, object)) {
+        json_skip_space(&parser);
+        if (parser.p < parser.end) object_parser_error(&parser, "Extra characters after the document");
+    }
+    free(parser.index_keys);
+    return object;
+}
+
+void json_skip_space(ObjectParser* parser) {
+    while (parser->p < parser->end && (*parser->p == ' ' || *parser->p == '\n' || *parser->p == '\r' || *parser->p == '\t')) parser->p++;
+}
+
+// Parses the {...} or [...] at the cursor into 'object'.
+bool parse_json_container(ObjectParser* parser, BshObject* object) {
+    bool is_array = *parser->p == '[';
+    char close = is_array ? ']' : '}';
+    if (++parser->depth > MAX_OBJECT_DEPTH) { object_parser_error(parser, "Document nested too deeply"); return false; }
+    parser->p++; // Consume '{' or '['
+    json_skip_space(parser);
+    if (parser->p < parser->end && *parser->p == close) { parser->p++; parser->depth--; return true; }
+
+    for (size_t index = 0; ; index++) {
+        char* key;
+        json_skip_space(parser);
+        if (is_array) {
+            if (!(key = json_index_key(parser, index))) return false;
+        } else {
+            if (!(key = json_read_string(parser))) return false;
+            json_skip_space(parser);
+            if (parser->p >= parser->end || *parser->p != ':') { object_parser_error(parser, "Expected ':' after member name"); return false; }
+            parser->p++;
+            json_skip_space(parser);
+        }
+        if (!parse_json_member(parser, object, key)) return false;
+
+        json_skip_space(parser);
+        if (parser->p < parser->end && *parser->p == ',') { parser->p++; continue; }
+        if (parser->p < parser->end && *parser->p == close) { parser->p++; break; }
+        object_parser_error(parser, is_array ? "Expected ',' or ']'" : "Expected ',' or '}'");
         return false;
     }
-    
+    parser->depth--;
     return true;
 }
 
+// Parses the value at the cursor and stores it under 'key'. A repeated member name
+// replaces the earlier value.
+bool parse_json_member(ObjectParser* parser, BshObject* object, char* key) {
+    BshObjectEntry* entry;
+    char* value = NULL;
+    char c = parser->p < parser->end ? *parser->p : '\0';
+    if (c == '{' || c == '[') {
+        BshObject* child = (BshObject*)calloc(1, sizeof(BshObject));
+        if (!child || !(entry = bsh_object_put(object, key))) { perror("bsh: JSON parse"); free(child); parser->failed = true; return false; }
+        entry->child = child;
+        return parse_json_container(parser, child);
+    } else if (c == '"') {
+        value = json_read_string(parser);
+    } else if (c == '-' || isdigit((unsigned char)c)) {
+        value = json_read_number(parser);
+    } else {
+        static const char* const literals[] = { "true", "false", "null" };
+        for (int i = 0; i < 3 && !value; i++) {
+            size_t literal_len = strlen(literals[i]);
+            if ((size_t)(parser->end - parser->p) >= literal_len && strncmp(parser->p, literals[i], literal_len) == 0) {
+                value = bsh_object_add_text(parser->root, literals[i], literal_len);
+                if (!value) { perror("bsh: JSON parse"); parser->failed = true; return false; }
+                parser->p += literal_len;
+            }
+        }
+        if (!value) object_parser_error(parser, "Expected a value");
+    }
+    if (!value) return false;
+    if (!(entry = bsh_object_put(object, key))) { perror("bsh: JSON parse"); parser->failed = true; return false; }
+    entry->value = value;
+    return true;
+}
+
+// Returns the first byte in [p, end) that ends a plain run inside a JSON string: '"',
+// '\\' or a control character.
+const char* json_scan_string_run(const char* p, const char* end) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(0x1f);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                    _mm_cmpeq_epi8(_mm_max_epu8(chunk, control_max), control_max)); // Unsigned c <= 0x1f
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+    return p;
+}
+
+// Decodes the JSON string at the cursor in place (escapes, including \uXXXX surrogate
+// pairs, become UTF-8, which is never longer than the escape) and returns it.
+char* json_read_string(ObjectParser* parser) {
+    if (parser->p >= parser->end || *parser->p != '"') { object_parser_error(parser, "Expected '\"'"); return NULL; }
+    char* text = parser->p + 1;
+    char* in = (char*)json_scan_string_run(text, parser->end);
+    char* out = in;
+    while (in < parser->end && *in != '"') {
+        if ((unsigned char)*in < 0x20) { parser->p = in; object_parser_error(parser, "Control character in string"); return NULL; }
+        if (*in != '\\') { *out++ = *in++; continue; }
+        if (++in >= parser->end) break;
+        switch (*in++) {
+            case '"':  *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/':  *out++ = '/'; break;
+            case 'b':  *out++ = '\b'; break;
+            case 'f':  *out++ = '\f'; break;
+            case 'n':  *out++ = '\n'; break;
+            case 'r':  *out++ = '\r'; break;
+            case 't':  *out++ = '\t'; break;
+            case 'u': {
+                unsigned long code = 0;
+                for (int pair = 0; pair < 2; pair++) {
+                    unsigned int unit = 0;
+                    for (int i = 0; i < 4; i++, in++) {
+                        int digit = in < parser->end && isxdigit((unsigned char)*in) ? (isdigit((unsigned char)*in) ? *in - '0' : (tolower((unsigned char)*in) - 'a' + 10)) : -1;
+                        if (digit < 0) { parser->p = in; object_parser_error(parser, "Invalid \\u escape"); return NULL; }
+                        unit = unit * 16 + digit;
+                    }
+                    if (pair == 0 && unit >= 0xD800 && unit <= 0xDBFF && parser->end - in >= 6 && in[0] == '\\' && in[1] == 'u') {
+                        code = unit; in += 2; continue; // High surrogate: combine with the next escape
+                    }
+                    if (pair == 1) {
+                        if (unit < 0xDC00 || unit > 0xDFFF) { parser->p = in - 6; object_parser_error(parser, "Unpaired surrogate"); return NULL; }
+                        unit = (unsigned int)(0x10000 + ((code - 0xD800) << 10) + (unit - 0xDC00));
+                    }
+                    code = unit;
+                    break;
+                }
+                // Errors point at the offending \uXXXX escape. A surrogate left over here
+                // had no partner, and has no UTF-8 encoding of its own.
+                if (code >= 0xD800 && code <= 0xDFFF) { parser->p = in - 6; object_parser_error(parser, "Unpaired surrogate"); return NULL; }
+                if (code == 0) { parser->p = in - 6; object_parser_error(parser, "\\u0000 cannot be stored in a bsh string"); return NULL; }
+                if (code < 0x80) {
+                    *out++ = (char)code;
+                } else if (code < 0x800) {
+                    *out++ = (char)(0xC0 | (code >> 6));
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                } else if (code < 0x10000) {
+                    *out++ = (char)(0xE0 | (code >> 12));
+                    *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                } else {
+                    *out++ = (char)(0xF0 | (code >> 18));
+                    *out++ = (char)(0x80 | ((code >> 12) & 0x3F));
+                    *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                }
+                break;
+            }
+            default:
+                parser->p = in - 1;
+                object_parser_error(parser, "Invalid escape");
+                return NULL;
+        }
+        // Copy the next plain run without looking at it byte by byte
+        const char* run_end = json_scan_string_run(in, parser->end);
+        memmove(out, in, run_end - in);
+        out += run_end - in;
+        in = (char*)run_end;
+    }
+    if (in >= parser->end) { object_parser_error(parser, "Unterminated string"); return NULL; }
+    *out = '\0';
+    parser->p = in + 1;
+    return text;
+}
+
+// Validates the number at the cursor (JSON grammar) and returns a copy of its text.
+char* json_read_number(ObjectParser* parser) {
+    const char* start = parser->p;
+    const char* c = start;
+    const char* end = parser->end;
+    if (c < end && *c == '-') c++;
+    if (c < end && *c == '0') c++;
+    else if (c < end && isdigit((unsigned char)*c)) { while (c < end && isdigit((unsigned char)*c)) c++; }
+    else { object_parser_error(parser, "Invalid number"); return NULL; }
+    if (c < end && *c == '.') {
+        if (++c >= end || !isdigit((unsigned char)*c)) { parser->p = (char*)c; object_parser_error(parser, "Digit expected after '.'"); return NULL; }
+        while (c < end && isdigit((unsigned char)*c)) c++;
+    }
+    if (c < end && (*c == 'e' || *c == 'E')) {
+        if (++c < end && (*c == '+' || *c == '-')) c++;
+        if (c >= end || !isdigit((unsigned char)*c)) { parser->p = (char*)c; object_parser_error(parser, "Digit expected in exponent"); return NULL; }
+        while (c < end && isdigit((unsigned char)*c)) c++;
+    }
+    char* value = bsh_object_add_text(parser->root, start, c - start);
+    if (!value) { perror("bsh: JSON parse"); parser->failed = true; return NULL; }
+    parser->p = (char*)c;
+    return value;
+}
+
+// Array keys are made once per document and shared by all its arrays.
+char* json_index_key(ObjectParser* parser, size_t index) {
+    if (index < parser->index_key_count) return parser->index_keys[index];
+    char** keys = (char**)realloc(parser->index_keys, (index + 1) * 2 * sizeof(char*));
+    if (!keys) { perror("bsh: JSON parse"); parser->failed = true; return NULL; }
+    parser->index_keys = keys;
+    for (size_t i = parser->index_key_count; i < (index + 1) * 2; i++) {
+        char digits[24];
+        int len = snprintf(digits, sizeof(digits), "%zu", i);
+        if (!(keys[i] = bsh_object_add_text(parser->root, digits, len))) {
+            parser->index_key_count = i;
+            perror("bsh: JSON parse");
+            parser->failed = true;
+            return NULL;
+        }
+    }
+    parser->index_key_count = (index + 1) * 2;
+    return keys[index];
+}
+
+/// Stringify object
+
+// Appends 'object' as ["key": "value", "key2": [...]] (the format the parser reads) in
+// one pass over the tree.
+bool stringify_bsh_object(const BshObject* object, ObjectWriter* out) {
+    bool ok = object_writer_append(out, "[", 1);
+    for (size_t i = 0; ok && i < object->count; i++) {
+        const BshObjectEntry* entry = &object->entries[i];
+        if (i > 0) ok = object_writer_append(out, ", ", 2);
+        ok = ok && object_writer_append_quoted(out, entry->key) && object_writer_append(out, ": ", 2);
+        if (!ok) break;
+        ok = entry->child ? stringify_bsh_object(entry->child, out)
+                          : object_writer_append_quoted(out, entry->value ? entry->value : "");
+    }
+    return ok && object_writer_append(out, "]", 1);
+}
+
+bool object_writer_append(ObjectWriter* out, const char* data, size_t len) {
+    if (!string_builder_append(&out->buffer, data, len)) return false;
+    return !out->stream || out->buffer.length < OBJECT_WRITER_FLUSH_SIZE || object_writer_flush(out);
+}
+
+// "text" with '"' and '\' backslash-escaped; runs without either are copied whole.
+bool object_writer_append_quoted(ObjectWriter* out, const char* text) {
+    if (!object_writer_append(out, "\"", 1)) return false;
+    for (;;) {
+        size_t run = strcspn(text, "\"\\");
+        if (run > 0 && !object_writer_append(out, text, run)) return false;
+        text += run;
+        if (!*text) break;
+        char escaped[2] = { '\\', *text++ };
+        if (!object_writer_append(out, escaped, 2)) return false;
+    }
+    return object_writer_append(out, "\"", 1);
+}
+
+// Writes out whatever is buffered (a no-op without a stream).
+bool object_writer_flush(ObjectWriter* out) {
+    if (!out->stream || out->buffer.length == 0) return true;
+    size_t written = fwrite(out->buffer.data, 1, out->buffer.length, out->stream);
+    bool ok = written == out->buffer.length;
+    out->buffer.length = 0;
+    if (!ok) perror("bsh: write");
+    return ok;
+}
+
+// Compatibility for the old flattened form: "obj_key_sub" names the value at obj.key.sub
+// and "obj_key_BSH_STRUCT_TYPE" the marker that used to be stored for containers. Tries
+// each '_' as the end of the variable name; 'name' is modified while searching.
+char* find_flattened_object_value(char* name) {
+    for (char* split = strchr(name, '_'); split; split = strchr(split + 1, '_')) {
+        *split = '\0';
+        Variable* base_var = find_variable_scoped(name);
+        *split = '_';
+        if (!base_var || !base_var->object) continue;
+        char* value = resolve_flattened_object_path(base_var->object, split + 1, true);
+        if (value) return value;
+    }
+    return NULL;
+}
+
+// Keys may themselves contain '_', so every key that prefixes 'path' is tried.
+char* resolve_flattened_object_path(const BshObject* object, const char* path, bool is_root) {
+    if (strcmp(path, "BSH_STRUCT_TYPE") == 0) return is_root ? "BSH_OBJECT_ROOT" : "BSH_OBJECT";
+    for (size_t i = 0; i < object->count; i++) {
+        const BshObjectEntry* entry = &object->entries[i];
+        size_t key_len = strlen(entry->key);
+        if (strncmp(path, entry->key, key_len) != 0) continue;
+        if (path[key_len] == '\0' && entry->value) return entry->value;
+        if (path[key_len] == '_' && entry->child) {
+            char* value = resolve_flattened_object_path(entry->child, path + key_len + 1, false);
+            if (value) return value;
+        }
+    }
+    return NULL;
+}
+
 // echo definition moved here for helpers
 
 void handle_echo_advanced(Token *tokens, int num_tokens) {
     if (current_exec_state == STATE_BLOCK_SKIP) return;
 
     char expanded_arg_buffer[INPUT_BUFFER_SIZE]; // Buffer for general argument expansion
-    char object_stringified_buffer[INPUT_BUFFER_SIZE * 2]; // Potentially larger for object stringification
+    ObjectWriter object_out = { .stream = stdout }; // Object values are streamed, with no size limit
 
     for (int i = 1; i < num_tokens; i++) {
         if (tokens[i].type == TOKEN_COMMENT) break;
@@ -2852,22 +6053,15 @@ void handle_echo_advanced(Token *tokens, int num_tokens) {
                     }
                 }
 
-                if (strlen(var_name_raw) > 0) {
-                    char object_type_var_name[MAX_VAR_NAME_LEN + 30];
-                    snprintf(object_type_var_name, sizeof(object_type_var_name), "%s_BSH_STRUCT_TYPE", var_name_raw);
-                    char* struct_type = get_variable_scoped(object_type_var_name);
-
-                    if (struct_type && strcmp(struct_type, "BSH_OBJECT_ROOT") == 0) {
-                        // It's a BSH object, attempt to stringify it
-                        if (stringify_bsh_object_to_string(var_name_raw, object_stringified_buffer, sizeof(object_stringified_buffer))) {
-                            string_to_print = object_stringified_buffer;
-                            is_bsh_object_to_stringify = true;
-                        } else {
-                            // Stringification failed, print an error marker or the raw variable token
-                            snprintf(expanded_arg_buffer, sizeof(expanded_arg_buffer), "[Error stringifying object: %s]", var_name_raw);
-                            string_to_print = expanded_arg_buffer;
-                        }
+                Variable* var = strlen(var_name_raw) > 0 && !strchr(tokens[i].text, '[') ? find_variable_scoped(var_name_raw) : NULL;
+                if (var && var->object) {
+                    // It's a BSH object, stringify its tree straight to stdout
+                    if (object_writer_append(&object_out, OBJECT_STDOUT_PREFIX, strlen(OBJECT_STDOUT_PREFIX))) {
+                        stringify_bsh_object(var->object, &object_out);
                     }
+                    object_writer_flush(&object_out);
+                    string_to_print = "";
+                    is_bsh_object_to_stringify = true;
                 }
             }
         }
@@ -2884,10 +6078,13 @@ void handle_echo_advanced(Token *tokens, int num_tokens) {
             string_to_print = expanded_arg_buffer;
         }
 
-        printf("%s%s", string_to_print,
-               (i == num_tokens - 1 || (i + 1 < num_tokens && tokens[i + 1].type == TOKEN_COMMENT)) ? "" : " ");
+        // Tokens written without space between them (e.g. 'key=value') print as one word.
+        bool ends_word_list = i == num_tokens - 1 || (i + 1 < num_tokens && tokens[i + 1].type == TOKEN_COMMENT);
+        bool joins_next = !ends_word_list && tokens[i + 1].type != TOKEN_EOF && tokens_touch(&tokens[i], &tokens[i + 1]);
+        printf("%s%s", string_to_print, (ends_word_list || joins_next) ? "" : " ");
     }
     printf("\n");
+    string_builder_free(&object_out.buffer);
 }
 
 /////
@@ -2904,6 +6101,11 @@ int enter_scope() {
     scope_stack_top++;
     scope_stack[scope_stack_top].scope_id = (scope_stack_top == 0 && next_scope_id == 1) ? GLOBAL_SCOPE_ID : next_scope_id++;
     if (scope_stack_top == 0) scope_stack[scope_stack_top].scope_id = GLOBAL_SCOPE_ID;
+    scope_stack[scope_stack_top].variables = NULL;
+    scope_stack[scope_stack_top].var_slots = NULL;
+    scope_stack[scope_stack_top].var_slot_capacity = 0;
+    scope_stack[scope_stack_top].var_count = 0;
+    scope_stack[scope_stack_top].record_var_name = NULL;
 
     return scope_stack[scope_stack_top].scope_id;
 }
@@ -2917,6 +6119,10 @@ void leave_scope(int scope_id_to_leave) {
              fprintf(stderr, "Error: Scope mismatch on leave_scope. Trying to leave %d, current top is %d.\n",
                 scope_id_to_leave, scope_stack[scope_stack_top].scope_id );
         }
+        // The popped frame's variables would be unreachable once its slot is reused.
+        if (scope_stack[scope_stack_top].scope_id != GLOBAL_SCOPE_ID) {
+            free_scope_frame_variables(&scope_stack[scope_stack_top]);
+        }
         scope_stack_top--;
         return;
     }
@@ -2926,39 +6132,108 @@ void leave_scope(int scope_id_to_leave) {
     scope_stack_top--;
 }
 
-void cleanup_variables_for_scope(int scope_id) {
-    if (scope_id == GLOBAL_SCOPE_ID) return; 
+ScopeFrame* find_scope_frame(int scope_id) {
+    for (int i = scope_stack_top; i >= 0; i--) {
+        if (scope_stack[i].scope_id == scope_id) return &scope_stack[i];
+    }
+    return NULL;
+}
 
-    Variable *current = variable_list_head;
-    Variable *prev = NULL;
-    while (current != NULL) {
-        if (current->scope_id == scope_id) {
-            Variable *to_delete = current;
-            if (prev == NULL) { 
-                variable_list_head = current->next;
-            } else { 
-                prev->next = current->next;
-            }
-            current = current->next; 
-            if (to_delete->value) free(to_delete->value);
-            free(to_delete);
-        } else {
-            prev = current;
-            current = current->next;
+// FNV-1a; the full hash is kept on the Variable so probes and table growth
+// never have to rehash the name.
+unsigned long hash_variable_name(const char* name) {
+    unsigned long hash = 2166136261UL;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+Variable* find_variable_in_frame(ScopeFrame* frame, const char* name, unsigned long name_hash) {
+    if (!frame || frame->var_slot_capacity == 0) return NULL;
+    size_t mask = frame->var_slot_capacity - 1;
+    size_t slot = name_hash & mask;
+    while (frame->var_slots[slot] != NULL) {
+        Variable* candidate = frame->var_slots[slot];
+        if (candidate->name_hash == name_hash && strcmp(candidate->name, name) == 0) {
+            return candidate;
         }
+        slot = (slot + 1) & mask;
     }
+    return NULL;
 }
 
-void free_all_variables() {
-    Variable *current = variable_list_head;
+// Indexes 'var' in the frame's hash table and links it into the frame's variable list.
+// The table is kept at most half full; variables are only ever removed a whole scope
+// at a time, so no tombstones are needed.
+bool insert_variable_in_frame(ScopeFrame* frame, Variable* var) {
+    if ((frame->var_count + 1) * 2 > frame->var_slot_capacity) {
+        size_t new_capacity = frame->var_slot_capacity ? frame->var_slot_capacity * 2 : VAR_TABLE_INITIAL_CAPACITY;
+        Variable** new_slots = (Variable**)calloc(new_capacity, sizeof(Variable*));
+        if (!new_slots) { perror("calloc for variable table failed"); return false; }
+        for (size_t i = 0; i < frame->var_slot_capacity; i++) {
+            Variable* moved = frame->var_slots[i];
+            if (!moved) continue;
+            size_t slot = moved->name_hash & (new_capacity - 1);
+            while (new_slots[slot] != NULL) slot = (slot + 1) & (new_capacity - 1);
+            new_slots[slot] = moved;
+        }
+        free(frame->var_slots);
+        frame->var_slots = new_slots;
+        frame->var_slot_capacity = new_capacity;
+    }
+
+    size_t mask = frame->var_slot_capacity - 1;
+    size_t slot = var->name_hash & mask;
+    while (frame->var_slots[slot] != NULL) slot = (slot + 1) & mask;
+    frame->var_slots[slot] = var;
+    frame->var_count++;
+
+    var->next = frame->variables;
+    frame->variables = var;
+    return true;
+}
+
+void free_scope_frame_variables(ScopeFrame* frame) {
+    Variable *current = frame->variables;
     Variable *next_var;
     while (current != NULL) {
         next_var = current->next;
-        if (current->value) free(current->value);
+        if (current->value != current->inline_value) free(current->value);
+        free_array(current->array);
+        free_bsh_object(current->object);
+        release_variable_name(current->name);
         free(current);
         current = next_var;
     }
-    variable_list_head = NULL;
+    free(frame->var_slots);
+    frame->variables = NULL;
+    frame->var_slots = NULL;
+    frame->var_slot_capacity = 0;
+    frame->var_count = 0;
+}
+
+void cleanup_variables_for_scope(int scope_id) {
+    if (scope_id == GLOBAL_SCOPE_ID) return; 
+
+    ScopeFrame* frame = find_scope_frame(scope_id);
+    if (frame) free_scope_frame_variables(frame);
+}
+
+void free_all_variables() {
+    for (int i = scope_stack_top; i >= 0; i--) {
+        free_scope_frame_variables(&scope_stack[i]);
+    }
+    free_interned_names(); // No variable points at them any more
+}
+
+void free_interned_names() {
+    for (size_t i = 0; i < interned_name_capacity; i++) free(interned_names[i]);
+    free(interned_names);
+    interned_names = NULL;
+    interned_name_capacity = 0;
+    interned_name_count = 0;
 }
 
 char* get_variable_scoped(const char *name_raw) {
@@ -2967,17 +6242,35 @@ char* get_variable_scoped(const char *name_raw) {
     trim_whitespace(clean_name);
     if (strlen(clean_name) == 0) return NULL;
 
+    Variable *found = find_variable_scoped(clean_name);
+    if (found) return found->value;
+
+    // Compatibility: "name_ARRAYIDX_i" still reads element i of a native array, and
+    // flattened names like "obj_key_sub" read inside object trees.
+    char *mangle = NULL;
+    for (char *next = strstr(clean_name, "_ARRAYIDX_"); next; next = strstr(next + 1, "_ARRAYIDX_")) mangle = next;
+    if (!mangle) return find_flattened_object_value(clean_name);
+    *mangle = '\0';
+    BshArray *array = find_array_scoped(clean_name);
+    return array ? array_element_at(array, mangle + strlen("_ARRAYIDX_")) : NULL;
+}
+
+// Innermost visible variable called 'name' (already trimmed).
+Variable* find_variable_scoped(const char *name) {
+    unsigned long name_hash = hash_variable_name(name);
     for (int i = scope_stack_top; i >= 0; i--) {
-        int current_search_scope_id = scope_stack[i].scope_id;
-        Variable *current_node = variable_list_head;
-        while (current_node != NULL) {
-            if (current_node->scope_id == current_search_scope_id && strcmp(current_node->name, clean_name) == 0) {
-                return current_node->value; 
-            }
-            current_node = current_node->next;
-        }
+        Variable *found = find_variable_in_frame(&scope_stack[i], name, name_hash);
+        if (found) return found;
     }
-    return NULL; 
+    return NULL;
+}
+
+// The frame that assigning 'name' writes to: the innermost one, except that a
+// foreach_record scope only takes its own record variable.
+ScopeFrame* assignment_frame(const char *name) {
+    int i = scope_stack_top;
+    while (i > 0 && scope_stack[i].record_var_name && strcmp(scope_stack[i].record_var_name, name) != 0) i--;
+    return &scope_stack[i];
 }
 
 void set_variable_scoped(const char *name_raw, const char *value_to_set, bool is_array_elem) {
@@ -2985,34 +6278,137 @@ void set_variable_scoped(const char *name_raw, const char *value_to_set, bool is
         fprintf(stderr, "Critical Error: No active scope to set variable '%s'. Shell not initialized?\n", name_raw);
         return;
     }
-    int current_scope_id = scope_stack[scope_stack_top].scope_id;
 
     char clean_name[MAX_VAR_NAME_LEN];
     strncpy(clean_name, name_raw, MAX_VAR_NAME_LEN -1); clean_name[MAX_VAR_NAME_LEN-1] = '\0';
     trim_whitespace(clean_name);
     if (strlen(clean_name) == 0) { fprintf(stderr, "Error: Cannot set variable with empty name.\n"); return; }
-
-    Variable *current_node = variable_list_head;
-    while (current_node != NULL) {
-        if (current_node->scope_id == current_scope_id && strcmp(current_node->name, clean_name) == 0) {
-            if (current_node->value) free(current_node->value); 
-            current_node->value = strdup(value_to_set);
-            if (!current_node->value) { perror("strdup failed for variable value update"); current_node->value = strdup("");  }
-            current_node->is_array_element = is_array_elem;
-            return;
-        }
-        current_node = current_node->next;
+    ScopeFrame* current_frame = assignment_frame(clean_name);
+
+    unsigned long name_hash = hash_variable_name(clean_name);
+    Variable *current_node = find_variable_in_frame(current_frame, clean_name, name_hash);
+    if (current_node) {
+        free_array(current_node->array); // A scalar assignment replaces an array or object
+        current_node->array = NULL;
+        free_bsh_object(current_node->object);
+        current_node->object = NULL;
+        set_variable_value(current_node, value_to_set); // Keeps the old value if out of memory
+        current_node->is_array_element = is_array_elem;
+        if (current_frame == &scope_stack[0] && strcmp(current_node->name, "PATH") == 0) export_path_variable(current_node->value);
+        return;
     }
 
     Variable *new_var = (Variable*)malloc(sizeof(Variable));
     if (!new_var) { perror("malloc for new variable failed"); return; }
-    strncpy(new_var->name, clean_name, MAX_VAR_NAME_LEN - 1); new_var->name[MAX_VAR_NAME_LEN - 1] = '\0';
-    new_var->value = strdup(value_to_set);
-    if (!new_var->value) { perror("strdup failed for new variable value"); free(new_var); new_var = NULL;  return; }
+    new_var->name = intern_variable_name(clean_name, name_hash);
+    new_var->value = new_var->inline_value;
+    new_var->value_capacity = VAR_INLINE_VALUE_SIZE;
+    if (!new_var->name || !set_variable_value(new_var, value_to_set)) {
+        if (new_var->name) release_variable_name(new_var->name);
+        free(new_var);
+        return;
+    }
+    new_var->array = NULL;
+    new_var->object = NULL;
     new_var->is_array_element = is_array_elem;
-    new_var->scope_id = current_scope_id;
-    new_var->next = variable_list_head; 
-    variable_list_head = new_var;
+    new_var->scope_id = current_frame->scope_id;
+    new_var->name_hash = name_hash;
+    if (!insert_variable_in_frame(current_frame, new_var)) {
+        if (new_var->value != new_var->inline_value) free(new_var->value);
+        release_variable_name(new_var->name);
+        free(new_var);
+        return;
+    }
+    if (current_frame == &scope_stack[0] && strcmp(new_var->name, "PATH") == 0) export_path_variable(new_var->value);
+}
+
+// A global $PATH assignment becomes the PATH that commands are looked up in and that
+// child processes inherit.
+void export_path_variable(const char *value) {
+    if (setenv("PATH", value, 1) != 0) { perror("bsh: setenv PATH failed"); return; }
+    build_path_list();
+}
+
+// Copies 'value' into the variable's buffer, in place when it fits ('value' may point
+// into that buffer). A larger heap buffer is allocated otherwise, at least doubling so a
+// value grown by repeated appends is not reallocated each time. On failure the old
+// value is left as it was.
+bool set_variable_value(Variable* var, const char* value) {
+    size_t size = strlen(value) + 1;
+    if (size <= var->value_capacity) {
+        memmove(var->value, value, size);
+        return true;
+    }
+    size_t capacity = var->value_capacity * 2 > size ? var->value_capacity * 2 : size;
+    char *grown = (char*)malloc(capacity);
+    if (!grown) { perror("malloc for variable value failed"); return false; }
+    memcpy(grown, value, size);
+    if (var->value != var->inline_value) free(var->value);
+    var->value = grown;
+    var->value_capacity = capacity;
+    return true;
+}
+
+// Shared copy of 'name' (see InternedName), added on first use. Each call takes a
+// reference, dropped with release_variable_name.
+const char* intern_variable_name(const char* name, unsigned long name_hash) {
+    size_t mask = interned_name_capacity - 1;
+    for (size_t slot = name_hash & mask; interned_name_capacity && interned_names[slot]; slot = (slot + 1) & mask) {
+        if (interned_names[slot]->hash == name_hash && strcmp(interned_names[slot]->text, name) == 0) {
+            interned_names[slot]->ref_count++;
+            return interned_names[slot]->text;
+        }
+    }
+
+    if ((interned_name_count + 1) * 2 > interned_name_capacity) {
+        size_t new_capacity = interned_name_capacity ? interned_name_capacity * 2 : VAR_TABLE_INITIAL_CAPACITY;
+        InternedName** new_slots = (InternedName**)calloc(new_capacity, sizeof(InternedName*));
+        if (!new_slots) { perror("calloc for variable name table failed"); return NULL; }
+        for (size_t i = 0; i < interned_name_capacity; i++) {
+            InternedName* moved = interned_names[i];
+            if (!moved) continue;
+            size_t slot = moved->hash & (new_capacity - 1);
+            while (new_slots[slot] != NULL) slot = (slot + 1) & (new_capacity - 1);
+            new_slots[slot] = moved;
+        }
+        free(interned_names);
+        interned_names = new_slots;
+        interned_name_capacity = new_capacity;
+        mask = new_capacity - 1;
+    }
+
+    size_t length = strlen(name);
+    InternedName* interned = (InternedName*)malloc(sizeof(InternedName) + length + 1);
+    if (!interned) { perror("malloc for variable name failed"); return NULL; }
+    interned->hash = name_hash;
+    interned->ref_count = 1;
+    memcpy(interned->text, name, length + 1);
+    size_t slot = name_hash & mask;
+    while (interned_names[slot] != NULL) slot = (slot + 1) & mask;
+    interned_names[slot] = interned;
+    interned_name_count++;
+    return interned->text;
+}
+
+// Drops a reference taken by intern_variable_name. The last one removes the name,
+// shifting later entries of its probe run back so lookups need no tombstones.
+void release_variable_name(const char* name) {
+    InternedName* interned = (InternedName*)(name - offsetof(InternedName, text));
+    if (--interned->ref_count > 0) return;
+    size_t mask = interned_name_capacity - 1;
+    size_t hole = interned->hash & mask;
+    while (interned_names[hole] != interned) hole = (hole + 1) & mask;
+    for (size_t slot = (hole + 1) & mask; interned_names[slot]; slot = (slot + 1) & mask) {
+        size_t home = interned_names[slot]->hash & mask;
+        // Move the entry unless its home lies cyclically in (hole, slot]
+        if (hole <= slot ? (home <= hole || home > slot) : (home <= hole && home > slot)) {
+            interned_names[hole] = interned_names[slot];
+            hole = slot;
+        }
+    }
+    interned_names[hole] = NULL;
+    interned_name_count--;
+    free(interned);
 }
 
 void expand_variables_in_string_advanced(const char *input_str, char *expanded_str, size_t expanded_str_size) {
@@ -3029,6 +6425,11 @@ void expand_variables_in_string_advanced(const char *input_str, char *expanded_s
             char segment_buffer[MAX_VAR_NAME_LEN]; // For individual segment (base var or property name)
             char* pv = segment_buffer;
             bool first_segment = true;
+            char* value_to_insert = NULL;
+            bool is_element_reference = false;
+            // Dot access on an object variable walks its tree alongside the mangled name
+            BshObject* object_cursor = NULL;
+            bool is_object_reference = false;
 
             do { // Loop for base variable and subsequent dot-separated properties
                 pv = segment_buffer; // Reset for current segment
@@ -3057,7 +6458,27 @@ void expand_variables_in_string_advanced(const char *input_str, char *expanded_s
                     }
                     strncpy(current_mangled_name, segment_buffer, sizeof(current_mangled_name) - 1);
                     first_segment = false;
+                    Variable* base_var = find_variable_scoped(segment_buffer);
+                    object_cursor = base_var ? base_var->object : NULL;
+
+                    // $arr[index]: the index is expanded like on assignment
+                    if (*p_in == '[') {
+                        const char *index_start = ++p_in;
+                        int bracket_depth = 1;
+                        while (*p_in && (*p_in != ']' || --bracket_depth > 0)) {
+                            if (*p_in == '[') bracket_depth++;
+                            p_in++;
+                        }
+                        char index_raw[INPUT_BUFFER_SIZE], index_expanded[INPUT_BUFFER_SIZE];
+                        snprintf(index_raw, sizeof(index_raw), "%.*s", (int)(p_in - index_start), index_start);
+                        if (*p_in == ']') p_in++;
+                        expand_array_index(index_raw, index_expanded, sizeof(index_expanded));
+                        value_to_insert = get_array_element_scoped(current_mangled_name, index_expanded);
+                        is_element_reference = true;
+                        break;
+                    }
                 } else { // Parsing a property name after a dot
+                    const char* dot_position = p_in++; // Consume '.'
                     if (*p_in == '$') { // Dynamic property: .$dynamicProp
                         p_in++; // Consume '$' for the dynamic part
                         char dynamic_prop_source_var_name[MAX_VAR_NAME_LEN];
@@ -3088,7 +6509,12 @@ void expand_variables_in_string_advanced(const char *input_str, char *expanded_s
                         *pv = '\0';
                     }
 
-                    if (strlen(segment_buffer) > 0) {
+                    if (strlen(segment_buffer) > 0 && (object_cursor || is_object_reference)) {
+                        BshObjectEntry* entry = object_cursor ? bsh_object_find(object_cursor, segment_buffer) : NULL;
+                        value_to_insert = entry ? entry->value : NULL;
+                        object_cursor = entry ? entry->child : NULL;
+                        is_object_reference = true;
+                    } else if (strlen(segment_buffer) > 0) {
                         if (strlen(current_mangled_name) + 1 + strlen(segment_buffer) < sizeof(current_mangled_name)) {
                             strcat(current_mangled_name, "_");
                             strcat(current_mangled_name, segment_buffer);
@@ -3098,13 +6524,14 @@ void expand_variables_in_string_advanced(const char *input_str, char *expanded_s
                     } else {
                         // Invalid or empty property segment, chain broken.
                         // The value of current_mangled_name up to this point will be sought.
+                        p_in = dot_position; // e.g. "Hello $name." keeps its '.'
                         break; // Exit dot processing loop
                     }
                 }
             } while (*p_in == '.'); // Check for next dot only if a valid segment was parsed
             // End of loop for base var and subsequent dot-separated properties
 
-            char* value_to_insert = get_variable_scoped(current_mangled_name);
+            if (!is_element_reference && !is_object_reference) value_to_insert = get_variable_scoped(current_mangled_name);
             if (value_to_insert) {
                 size_t val_len = strlen(value_to_insert);
                 if (val_len <= remaining_size) { // Check if it fits
@@ -3130,31 +6557,135 @@ void expand_variables_in_string_advanced(const char *input_str, char *expanded_s
     *p_out = '\0'; // Null-terminate the expanded string
 }
 
+// Numeric indexes (already expanded) address the native array 'array_base_name';
+// any other key, or an element stored sparsely, is a "name_ARRAYIDX_key" variable.
 char* get_array_element_scoped(const char* array_base_name, const char* index_str_raw_param) {
+    size_t index;
+    if (parse_array_index(index_str_raw_param, &index)) {
+        BshArray *array = find_array_scoped(array_base_name);
+        if (array && index < array->length && array->items[index]) return array->items[index];
+    }
     char mangled_name[MAX_VAR_NAME_LEN * 2]; 
     snprintf(mangled_name, sizeof(mangled_name), "%s_ARRAYIDX_%s", array_base_name, index_str_raw_param);
     return get_variable_scoped(mangled_name);
 }
 
 void set_array_element_scoped(const char* array_base_name, const char* index_str_raw_param, const char* value) {
+    char expanded_index_val[INPUT_BUFFER_SIZE];
+    expand_array_index(index_str_raw_param, expanded_index_val, sizeof(expanded_index_val));
+
+    size_t index;
+    BshArray *existing = find_array_scoped(array_base_name);
+    if (parse_array_index(expanded_index_val, &index) && array_index_is_dense(existing, index)) {
+        BshArray *array = existing ? existing : get_or_create_array_scoped(array_base_name);
+        if (array && !array_set(array, index, value)) {
+            fprintf(stderr, "Error: cannot store element %zu of array '%s'.\n", index, array_base_name);
+        }
+        return;
+    }
+    char mangled_name[MAX_VAR_NAME_LEN * 2];
+    snprintf(mangled_name, sizeof(mangled_name), "%s_ARRAYIDX_%s", array_base_name, expanded_index_val);
+    set_variable_scoped(mangled_name, value, true); 
+}
+
+// Expands the text between '[' and ']': a quoted string or $variable is expanded,
+// anything else is taken literally.
+void expand_array_index(const char *index_str_raw_param, char *expanded_index, size_t expanded_index_size) {
     char index_str_raw[INPUT_BUFFER_SIZE];
     strncpy(index_str_raw, index_str_raw_param, sizeof(index_str_raw) -1);
     index_str_raw[sizeof(index_str_raw)-1] = '\0';
 
-    char expanded_index_val[INPUT_BUFFER_SIZE];
     if (index_str_raw[0] == '"' && index_str_raw[strlen(index_str_raw)-1] == '"') {
         char unescaped_idx[INPUT_BUFFER_SIZE];
         unescape_string(index_str_raw, unescaped_idx, sizeof(unescaped_idx));
-        expand_variables_in_string_advanced(unescaped_idx, expanded_index_val, sizeof(expanded_index_val));
+        expand_variables_in_string_advanced(unescaped_idx, expanded_index, expanded_index_size);
     } else if (index_str_raw[0] == '$') {
-        expand_variables_in_string_advanced(index_str_raw, expanded_index_val, sizeof(expanded_index_val));
+        expand_variables_in_string_advanced(index_str_raw, expanded_index, expanded_index_size);
     } else { 
-        strncpy(expanded_index_val, index_str_raw, sizeof(expanded_index_val)-1);
-        expanded_index_val[sizeof(expanded_index_val)-1] = '\0';
+        strncpy(expanded_index, index_str_raw, expanded_index_size - 1);
+        expanded_index[expanded_index_size - 1] = '\0';
     }
-    char mangled_name[MAX_VAR_NAME_LEN * 2];
-    snprintf(mangled_name, sizeof(mangled_name), "%s_ARRAYIDX_%s", array_base_name, expanded_index_val);
-    set_variable_scoped(mangled_name, value, true); 
+}
+
+// True for a canonical decimal index ("0", "42"); such keys live in native arrays.
+// "007" or "+7" stay distinct string keys rather than aliasing element 7.
+bool parse_array_index(const char *text, size_t *index) {
+    if (!isdigit((unsigned char)text[0]) || (text[0] == '0' && text[1] != '\0')) return false;
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (*end != '\0' || errno == ERANGE || value > SIZE_MAX / sizeof(char*)) return false;
+    *index = (size_t)value;
+    return true;
+}
+
+BshArray* find_array_scoped(const char *name) {
+    Variable *var = find_variable_scoped(name);
+    return var ? var->array : NULL;
+}
+
+// The visible array 'name', so element writes inside a function update the caller's
+// array; otherwise a new array in the current scope (replacing a scalar there).
+BshArray* get_or_create_array_scoped(const char *name) {
+    Variable *var = find_variable_scoped(name);
+    if (var && var->array) return var->array;
+    set_variable_scoped(name, "", false); // Creates it in this scope, or clears a scalar here
+    var = find_variable_in_frame(assignment_frame(name), name, hash_variable_name(name));
+    if (!var) return NULL;
+    var->array = (BshArray*)calloc(1, sizeof(BshArray));
+    if (!var->array) perror("calloc for array failed");
+    return var->array;
+}
+
+char* array_element_at(BshArray *array, const char *index_str) {
+    size_t index;
+    if (!parse_array_index(index_str, &index) || index >= array->length) return NULL;
+    return array->items[index];
+}
+
+// Grows capacity geometrically; new slots are NULL.
+bool array_reserve(BshArray *array, size_t min_capacity) {
+    if (min_capacity <= array->capacity) return true;
+    size_t new_capacity = array->capacity ? array->capacity : 8;
+    while (new_capacity < min_capacity) {
+        if (new_capacity > SIZE_MAX / (2 * sizeof(char*))) { new_capacity = min_capacity; break; }
+        new_capacity *= 2;
+    }
+    char **new_items = (char**)realloc(array->items, new_capacity * sizeof(char*));
+    if (!new_items) return false;
+    memset(new_items + array->capacity, 0, (new_capacity - array->capacity) * sizeof(char*));
+    array->items = new_items;
+    array->capacity = new_capacity;
+    return true;
+}
+
+// True if 'index' may be stored in 'array' (NULL: not created yet): an existing slot,
+// or a bounded step past the end.
+bool array_index_is_dense(const BshArray *array, size_t index) {
+    return index <= (array ? array->length : 0) + ARRAY_MAX_DENSE_GAP;
+}
+
+// Stores a copy of 'value' at 'index'; indexes past the end extend the array, leaving
+// any skipped slots unset. Callers check array_index_is_dense first.
+bool array_set(BshArray *array, size_t index, const char *value) {
+    if (index == SIZE_MAX || !array_reserve(array, index + 1)) return false;
+    char *copy = strdup(value);
+    if (!copy) return false;
+    free(array->items[index]);
+    array->items[index] = copy;
+    if (index >= array->length) array->length = index + 1;
+    return true;
+}
+
+bool array_push(BshArray *array, const char *value) {
+    return array_set(array, array->length, value);
+}
+
+void free_array(BshArray *array) {
+    if (!array) return;
+    for (size_t i = 0; i < array->length; i++) free(array->items[i]);
+    free(array->items);
+    free(array);
 }
 
 
@@ -3169,6 +6700,32 @@ bool find_command_in_path_dynamic(const char *command, char *full_path) {
         }
         return false;
     }
+
+    CommandCacheEntry **bucket = &command_cache[hash_variable_name(command) & (COMMAND_CACHE_SIZE - 1)];
+    for (CommandCacheEntry *entry = *bucket; entry; entry = entry->next) {
+        if (strcmp(entry->name, command) != 0) continue;
+        if (!entry->full_path) return false;
+        strncpy(full_path, entry->full_path, MAX_FULL_PATH_LEN - 1); full_path[MAX_FULL_PATH_LEN - 1] = '\0';
+        return true;
+    }
+
+    bool found = search_path_list(command, full_path);
+    if (!found && command_cache_miss_count >= COMMAND_CACHE_MAX_MISSES) return false; // Search again next time
+    CommandCacheEntry *entry = (CommandCacheEntry*)malloc(sizeof(CommandCacheEntry));
+    if (entry && (entry->name = strdup(command)) != NULL) {
+        entry->full_path = found ? strdup(full_path) : NULL;
+        if (found && !entry->full_path) { free(entry->name); free(entry); return found; } // Just don't cache it
+        if (!found) command_cache_miss_count++;
+        entry->next = *bucket;
+        *bucket = entry;
+    } else {
+        free(entry);
+    }
+    return found;
+}
+
+// Uncached search of the PATH directories, in order.
+bool search_path_list(const char *command, char *full_path) {
     PathDirNode *current_path_node = path_list_head;
     while (current_path_node) {
         snprintf(full_path, MAX_FULL_PATH_LEN, "%s/%s", current_path_node->path, command);
@@ -3228,34 +6785,485 @@ bool find_module_in_path(const char* module_spec, char* result_full_path) {
 ///
 ///
 
+// Starts 'command_path' with stdin from 'input_fd' and stdout (plus stderr if
+// 'merge_stderr') on 'output_fd'; -1 inherits the shell's. Pipe fds must be O_CLOEXEC
+// so that children never hold other ends open. $BSH_LAUNCHER picks the method:
+// "spawn" (default) uses posix_spawn, which glibc runs via clone(CLONE_VM|CLONE_VFORK)
+// so the shell's page tables are never copied; "fork" is the classic fork + execv.
+// Returns the child's pid or -1.
+pid_t launch_external_command(char *command_path, char **args, int input_fd, int output_fd, bool merge_stderr) {
+    const char *launcher = get_variable_scoped("BSH_LAUNCHER");
+    if (launcher && strcmp(launcher, "fork") == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (input_fd >= 0) dup2(input_fd, STDIN_FILENO);
+            if (output_fd >= 0) { dup2(output_fd, STDOUT_FILENO); if (merge_stderr) dup2(output_fd, STDERR_FILENO); }
+            execv(command_path, args);
+            perror("execv failed"); exit(EXIT_FAILURE);
+        }
+        if (pid < 0) perror("fork failed");
+        return pid;
+    }
+
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) { perror("posix_spawn_file_actions_init failed"); return -1; }
+    if (input_fd >= 0) posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+    if (output_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+        if (merge_stderr) posix_spawn_file_actions_adddup2(&actions, output_fd, STDERR_FILENO);
+    }
+    pid_t pid;
+    int spawn_error = posix_spawn(&pid, command_path, &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (spawn_error != 0) {
+        fprintf(stderr, "posix_spawn failed for '%s': %s\n", command_path, strerror(spawn_error));
+        return -1;
+    }
+    return pid;
+}
+
 int execute_external_command(char *command_path, char **args, int arg_count, char *output_buffer, size_t output_buffer_size) {
-    pid_t pid; int status; int pipefd[2] = {-1, -1};
-    if (output_buffer) { if (pipe(pipefd) == -1) { perror("pipe failed for cmd output"); return -1; } }
-    pid = fork();
-    if (pid == 0) { 
-        if (output_buffer) { close(pipefd[0]); dup2(pipefd[1], STDOUT_FILENO); dup2(pipefd[1], STDERR_FILENO); close(pipefd[1]); }
-        execv(command_path, args);
-        perror("execv failed"); exit(EXIT_FAILURE);
-    } else if (pid < 0) { 
-        perror("fork failed"); if (output_buffer) { close(pipefd[0]); close(pipefd[1]); } return -1;
-    } else { 
-        if (output_buffer) {
-            close(pipefd[1]); ssize_t bytes_read; size_t total_bytes_read = 0;
-            char read_buf[INPUT_BUFFER_SIZE]; output_buffer[0] = '\0';
-            while((bytes_read = read(pipefd[0], read_buf, sizeof(read_buf)-1)) > 0) {
-                if (total_bytes_read + bytes_read < output_buffer_size) {
-                    read_buf[bytes_read] = '\0'; strcat(output_buffer, read_buf); total_bytes_read += bytes_read;
-                } else { strncat(output_buffer, read_buf, output_buffer_size - total_bytes_read -1); break; }
-            } close(pipefd[0]);
-            char* nl = strrchr(output_buffer, '\n');
-            while(nl && (nl == output_buffer + strlen(output_buffer) -1)) { *nl = '\0'; nl = strrchr(output_buffer, '\n');}
+    if (output_buffer) { // Fixed-size result: capture everything, then keep what fits
+        StringBuilder captured = {0};
+        int status = capture_external_command(command_path, args, &captured);
+        size_t copy_len = captured.length < output_buffer_size - 1 ? captured.length : output_buffer_size - 1;
+        if (captured.data) memcpy(output_buffer, captured.data, copy_len);
+        output_buffer[copy_len] = '\0';
+        string_builder_free(&captured);
+        return status;
+    }
+    pid_t pid = launch_external_command(command_path, args, -1, -1, false);
+    if (pid < 0) return -1;
+    return wait_for_external_command(pid);
+}
+
+// Runs the command with stdout and stderr appended to 'output' in full; trailing
+// newlines are dropped. Returns the exit status, or -1 if it could not be started.
+int capture_external_command(char *command_path, char **args, StringBuilder *output) {
+    int pipefd[2];
+    if (!open_cloexec_pipe(pipefd)) { perror("pipe failed for cmd output"); return -1; }
+    pid_t pid = launch_external_command(command_path, args, -1, pipefd[1], true);
+    close(pipefd[1]);
+    if (pid < 0) { close(pipefd[0]); return -1; }
+
+    char read_buf[INPUT_BUFFER_SIZE * 4];
+    ssize_t bytes_read;
+    bool capturing = true;
+    while ((bytes_read = read(pipefd[0], read_buf, sizeof(read_buf))) != 0) {
+        if (bytes_read < 0) { if (errno == EINTR) continue; break; }
+        if (capturing && !string_builder_append(output, read_buf, (size_t)bytes_read)) {
+            capturing = false; // Out of memory: keep draining so the child can finish
+        }
+    }
+    close(pipefd[0]);
+    while (output->length > 0 && output->data[output->length - 1] == '\n') output->data[--output->length] = '\0';
+    return wait_for_external_command(pid);
+}
+
+// pipe() with both ends FD_CLOEXEC, so launched children only keep the ends they dup2.
+bool open_cloexec_pipe(int pipefd[2]) {
+    if (pipe(pipefd) == -1) return false;
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+int exit_code_from_wait_status(int status) {
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// Waits for the child and records its exit status in $LAST_COMMAND_STATUS; a child
+// killed by a signal (e.g. SIGPIPE in a pipeline) reports 128 + the signal number.
+int wait_for_external_command(pid_t pid) {
+    int status;
+    do { waitpid(pid, &status, WUNTRACED); } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    int exit_code = exit_code_from_wait_status(status);
+    char status_str[12]; snprintf(status_str, sizeof(status_str), "%d", exit_code);
+    set_variable_scoped("LAST_COMMAND_STATUS", status_str, false);
+    return exit_code;
+}
+
+// cmd1 | cmd2 | ...: stages are external commands, function calls or builtins (the
+// latter two run in a forked copy of the shell, so they cannot change its variables).
+// All stages are started before any is waited for, each stdout feeding the next stdin
+// (stderr is inherited).
+// Exit statuses go to $PIPESTATUS[0..n-1] and $PIPESTATUS_COUNT; $LAST_COMMAND_STATUS
+// is the last stage's.
+void execute_pipeline(Token *tokens, int num_tokens) {
+    if (current_exec_state == STATE_BLOCK_SKIP) return;
+    pid_t pids[MAX_PIPELINE_STAGES];
+    int stage_count = start_pipeline(tokens, num_tokens, pids);
+    if (stage_count < 0) return;
+
+    int exit_code = 0;
+    char index_str[12], status_str[12];
+    for (int s = 0; s < stage_count; s++) {
+        exit_code = pids[s] >= 0 ? wait_for_external_command(pids[s]) : 127;
+        snprintf(index_str, sizeof(index_str), "%d", s);
+        snprintf(status_str, sizeof(status_str), "%d", exit_code);
+        set_array_element_scoped("PIPESTATUS", index_str, status_str);
+    }
+    snprintf(status_str, sizeof(status_str), "%d", stage_count);
+    set_variable_scoped("PIPESTATUS_COUNT", status_str, false);
+    snprintf(status_str, sizeof(status_str), "%d", exit_code);
+    set_variable_scoped("LAST_COMMAND_STATUS", status_str, false);
+}
+
+// Launches every stage of 'cmd1 | cmd2 | ...' (a single command is a one-stage
+// pipeline) without waiting. Fills 'pids' (MAX_PIPELINE_STAGES slots, -1 for a stage
+// that failed to start) and returns the stage count, or -1 if nothing was started.
+int start_pipeline(Token *tokens, int num_tokens, pid_t *pids) {
+    while (num_tokens > 0 && (tokens[num_tokens - 1].type == TOKEN_EOF || tokens[num_tokens - 1].type == TOKEN_COMMENT)) num_tokens--;
+
+    int stage_start[MAX_PIPELINE_STAGES], stage_len[MAX_PIPELINE_STAGES];
+    char stage_path[MAX_PIPELINE_STAGES][MAX_FULL_PATH_LEN];
+    bool stage_in_shell[MAX_PIPELINE_STAGES];
+    int stage_count = 0;
+    for (int i = 0, start = 0; i <= num_tokens; i++) {
+        if (i < num_tokens && tokens[i].type != TOKEN_PIPE) continue;
+        if (stage_count == MAX_PIPELINE_STAGES) {
+            fprintf(stderr, "bsh: pipeline has more than %d stages\n", MAX_PIPELINE_STAGES); return -1;
+        }
+        if (i == start || tokens[start].type != TOKEN_WORD) {
+            fprintf(stderr, "bsh: pipeline stage %d must start with a command name\n", stage_count + 1); return -1;
+        }
+        if (word_starts_block_statement(tokens[start].text)) {
+            fprintf(stderr, "bsh: pipeline: '%s' cannot be a pipeline stage\n", tokens[start].text); return -1;
+        }
+        KeywordEntry *keyword = find_keyword_entry(tokens[start].text);
+        stage_in_shell[stage_count] = (keyword && keyword->builtin) || find_user_function(tokens[start].text);
+        if (!stage_in_shell[stage_count] && !find_command_in_path_dynamic(tokens[start].text, stage_path[stage_count])) {
+            fprintf(stderr, "bsh: pipeline: command not found: %s\n", tokens[start].text);
+            set_variable_scoped("LAST_COMMAND_STATUS", "127", false);
+            return -1;
         }
-        do { waitpid(pid, &status, WUNTRACED); } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-        char status_str[12]; snprintf(status_str, sizeof(status_str), "%d", WEXITSTATUS(status));
-        set_variable_scoped("LAST_COMMAND_STATUS", status_str, false);
-        return WEXITSTATUS(status);
+        stage_start[stage_count] = start;
+        stage_len[stage_count] = i - start;
+        stage_count++;
+        start = i + 1;
+    }
+
+    int input_fd = -1;
+    for (int s = 0; s < stage_count; s++) {
+        int pipefd[2] = {-1, -1};
+        if (s < stage_count - 1 && !open_cloexec_pipe(pipefd)) perror("pipe failed for pipeline");
+        if (stage_in_shell[s]) {
+            pids[s] = launch_shell_stage(&tokens[stage_start[s]], stage_len[s], input_fd, pipefd[1], pipefd[0]);
+        } else {
+            char *args[MAX_ARGS + 1];
+            int arg_count = build_command_argv(&tokens[stage_start[s]], stage_len[s], args);
+            pids[s] = launch_external_command(stage_path[s], args, input_fd, pipefd[1], false);
+            free_command_argv(args, arg_count);
+        }
+        if (input_fd >= 0) close(input_fd);
+        if (pipefd[1] >= 0) close(pipefd[1]);
+        input_fd = pipefd[0]; // A stage that failed to start leaves the next one reading EOF
+    }
+    if (input_fd >= 0) close(input_fd);
+    return stage_count;
+}
+
+// True for if/else/while/foreach_record (and their aliases), and for aliases that do not
+// name a builtin: lines starting with these are statements, never commands.
+bool word_starts_block_statement(const char *word) {
+    KeywordEntry *keyword = find_keyword_entry(word);
+    return keyword && (!keyword->builtin || keyword->builtin->block_handler);
+}
+
+// Runs a function-call or builtin pipeline stage in a forked copy of the shell that
+// reads 'input_fd' and writes 'output_fd' (-1: inherited). 'unused_fd' (the read end
+// of its own output pipe) is closed in the child, or it would never get SIGPIPE.
+pid_t launch_shell_stage(Token *tokens, int num_tokens, int input_fd, int output_fd, int unused_fd) {
+    pid_t pid = fork_shell_child();
+    if (pid == 0) {
+        if (input_fd >= 0) { dup2(input_fd, STDIN_FILENO); close(input_fd); }
+        if (output_fd >= 0) { dup2(output_fd, STDOUT_FILENO); close(output_fd); }
+        if (unused_fd >= 0) close(unused_fd);
+        Token stage_tokens[MAX_ARGS + 1];
+        int stage_token_count = num_tokens < MAX_ARGS ? num_tokens : MAX_ARGS;
+        memcpy(stage_tokens, tokens, stage_token_count * sizeof(Token));
+        stage_tokens[stage_token_count] = (Token){ .type = TOKEN_EOF, .text = "EOF", .len = 3 };
+        execute_tokenized_line(stage_tokens, stage_token_count + 1, NULL, NULL, tokens[0].line, STATE_NORMAL);
+        exit_shell_child();
+    }
+    if (pid < 0) perror("fork failed for pipeline stage");
+    return pid;
+}
+
+void handle_sigchld(int signo) {
+    (void)signo;
+    child_status_changed = 1;
+}
+
+// Forks a copy of the shell to run a function call or builtin. In the child the
+// parent's jobs are forgotten and $LAST_COMMAND_STATUS starts at 0, so the status it
+// exits with (see exit_shell_child) comes only from what the child itself ran.
+pid_t fork_shell_child() {
+    fflush(NULL); // Or buffered output would be written by both processes
+    pid_t pid = fork();
+    if (pid == 0) {
+        free_job_list(); // The parent's jobs are not this process's children
+        set_variable_scoped("LAST_COMMAND_STATUS", "0", false);
     }
-    return -1; 
+    return pid;
+}
+
+void exit_shell_child() {
+    const char *status_str = get_variable_scoped("LAST_COMMAND_STATUS");
+    fflush(NULL);
+    _exit(status_str ? atoi(status_str) : 0);
+}
+
+// Runs 'tokens' (the line without its '&') as job $LAST_JOB_ID. External commands and
+// pipelines are launched directly; function calls and builtins run in a forked copy
+// of the shell whose exit status is their $LAST_COMMAND_STATUS.
+void start_background_job(Token *tokens, int num_tokens, TokenizedLine *call_site, FILE *input_source) {
+    if (num_tokens == 0 || tokens[0].type != TOKEN_WORD) {
+        fprintf(stderr, "bsh: only commands and function calls can run in the background\n");
+        return;
+    }
+    KeywordEntry *keyword = find_keyword_entry(tokens[0].text);
+    if (keyword && keyword->builtin && keyword->builtin->block_handler) {
+        fprintf(stderr, "bsh: '%s' cannot run in the background\n", tokens[0].text);
+        return;
+    }
+
+    Job *job = (Job*)calloc(1, sizeof(Job));
+    if (!job) { perror("calloc for job failed"); return; }
+    bool in_process = (keyword && keyword->builtin) || resolve_call_site_function(call_site, tokens[0].text);
+    if (!in_process) {
+        job->pid_count = start_pipeline(tokens, num_tokens, job->pids);
+        if (job->pid_count < 0) { free(job); return; }
+    } else {
+        pid_t pid = fork_shell_child();
+        if (pid == 0) {
+            Token line_tokens[MAX_ARGS + 1];
+            int line_token_count = num_tokens < MAX_ARGS ? num_tokens : MAX_ARGS;
+            memcpy(line_tokens, tokens, line_token_count * sizeof(Token));
+            line_tokens[line_token_count] = (Token){ .type = TOKEN_EOF, .text = "EOF", .len = 3 };
+            execute_tokenized_line(line_tokens, line_token_count + 1, call_site, input_source, tokens[0].line, STATE_NORMAL);
+            exit_shell_child();
+        }
+        if (pid < 0) perror("fork failed for background job");
+        job->pids[0] = pid;
+        job->pid_count = 1;
+    }
+    for (int s = 0; s < job->pid_count; s++) {
+        if (job->pids[s] >= 0) job->running_count++;
+    }
+    job->status = job->pids[job->pid_count - 1] >= 0 ? 0 : 127;
+
+    StringBuilder command_text = {0};
+    for (int i = 0; i < num_tokens; i++) {
+        if (i > 0) string_builder_append(&command_text, " ", 1);
+        string_builder_append(&command_text, tokens[i].text, strlen(tokens[i].text));
+    }
+    job->command = command_text.data ? command_text.data : strdup("");
+    job->id = next_job_id++;
+    Job **link = &job_list_head;
+    while (*link) link = &(*link)->next;
+    *link = job;
+
+    char id_str[12];
+    snprintf(id_str, sizeof(id_str), "%d", job->id);
+    set_variable_scoped("LAST_JOB_ID", id_str, false);
+}
+
+// Collects every background child that has exited, without blocking.
+void reap_background_jobs() {
+    child_status_changed = 0;
+    for (Job *job = job_list_head; job; job = job->next) {
+        for (int s = 0; s < job->pid_count && job->running_count > 0; s++) {
+            int status;
+            if (job->pids[s] < 0 || waitpid(job->pids[s], &status, WNOHANG) <= 0) continue;
+            if (s == job->pid_count - 1) job->status = exit_code_from_wait_status(status);
+            job->pids[s] = -1;
+            job->running_count--;
+        }
+    }
+}
+
+// Blocks until every process of 'job' has exited; records the result in
+// $JOB_STATUS[id] and returns it.
+int wait_for_job(Job *job) {
+    for (int s = 0; s < job->pid_count; s++) {
+        if (job->pids[s] < 0) continue;
+        int status;
+        pid_t waited;
+        do { waited = waitpid(job->pids[s], &status, 0); } while (waited < 0 && errno == EINTR);
+        if (s == job->pid_count - 1) job->status = waited < 0 ? 127 : exit_code_from_wait_status(status);
+        job->pids[s] = -1;
+        job->running_count--;
+    }
+    char id_str[12], status_str[12];
+    snprintf(id_str, sizeof(id_str), "%d", job->id);
+    snprintf(status_str, sizeof(status_str), "%d", job->status);
+    set_array_element_scoped("JOB_STATUS", id_str, status_str);
+    return job->status;
+}
+
+void remove_job(Job *job) {
+    Job **link = &job_list_head;
+    while (*link && *link != job) link = &(*link)->next;
+    if (*link) *link = job->next;
+    free(job->command);
+    free(job);
+}
+
+// Forgets all jobs without waiting for them.
+void free_job_list() {
+    while (job_list_head) remove_job(job_list_head);
+}
+
+void* native_map_worker(void *arg) {
+    NativeMapContext *ctx = (NativeMapContext*)arg;
+    char output_buffer[INPUT_BUFFER_SIZE];
+    int index;
+    while ((index = __atomic_fetch_add(&ctx->next_index, 1, __ATOMIC_RELAXED)) < ctx->count) {
+        char *argv[2] = { ctx->elements[index], NULL };
+        output_buffer[0] = '\0';
+        ctx->statuses[index] = ctx->func(1, argv, output_buffer, sizeof(output_buffer));
+        ctx->results[index] = strdup(output_buffer);
+    }
+    return NULL;
+}
+
+// Calls a library function once per element on up to 'worker_count' threads. The
+// function must not touch shell state. Returns the first non-zero status, or 0.
+int run_native_map(BshLibFunction func, char **elements, char **results, int count, int worker_count) {
+    int *statuses = (int*)calloc(count > 0 ? count : 1, sizeof(int));
+    pthread_t *threads = (pthread_t*)malloc(worker_count * sizeof(pthread_t));
+    if (!statuses || !threads) { perror("malloc for parallel_map threads failed"); free(statuses); free(threads); return 1; }
+    NativeMapContext ctx = { func, elements, results, statuses, count, 0 };
+
+    int started = 0;
+    while (started < worker_count && started < count &&
+           pthread_create(&threads[started], NULL, native_map_worker, &ctx) == 0) {
+        started++;
+    }
+    if (started == 0) native_map_worker(&ctx); // No threads available: run inline
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+
+    int first_failure = 0;
+    for (int i = 0; i < count && first_failure == 0; i++) first_failure = statuses[i];
+    free(statuses);
+    free(threads);
+    return first_failure;
+}
+
+// Runs 'func' (in a forked copy of the shell) or the external command at
+// 'command_path' once per element, at most 'worker_count' at a time, and stores each
+// one's stdout (trailing newlines dropped) in results[]. Returns the first non-zero
+// exit status in element order, or 0.
+int run_process_map(UserFunction *func, const char *command_path, char **elements, char **results, int count, int worker_count) {
+    MapWorker *workers = (MapWorker*)calloc(worker_count, sizeof(MapWorker));
+    struct pollfd *poll_fds = (struct pollfd*)calloc(worker_count, sizeof(struct pollfd));
+    int *statuses = (int*)calloc(count > 0 ? count : 1, sizeof(int));
+    if (!workers || !poll_fds || !statuses) {
+        perror("calloc for parallel_map workers failed");
+        free(workers); free(poll_fds); free(statuses);
+        return 1;
+    }
+    for (int w = 0; w < worker_count; w++) workers[w].output_fd = -1;
+
+    int next_index = 0, active = 0;
+    char read_buf[INPUT_BUFFER_SIZE * 4];
+    while (next_index < count || active > 0) {
+        // Fill free slots
+        for (int w = 0; w < worker_count && next_index < count; w++) {
+            if (workers[w].output_fd >= 0) continue;
+            int index = next_index++;
+            int pipefd[2];
+            if (!open_cloexec_pipe(pipefd)) { perror("pipe failed for parallel_map"); statuses[index] = 127; continue; }
+            pid_t pid;
+            if (func) {
+                pid = fork_shell_child();
+                if (pid == 0) {
+                    dup2(pipefd[1], STDOUT_FILENO);
+                    const char *arg_values[1] = { elements[index] };
+                    execute_user_function_with_values(func, arg_values, 1, true);
+                    exit_shell_child();
+                }
+            } else {
+                char *args[3] = { (char*)command_path, elements[index], NULL };
+                pid = launch_external_command((char*)command_path, args, -1, pipefd[1], false);
+            }
+            close(pipefd[1]);
+            if (pid < 0) { close(pipefd[0]); statuses[index] = 127; continue; }
+            workers[w] = (MapWorker){ pid, pipefd[0], index, {0} };
+            active++;
+        }
+        if (active == 0) continue;
+
+        // Drain whichever children have output (or have exited)
+        int polled = 0;
+        for (int w = 0; w < worker_count; w++) {
+            if (workers[w].output_fd < 0) continue;
+            poll_fds[polled].fd = workers[w].output_fd;
+            poll_fds[polled].events = POLLIN;
+            poll_fds[polled].revents = 0;
+            polled++;
+        }
+        if (poll(poll_fds, polled, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed for parallel_map");
+            break;
+        }
+        for (int w = 0, p = 0; w < worker_count; w++) {
+            MapWorker *worker = &workers[w];
+            if (worker->output_fd < 0) continue;
+            if (!poll_fds[p++].revents) continue;
+            ssize_t bytes_read = read(worker->output_fd, read_buf, sizeof(read_buf));
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read > 0) { string_builder_append(&worker->output, read_buf, (size_t)bytes_read); continue; }
+
+            close(worker->output_fd);
+            worker->output_fd = -1;
+            int status;
+            while (waitpid(worker->pid, &status, 0) < 0 && errno == EINTR) {}
+            statuses[worker->index] = exit_code_from_wait_status(status);
+            StringBuilder *output = &worker->output;
+            while (output->length > 0 && output->data[output->length - 1] == '\n') output->data[--output->length] = '\0';
+            results[worker->index] = output->data ? output->data : strdup("");
+            active--;
+        }
+    }
+
+    int first_failure = 0;
+    for (int i = 0; i < count && first_failure == 0; i++) first_failure = statuses[i];
+    free(workers);
+    free(poll_fds);
+    free(statuses);
+    return first_failure;
+}
+
+// Fills 'args' (MAX_ARGS + 1 slots) with the expanded words of a command line, up to
+// the end of line or a comment, NULL-terminated. Tokens written without space between
+// them form one word, so '-l', 'x-y' or '--name="a b"' stay single arguments even when
+// the tokenizer splits them around operator characters. Returns the count; free with
+// free_command_argv.
+int build_command_argv(Token *tokens, int num_tokens, char **args) {
+    int arg_count = 0;
+    for (int i = 0; i < num_tokens && arg_count < MAX_ARGS; i++) {
+        if (tokens[i].type == TOKEN_EOF || tokens[i].type == TOKEN_COMMENT) break;
+        char expanded_arg[INPUT_BUFFER_SIZE];
+        size_t arg_len = 0;
+        expanded_arg[0] = '\0';
+        for (;; i++) {
+            expand_word_token(&tokens[i], expanded_arg + arg_len, sizeof(expanded_arg) - arg_len);
+            arg_len += strlen(expanded_arg + arg_len);
+            if (i + 1 >= num_tokens || tokens[i + 1].type == TOKEN_EOF || tokens[i + 1].type == TOKEN_COMMENT ||
+                !tokens_touch(&tokens[i], &tokens[i + 1])) break;
+        }
+        if (!(args[arg_count] = strdup(expanded_arg))) { perror("strdup for command argument failed"); break; }
+        arg_count++;
+    }
+    args[arg_count] = NULL;
+    return arg_count;
+}
+
+void free_command_argv(char **args, int arg_count) {
+    for (int i = 0; i < arg_count; i++) free(args[i]);
 }
 
 void execute_user_function(UserFunction* func, Token* call_arg_tokens, int call_arg_token_count, FILE* input_source_for_context) {
@@ -3279,20 +7287,71 @@ void execute_user_function(UserFunction* func, Token* call_arg_tokens, int call_
         }
     }
 
+    run_user_function_body(func);
+    leave_function_scope(function_scope_id, true);
+}
+
+// Calls 'func' with already-evaluated argument strings, bound to its parameters
+// as-is (no unescaping or variable expansion). Used by operator handler calls, which
+// pass is_command_call = false so the handler's last status stays out of the caller.
+void execute_user_function_with_values(UserFunction* func, const char *arg_values[], int arg_count, bool is_command_call) {
+    if (!func) return;
+    int function_scope_id = enter_scope();
+    if (function_scope_id == -1) { return; }
+
+    for (int i = 0; i < func->param_count; ++i) {
+        set_variable_scoped(func->params[i], i < arg_count ? arg_values[i] : "", false);
+    }
+
+    run_user_function_body(func);
+    leave_function_scope(function_scope_id, is_command_call);
+}
+
+// Leaves a function's scope. The status of the last command the body ran is stored in
+// the function's own frame; for a command-level call it is copied out to the caller as
+// the call's status.
+void leave_function_scope(int function_scope_id, bool propagate_status) {
+    char status_str[12] = "";
+    Variable *status = NULL;
+    if (propagate_status) {
+        status = find_variable_in_frame(&scope_stack[scope_stack_top], "LAST_COMMAND_STATUS",
+                                        hash_variable_name("LAST_COMMAND_STATUS"));
+    }
+    if (status) snprintf(status_str, sizeof(status_str), "%s", status->value);
+    leave_scope(function_scope_id);
+    if (status_str[0]) set_variable_scoped("LAST_COMMAND_STATUS", status_str, false);
+}
+
+// Runs func's body in the (already entered) function scope, restoring the caller's
+// block stack and execution state afterwards.
+void run_user_function_body(UserFunction* func) {
     int func_outer_block_stack_top_bf = block_stack_top_bf;
     ExecutionState func_outer_exec_state = current_exec_state;
     current_exec_state = STATE_NORMAL; 
 
-    for (int i = 0; i < func->line_count; ++i) {
-        char line_copy[MAX_LINE_LENGTH]; 
-        strncpy(line_copy, func->body[i], MAX_LINE_LENGTH-1); line_copy[MAX_LINE_LENGTH-1] = '\0';
-        process_line(line_copy, NULL, i + 1, STATE_NORMAL); 
+    // Operators defined since the last call make the cached tokens stale. Rebuild them
+    // only when no outer call of this function is still using them.
+    if (func->active_calls == 0 && func->tokenized_body && func->line_count > 0 &&
+        func->tokenized_body[0].op_epoch != operator_table_epoch) {
+        build_function_token_cache(func);
+    }
+    if (bsh_engine_mode == ENGINE_VM && !func->compiled_body && !func->compile_failed) {
+        func->compiled_body = compile_bytecode_program(func->body, func->line_count, func->name);
+        func->compile_failed = (func->compiled_body == NULL);
     }
+    func->active_calls++;
+
+    if (bsh_engine_mode == ENGINE_VM && func->compiled_body) {
+        run_bytecode_program(func->compiled_body, STATE_NORMAL);
+    } else {
+        // Stale lines may only be re-tokenized in place if no outer call is using them.
+        execute_line_sequence(func->body, func->tokenized_body, func->line_count, func->active_calls == 1, STATE_NORMAL);
+    }
+
+    func->active_calls--;
 
     while(block_stack_top_bf > func_outer_block_stack_top_bf) {
         pop_block_bf();
     }
     current_exec_state = func_outer_exec_state;
-
-    leave_scope(function_scope_id); 
 }
\ No newline at end of file